@@ -29,7 +29,8 @@ ipset_error_quark();
 
 typedef enum
 {
-    IPSET_ERROR_PARSE_ERROR
+    IPSET_ERROR_PARSE_ERROR,
+    IPSET_ERROR_OUT_OF_MEMORY
 } IpsetError;
 
 
@@ -103,200 +104,1355 @@ typedef gint  ipset_range_t;
 /**
  * An identifier for each distinct node in a BDD.
  *
- * Internal implementation note.  Since pointers are aligned to at
- * least two bytes, the ID of a terminal node has its LSB set to 1,
- * and has the terminal value stored in the remaining bits.  The ID of
- * a nonterminal node is simply a pointer to the node struct.
+ * Internal implementation note.  Node IDs are 32-bit integers.  The
+ * ID of a terminal node has its LSB set to 1, and has the terminal
+ * value stored in the remaining bits.  The ID of a nonterminal node
+ * has its LSB set to 0, has a complement bit in the next bit, and has
+ * the index of the node in its node cache's arena stored in the
+ * remaining bits.  Index 0 is never used, so an ID of 0 never refers
+ * to a valid node.
+ *
+ * If the complement bit is set, the ID refers to the negation of the
+ * node's Boolean function.  This lets a set and its complement share
+ * all of their nodes.  Complemented IDs only ever refer to nodes
+ * whose terminals are all 0 or 1.  The complement bit is in the same
+ * position as the lowest bit of a terminal's value, so flipping it
+ * turns the FALSE terminal into TRUE, and vice versa.
+ */
+
+typedef guint32  ipset_node_id_t;
+
+
+/**
+ * The bit of a node ID that marks a complemented reference.
+ */
+
+#define IPSET_NODE_COMPLEMENT_BIT  ((ipset_node_id_t) 2)
+
+
+/**
+ * Return the negation of a Boolean BDD.  This is a constant-time
+ * operation, since the negation shares all of its nodes with the
+ * original.  The result is undefined if the BDD has any terminal
+ * other than 0 or 1.
+ */
+
+#define ipset_node_not(node_id) \
+    ((ipset_node_id_t) ((node_id) ^ IPSET_NODE_COMPLEMENT_BIT))
+
+
+/**
+ * Return the uncomplemented ID of a nonterminal node.
+ */
+
+#define ipset_node_regular(node_id) \
+    ((ipset_node_id_t) ((node_id) & ~IPSET_NODE_COMPLEMENT_BIT))
+
+
+/**
+ * A node ID that doesn't refer to any node.
+ */
+
+#define IPSET_NULL_NODE  ((ipset_node_id_t) 0)
+
+
+/**
+ * Nodes can either be terminal or nonterminal.
+ */
+
+typedef enum ipset_node_type
+{
+    IPSET_TERMINAL_NODE,
+    IPSET_NONTERMINAL_NODE
+} ipset_node_type_t;
+
+
+/**
+ * Return the type of node represented by a particular node ID.
+ */
+
+ipset_node_type_t
+ipset_node_get_type(ipset_node_id_t node);
+
+
+/* forward declaration */
+
+typedef struct ipset_node_cache  ipset_node_cache_t;
+typedef struct ipset_apply_pool  ipset_apply_pool_t;
+
+
+/**
+ * Return the number of nodes that are reachable from the given node.
+ * This does not include duplicates if a node is reachable via more
+ * than one path.
+ */
+
+gsize
+ipset_node_reachable_count(ipset_node_cache_t *cache,
+                           ipset_node_id_t node);
+
+
+/**
+ * Return the amount of memory used by the nodes in the given BDD.
+ */
+
+gsize
+ipset_node_memory_size(ipset_node_cache_t *cache,
+                       ipset_node_id_t node);
+
+
+/**
+ * Return whether there's no assignment of the variables for which
+ * both BDDs have a nonzero value (for Boolean BDDs, whether their AND
+ * is FALSE).  This walks both BDDs at once, and stops as soon as it
+ * finds an overlap; it never creates any nodes, or touches the
+ * computed table.  Since a Boolean BDD's complement is free, this
+ * also tests implication: f implies g when f and ¬g are disjoint.
+ */
+
+gboolean
+ipset_node_is_disjoint(ipset_node_cache_t *cache,
+                       ipset_node_id_t lhs,
+                       ipset_node_id_t rhs);
+
+
+/**
+ * An unsigned 128-bit count, split into two 64-bit halves.
+ */
+
+typedef struct ipset_node_count
+{
+    guint64  high;
+    guint64  low;
+
+} ipset_node_count_t;
+
+
+/**
+ * Add, subtract, and compare counts.  Addition and subtraction wrap
+ * around modulo 2^128.
+ */
+
+ipset_node_count_t
+ipset_node_count_add(ipset_node_count_t a, ipset_node_count_t b);
+
+ipset_node_count_t
+ipset_node_count_sub(ipset_node_count_t a, ipset_node_count_t b);
+
+gboolean
+ipset_node_count_less(ipset_node_count_t a, ipset_node_count_t b);
+
+
+/**
+ * Count the assignments of the variables from first_variable through
+ * last_variable (inclusive) for which a BDD has a nonzero value.  The
+ * BDD shouldn't test any variables outside of that range.  Any
+ * variable that a path skips over can take on either value, so it
+ * doubles the number of assignments along that path.  Each node's
+ * count is computed once, no matter how often it's shared.  A count
+ * that doesn't fit into 128 bits saturates at 2^128 - 1.
+ */
+
+ipset_node_count_t
+ipset_node_path_count(ipset_node_cache_t *cache,
+                      ipset_node_id_t node,
+                      ipset_variable_t first_variable,
+                      ipset_variable_t last_variable);
+
+
+/**
+ * Remembers the path counts of the nodes that it has seen, so that
+ * several questions about the same BDD only have to count each node
+ * once.  The counter is only valid while none of the nodes that it
+ * has seen are reclaimed.
+ */
+
+typedef struct ipset_node_counter
+{
+    /**
+     * The node cache that the BDDs live in.
+     */
+
+    ipset_node_cache_t  *cache;
+
+    /**
+     * The last variable that we count assignments for.
+     */
+
+    ipset_variable_t  last_variable;
+
+    /**
+     * The path count of each nonterminal that we've seen.
+     */
+
+    GHashTable  *memo;
+
+} ipset_node_counter_t;
+
+
+/**
+ * Initialize a counter for variables up through last_variable.
+ */
+
+void
+ipset_node_counter_init(ipset_node_counter_t *counter,
+                        ipset_node_cache_t *cache,
+                        ipset_variable_t last_variable);
+
+
+/**
+ * Free the memory used by a counter.
+ */
+
+void
+ipset_node_counter_done(ipset_node_counter_t *counter);
+
+
+/**
+ * Count the assignments of the variables from first_variable through
+ * the counter's last variable for which a BDD has a nonzero value.
+ * This is the same as ipset_node_path_count().
+ */
+
+ipset_node_count_t
+ipset_node_counter_count(ipset_node_counter_t *counter,
+                         ipset_node_id_t node,
+                         ipset_variable_t first_variable);
+
+
+/**
+ * Find the index'th assignment (counting from 0) for which a BDD has
+ * a nonzero value, with assignments ordered as big-endian binary
+ * numbers.  The value of each variable is stored into the assignment
+ * bit array, with first_variable in bit 0.  Once each node's count
+ * is known, this takes one step per variable.  Returns FALSE if
+ * there aren't that many assignments.
+ */
+
+gboolean
+ipset_node_counter_select(ipset_node_counter_t *counter,
+                          ipset_node_id_t node,
+                          ipset_variable_t first_variable,
+                          ipset_node_count_t index,
+                          gpointer assignment);
+
+
+/**
+ * Count the assignments, in the same order as
+ * ipset_node_counter_select(), that come before the given one and
+ * for which a BDD has a nonzero value.
+ */
+
+ipset_node_count_t
+ipset_node_counter_rank(ipset_node_counter_t *counter,
+                        ipset_node_id_t node,
+                        ipset_variable_t first_variable,
+                        gpointer assignment);
+
+
+/*-----------------------------------------------------------------------
+ * Terminal nodes
+ */
+
+/**
+ * Return the value of a terminal node.  The result is undefined if
+ * the node ID represents a nonterminal.
+ */
+
+ipset_range_t
+ipset_terminal_value(ipset_node_id_t node_id);
+
+
+/*-----------------------------------------------------------------------
+ * Nonterminal nodes
+ */
+
+/**
+ * A nonterminal BDD node.  This is an inner node of the BDD tree.
+ * The node represents one variable in an overall variable assignment.
+ * The node has two children: a “low” child and a “high” child.  The
+ * low child is the subtree that applies when the node's variable is
+ * false or 0; the high child is the subtree that applies when it's
+ * true or 1.
+ *
+ * This type does not take care of ensuring that all BDD nodes are
+ * reduced; that is handled by the node_cache_t class.
+ *
+ * Since the children are referred to by 32-bit IDs, and we never need
+ * more than 8 bits for a variable number (an IPv6 address only needs
+ * 129 variables), each node fits into 12 bytes, with room left over
+ * for the node's reference count.
+ */
+
+typedef struct ipset_node
+{
+    /**
+     * The variable that this node represents.
+     */
+
+    guint32  variable:8;
+
+    /**
+     * Whether this node has been released, and its slot in the node
+     * arena is waiting to be reused.
+     */
+
+    guint32  released:1;
+
+    /**
+     * Whether every terminal reachable from this node is 0 or 1.
+     * Only these nodes can be referred to by a complemented ID.
+     */
+
+    guint32  boolean:1;
+
+    /**
+     * The number of references to this node, from parent nodes and
+     * from the roots of sets and maps.  Once the count reaches
+     * IPSET_NODE_MAX_REFCOUNT, it sticks there, and the node is never
+     * released.
+     */
+
+    guint32  refcount:22;
+
+    /**
+     * The subtree node for when the variable is false.  This is never
+     * a complemented ID; see ipset_node_cache_nonterminal().
+     */
+
+    ipset_node_id_t  low;
+
+    /**
+     * The subtree node for when the variable is true.
+     */
+
+    ipset_node_id_t  high;
+
+} ipset_node_t;
+
+/**
+ * The largest reference count that a node can hold.
+ */
+
+#define IPSET_NODE_MAX_REFCOUNT  ((1u << 22) - 1)
+
+/**
+ * Return the low and high subtrees of a nonterminal, as seen through
+ * a (possibly complemented) ID for the node.  If the ID is
+ * complemented, so are the subtrees.
+ */
+
+#define ipset_node_low(node, node_id) \
+    ((ipset_node_id_t) ((node)->low ^ \
+                        ((node_id) & IPSET_NODE_COMPLEMENT_BIT)))
+
+#define ipset_node_high(node, node_id) \
+    ((ipset_node_id_t) ((node)->high ^ \
+                        ((node_id) & IPSET_NODE_COMPLEMENT_BIT)))
+
+/**
+ * The number of distinct variables that a nonterminal can test.
+ */
+
+#define IPSET_VARIABLE_COUNT  (1u << 8)
+
+
+/**
+ * Print out a node object.
+ */
+
+void
+ipset_node_fprint(FILE *stream, ipset_node_t *node);
+
+/**
+ * Return a hash value for a node.
+ */
+
+guint
+ipset_node_hash(ipset_node_t *node);
+
+/**
+ * Return a 64-bit hash value for the contents of a nonterminal.
+ */
+
+guint64
+ipset_node_hash64(ipset_variable_t variable,
+                  ipset_node_id_t low,
+                  ipset_node_id_t high);
+
+/**
+ * Test two nodes for equality.
+ */
+
+gboolean
+ipset_node_equal(const ipset_node_t *node1,
+                 const ipset_node_t *node2);
+
+
+/*-----------------------------------------------------------------------
+ * Computed tables
+ */
+
+/**
+ * The BDD operations that are memoized in a node cache's computed
+ * table.
+ */
+
+typedef enum ipset_op
+{
+    IPSET_OP_AND = 0,
+    IPSET_OP_OR,
+    IPSET_OP_XOR,
+    IPSET_OP_ITE,
+    IPSET_OP_EXISTS,
+    IPSET_OP_RESTRICT,
+    IPSET_OP_COMBINE,
+    IPSET_OP_MAP,
+    IPSET_OP_COUNT
+} ipset_op_t;
+
+/**
+ * The key for an entry in a computed table: an operation and its
+ * operands.  Binary operations leave h set to IPSET_NULL_NODE.  For
+ * EXISTS, f is the BDD, and g is the first variable to quantify away,
+ * rather than a node.  For RESTRICT, f is the BDD, and g is the care
+ * set.  For COMBINE, f and g are the operands, and h is a token that
+ * identifies the call, since each call can use a different combiner.
+ * MAP is the same, but with only one operand, in f.
+ */
+
+typedef struct ipset_op_key
+{
+    ipset_node_id_t  f;
+    ipset_node_id_t  g;
+    ipset_node_id_t  h;
+    guint32  op;
+} ipset_op_key_t;
+
+/**
+ * Return a hash value for a computed table key.
+ */
+
+guint64
+ipset_op_key_hash(const ipset_op_key_t *key);
+
+/**
+ * Test two computed table keys for equality.
+ */
+
+gboolean
+ipset_op_key_equal(const ipset_op_key_t *key1,
+                   const ipset_op_key_t *key2);
+
+/**
+ * An entry in a node cache's computed table, which memoizes the
+ * results of every BDD operation.  The computed table is
+ * direct-mapped and lossy: each key can only live in one entry, and a
+ * new result simply overwrites whatever was there before, even if it
+ * belongs to a different operation.  An entry is only valid if its
+ * epoch matches the node cache's current epoch, which lets us throw
+ * away every entry at once by bumping the epoch.
+ */
+
+typedef struct ipset_op_entry
+{
+    ipset_op_key_t  key;
+    ipset_node_id_t  result;
+    guint32  epoch;
+} ipset_op_entry_t;
+
+/**
+ * An operation that the apply engine is in the middle of computing.
+ * The engine doesn't recurse; instead, it keeps a stack of these
+ * frames, one for each level of the BDDs that it's currently working
+ * on.
+ */
+
+typedef struct ipset_apply_frame
+{
+    /**
+     * The (normalized) operation and operands, and the computed table
+     * slot where the result will be stored.
+     */
+
+    ipset_op_key_t  key;
+    guint32  slot;
+
+    /**
+     * The variable that we're splitting the operands on.
+     */
+
+    ipset_variable_t  variable;
+
+    /**
+     * The operands for the high half of the result, which we work on
+     * once the low half is done.
+     */
+
+    ipset_node_id_t  high[3];
+
+    /**
+     * The result for the low half, or IPSET_NULL_NODE if we're still
+     * working on it.
+     */
+
+    ipset_node_id_t  low_result;
+
+    /**
+     * Whether this frame chains two operations together instead of
+     * splitting one in half.  A chained frame's first operation
+     * computes an operand of its second one, whose result is the
+     * frame's result as is.  RESTRICT uses this to merge the halves of
+     * its care set.
+     */
+
+    gboolean  chained;
+} ipset_apply_frame_t;
+
+/**
+ * The default number of entries in a node cache's computed table.
+ */
+
+#define IPSET_DEFAULT_OP_CACHE_SIZE  (1u << 17)
+
+/**
+ * The default and largest number of levels that a parallel BDD
+ * operation splits into tasks.  Each level can double the number of
+ * tasks.
+ */
+
+#define IPSET_DEFAULT_PARALLEL_DEPTH  8
+#define IPSET_MAX_PARALLEL_DEPTH  16
+
+/**
+ * The smallest computed table that each thread of a parallel BDD
+ * operation gets.
+ */
+
+#define IPSET_MIN_WORKER_OP_CACHE_SIZE  (1u << 10)
+
+/**
+ * The default number of nodes that each operand of an operation needs
+ * before the operation is spread across several threads.
+ */
+
+#define IPSET_DEFAULT_PARALLEL_MIN_NODES  (1u << 12)
+
+
+/*-----------------------------------------------------------------------
+ * Node caches
+ */
+
+/**
+ * The number of nodes in the first chunk of a node cache's arena.
+ * Each subsequent chunk is twice as large as the previous one.
+ */
+
+#define IPSET_NODE_CHUNK_BASE_BITS  10
+#define IPSET_NODE_CHUNK_BASE_SIZE  (1u << IPSET_NODE_CHUNK_BASE_BITS)
+
+/**
+ * The maximum number of chunks in a node cache's arena.  This is
+ * enough to hold every index that fits into a node ID.
+ */
+
+#define IPSET_NODE_CHUNK_COUNT  (32 - IPSET_NODE_CHUNK_BASE_BITS)
+
+/**
+ * The number of payloads in the first chunk of a node cache's payload
+ * dictionary.  Each subsequent chunk is twice as large as the
+ * previous one.
+ */
+
+#define IPSET_PAYLOAD_CHUNK_BASE_BITS  6
+#define IPSET_PAYLOAD_CHUNK_BASE_SIZE  (1u << IPSET_PAYLOAD_CHUNK_BASE_BITS)
+
+/**
+ * The maximum number of chunks in a payload dictionary.  This is
+ * enough to hold every non-negative terminal value.
+ */
+
+#define IPSET_PAYLOAD_CHUNK_COUNT  (32 - IPSET_PAYLOAD_CHUNK_BASE_BITS)
+
+/**
+ * One slot in a unique table.  The contents of the node are stored
+ * inline, so that a lookup never has to leave the table to compare
+ * keys.
+ */
+
+typedef struct ipset_unique_slot
+{
+    /**
+     * The ID of the node in this slot.  IPSET_NULL_NODE marks a slot
+     * that has never been used.  Since nonterminal IDs are always
+     * even, we use an odd value to mark a slot whose node has been
+     * removed.
+     */
+
+    ipset_node_id_t  id;
+
+    /**
+     * The contents of the node in this slot.
+     */
+
+    guint32  variable;
+    ipset_node_id_t  low;
+    ipset_node_id_t  high;
+
+} ipset_unique_slot_t;
+
+#define IPSET_UNIQUE_TOMBSTONE  ((ipset_node_id_t) 1)
+
+/**
+ * In a concurrent cache, a thread that's adding a node to the unique
+ * table marks the node's slot with this (odd) value until it has
+ * filled in the slot's contents.
+ */
+
+#define IPSET_UNIQUE_BUSY  ((ipset_node_id_t) 3)
+
+/**
+ * An open-addressing hash table, with linear probing, that maps the
+ * contents of a nonterminal to its ID.
+ */
+
+typedef struct ipset_unique_table
+{
+    /**
+     * The slots of the table.  The number of slots is always a power
+     * of two.
+     */
+
+    ipset_unique_slot_t  *slots;
+
+    /**
+     * The number of slots in the table.
+     */
+
+    guint32  capacity;
+
+    /**
+     * The number of slots that hold a node.
+     */
+
+    guint32  live_count;
+
+    /**
+     * The number of slots that hold a node or a tombstone.  This is
+     * what determines how long probe sequences get.
+     */
+
+    guint32  used_count;
+
+} ipset_unique_table_t;
+
+/**
+ * The initial number of slots in a unique table.
+ */
+
+#define IPSET_UNIQUE_INITIAL_CAPACITY  1024
+
+/**
+ * The number of old slots that we migrate into a resized unique
+ * table each time we add a node.
+ */
+
+#define IPSET_UNIQUE_MIGRATE_STEP  4
+
+/**
+ * Counters that track how well a node cache's tables are working.
+ * The counters are only updated if the library is built with
+ * IPSET_CACHE_STATS defined; otherwise they stay at 0, and updating
+ * them doesn't cost anything.
+ */
+
+typedef struct ipset_node_cache_counters
+{
+    /**
+     * The number of unique table lookups that found an existing node,
+     * and the number that didn't.
+     */
+
+    guint64  unique_hits;
+    guint64  unique_misses;
+
+    /**
+     * The total number of unique table slots examined by those
+     * lookups.
+     */
+
+    guint64  unique_probes;
+
+    /**
+     * The number of computed table lookups that found a usable
+     * result, and the number that didn't, for each operation.
+     */
+
+    guint64  op_hits[IPSET_OP_COUNT];
+    guint64  op_misses[IPSET_OP_COUNT];
+
+} ipset_node_cache_counters_t;
+
+#if defined(IPSET_CACHE_STATS)
+#define IPSET_CACHE_STAT_ADD(cache, counter, n) \
+    ((cache)->counters.counter += (n))
+#else
+#define IPSET_CACHE_STAT_ADD(cache, counter, n)  ((void) 0)
+#endif
+
+#define IPSET_CACHE_STAT_INC(cache, counter) \
+    IPSET_CACHE_STAT_ADD(cache, counter, 1)
+
+/**
+ * A cache for BDD nodes.  By creating and retrieving nodes through
+ * the cache, we ensure that a BDD is reduced.
+ */
+
+struct ipset_node_cache
+{
+    /**
+     * The arena that holds the nonterminal nodes.  The arena is a
+     * sequence of chunks, each twice as large as the previous one, so
+     * that nodes never move once they've been created, and so that
+     * nodes that are created together are stored next to each other
+     * in memory.  Chunks are only allocated once they're needed.
+     */
+
+    ipset_node_t  *chunks[IPSET_NODE_CHUNK_COUNT];
+
+    /**
+     * The index of the next nonterminal node that we'll create.
+     */
+
+    guint32  next_index;
+
+    /**
+     * The arena indices of nodes that have been released, and which
+     * can be reused for new nodes.
+     */
+
+    GArray  *free_indices;
+
+    /**
+     * The arena indices of nodes that have been released, but which
+     * might still appear in the computed table.  Before reusing
+     * these, we have to flush the computed table, so that a stale
+     * cache entry can't refer to an unrelated node that happens to
+     * reuse the same index.
+     */
+
+    GArray  *pending_indices;
+
+    /**
+     * The unique table, which maps the contents of each nonterminal
+     * node to its ID.
+     */
+
+    ipset_unique_table_t  unique;
+
+    /**
+     * When the unique table grows, we don't move all of its nodes at
+     * once.  Instead, the previous table is kept here, and a few of
+     * its slots are moved over each time we add a node.  Lookups
+     * check both tables until the migration finishes.
+     */
+
+    ipset_unique_table_t  old_unique;
+
+    /**
+     * The next slot in old_unique that needs to be migrated.
+     */
+
+    guint32  migrate_index;
+
+    /**
+     * The computed table, which is shared by every BDD operation.
+     */
+
+    ipset_op_entry_t  *op_cache;
+
+    /**
+     * The number of entries in the computed table.  This is always a
+     * power of two.
+     */
+
+    guint32  op_cache_size;
+
+    /**
+     * The current epoch of the computed table.  Entries from any
+     * other epoch are ignored.
+     */
+
+    guint32  op_cache_epoch;
+
+    /**
+     * The token of the most recent operation whose terminal values
+     * come from a user-supplied function.  Each such operation gets a
+     * new token, which is part of its computed table keys.
+     */
+
+    guint32  op_token;
+
+    /**
+     * The work stack used by the apply engine.  Each frame splits on
+     * a larger variable than the one below it, so the stack never
+     * needs more than IPSET_VARIABLE_COUNT frames.
+     */
+
+    ipset_apply_frame_t  *apply_stack;
+
+    /**
+     * The number of threads that a single BDD operation can use.
+     * With 1 (the default), every operation runs on the calling
+     * thread.  Either way, the cache itself must only be used from
+     * one thread at a time.  Use ipset_node_cache_set_threads() to
+     * change this.
+     */
+
+    guint  thread_count;
+
+    /**
+     * The threads that help out with parallel operations, along with
+     * their private computed tables.  They're started by
+     * ipset_node_cache_set_threads(), and wait around between
+     * operations until the cache is freed.  NULL if thread_count
+     * is 1.
+     */
+
+    ipset_apply_pool_t  *apply_pool;
+
+    /**
+     * An operation only runs on several threads if each of its
+     * operands has at least this many nodes.  Smaller operations
+     * don't have enough work to pay for waking the threads up.
+     */
+
+    guint  parallel_min_nodes;
+
+    /**
+     * When an operation runs on several threads, the top this many
+     * levels of the result are split up into independent tasks,
+     * which the threads then share out between themselves.
+     */
+
+    guint  parallel_depth;
+
+    /**
+     * While several threads are creating nodes, a new nonterminal
+     * doesn't add references to its children right away, since that
+     * would write to nodes that other threads are reading.  Instead,
+     * the arena index of each new node is collected here, and the
+     * references are added once the threads are done.  This is NULL
+     * the rest of the time.
+     */
+
+    GArray  *deferred_nodes;
+
+    /**
+     * The set of registered roots.  Each key is a pointer to a
+     * location that holds the ID of a root node, such as the BDD
+     * field of a set or map.  The garbage collector keeps alive any
+     * node that's reachable from one of these locations.
+     */
+
+    GHashTable  *roots;
+
+    /**
+     * How many times ipset_node_cache_compact() has moved nodes.
+     * Anything that remembers node IDs without registering them as
+     * roots can check this to see whether they might have changed.
+     */
+
+    guint  compactions;
+
+    /**
+     * Once the unique table holds more than this many nodes, the
+     * next call to ipset_node_cache_collect_if_needed() runs the
+     * garbage collector.  A threshold of 0 turns off automatic
+     * collection.
+     */
+
+    gsize  gc_threshold;
+
+    /**
+     * Statistics about the cache's tables.  These are only updated
+     * if IPSET_CACHE_STATS is defined.
+     */
+
+    ipset_node_cache_counters_t  counters;
+
+    /**
+     * The maximum number of bytes that the cache's tables can use, or
+     * 0 if there's no limit.
+     */
+
+    gsize  memory_limit;
+
+    /**
+     * Whether the most recent set or map operation on this cache
+     * failed because it would have exceeded the memory limit.
+     */
+
+    gboolean  out_of_memory;
+
+    /**
+     * The payloads that map terminals can stand for.  A terminal with
+     * value i stands for payload i.  Payload 0 is always 0.  Like the
+     * arena, the payloads are stored in a sequence of chunks, each
+     * twice as large as the previous one, so that a payload never
+     * moves once it's been added.
+     */
+
+    guint64  *payload_chunks[IPSET_PAYLOAD_CHUNK_COUNT];
+
+    /**
+     * The number of payloads in the dictionary.  Payloads are never
+     * removed, and a payload is stored before this count is raised to
+     * include it, so readers can look one up without taking a lock.
+     */
+
+    gint  payload_count;
+
+    /**
+     * Maps each payload in the payloads array back to its index.
+     */
+
+    GHashTable  *payload_values;
+
+    /**
+     * Whether the cache can be used from several threads at once.
+     * See ipset_node_cache_new_concurrent().
+     */
+
+    gboolean  concurrent;
+
+    /**
+     * In a concurrent cache, every operation that creates nodes holds
+     * this lock for reading, so that any number of them can run at
+     * once.  Anything that needs the whole cache to hold still, such
+     * as the garbage collector, holds it for writing.
+     */
+
+    GRWLock  operation_lock;
+
+    /**
+     * In a concurrent cache, protects the set of registered roots and
+     * the payload dictionary's hash table, which threads can update at
+     * any time.  Reading a payload doesn't need the lock.
+     */
+
+    GMutex  table_lock;
+
+    /**
+     * In a concurrent cache, the number of entries at the start of
+     * free_indices that threads can still claim.  This goes negative
+     * once they've all been claimed.  The free list itself is only
+     * refilled while the operation lock is held for writing.
+     */
+
+    gint  shared_free_count;
+
+    /**
+     * A number that's different for each concurrent cache, so that a
+     * thread's private computed table can tell which cache its
+     * entries belong to.
+     */
+
+    guint  serial;
+
+};
+
+/**
+ * The default number of nodes that a node cache can hold before we
+ * automatically run the garbage collector.
+ */
+
+#define IPSET_DEFAULT_GC_THRESHOLD  (1u << 20)
+
+/**
+ * Convert between the ID of a nonterminal and its index in the node
+ * arena.  The complement bit is ignored.
+ */
+
+#define ipset_node_id_to_index(id)  ((guint32) ((id) >> 2))
+
+/**
+ * Convert between an index in the node arena, and the (uncomplemented)
+ * ID of the corresponding nonterminal.
+ */
+
+#define ipset_index_to_node_id(index)  ((ipset_node_id_t) ((index) << 2))
+
+/**
+ * The largest number of nonterminals that a node arena can hold.
+ */
+
+#define IPSET_NODE_MAX_INDEX  ((1u << 30) - 1)
+
+/**
+ * Return the node struct of a nonterminal node.  The result is
+ * undefined if the node ID represents a terminal.  Nodes never move
+ * once they've been created, so the pointer stays valid for as long
+ * as the node cache does.
+ */
+
+ipset_node_t *
+ipset_node_cache_get_nonterminal(ipset_node_cache_t *cache,
+                                 ipset_node_id_t node_id);
+
+/**
+ * Return whether a node ID refers to a nonterminal that has been
+ * released.  Terminals are never released.
+ */
+
+gboolean
+ipset_node_cache_is_released(ipset_node_cache_t *cache,
+                             ipset_node_id_t node_id);
+
+/**
+ * Look up a nonterminal in the cache's unique table, returning its
+ * ID, or IPSET_NULL_NODE if there isn't a node with these contents.
+ */
+
+ipset_node_id_t
+ipset_node_cache_unique_lookup(ipset_node_cache_t *cache,
+                               ipset_variable_t variable,
+                               ipset_node_id_t low,
+                               ipset_node_id_t high);
+
+/**
+ * Add a nonterminal to the cache's unique table.  There must not
+ * already be a node with the same contents.  Returns FALSE if the
+ * table is full, and can't grow without exceeding the cache's memory
+ * limit.
+ */
+
+gboolean
+ipset_node_cache_unique_insert(ipset_node_cache_t *cache,
+                               ipset_node_id_t node_id,
+                               ipset_node_t *node);
+
+/**
+ * Remove a nonterminal from the cache's unique table.
+ */
+
+void
+ipset_node_cache_unique_remove(ipset_node_cache_t *cache,
+                               ipset_node_t *node);
+
+/**
+ * Rebuild the cache's unique table from the contents of the node
+ * arena.  This is needed whenever nodes have been moved, since that
+ * changes the contents of their parents.
+ */
+
+void
+ipset_node_cache_unique_rebuild(ipset_node_cache_t *cache);
+
+/**
+ * In a concurrent cache, look up a nonterminal in the unique table,
+ * claiming an empty slot for it if it isn't there.  This never takes
+ * a lock; threads that try to add the same node at the same time
+ * agree on which slot it goes into.  If the node already exists,
+ * returns its ID.  Otherwise, returns IPSET_NULL_NODE, and fills in
+ * slot with the claimed slot, which the caller must pass to
+ * ipset_node_cache_unique_publish() or _abandon().  If the table is
+ * too full to add a node, slot is set to NULL.
  */
 
-typedef gpointer  ipset_node_id_t;
-
+ipset_node_id_t
+ipset_node_cache_unique_claim(ipset_node_cache_t *cache,
+                              ipset_variable_t variable,
+                              ipset_node_id_t low,
+                              ipset_node_id_t high,
+                              ipset_unique_slot_t **slot);
 
 /**
- * Nodes can either be terminal or nonterminal.
+ * Fill in a unique table slot claimed by
+ * ipset_node_cache_unique_claim(), making the node visible to other
+ * threads.  The node's contents in the arena must already be filled
+ * in.
  */
 
-typedef enum ipset_node_type
-{
-    IPSET_TERMINAL_NODE,
-    IPSET_NONTERMINAL_NODE
-} ipset_node_type_t;
-
+void
+ipset_node_cache_unique_publish(ipset_node_cache_t *cache,
+                                ipset_unique_slot_t *slot,
+                                ipset_node_id_t node_id,
+                                ipset_node_t *node);
 
 /**
- * Return the type of node represented by a particular node ID.
+ * Give up on a unique table slot claimed by
+ * ipset_node_cache_unique_claim().
  */
 
-ipset_node_type_t
-ipset_node_get_type(ipset_node_id_t node);
+void
+ipset_node_cache_unique_abandon(ipset_node_cache_t *cache,
+                                ipset_unique_slot_t *slot);
+
+/**
+ * Make sure that the unique table has room for at least as many new
+ * nodes as it already holds, growing it, or clearing out its
+ * tombstones, if needed.  A concurrent cache can't grow its unique
+ * table while operations are running, so it calls this whenever the
+ * operation lock is held for writing.
+ */
 
+void
+ipset_node_cache_unique_make_room(ipset_node_cache_t *cache);
 
 /**
- * Return the number of nodes that are reachable from the given node.
- * This does not include duplicates if a node is reachable via more
- * than one path.
+ * Return the number of nonterminals in the cache's unique table.
  */
 
 gsize
-ipset_node_reachable_count(ipset_node_id_t node);
-
+ipset_node_cache_node_count(ipset_node_cache_t *cache);
 
 /**
- * Return the amount of memory used by the nodes in the given BDD.
+ * Return the number of bytes used by the cache's node arena, unique
+ * table, and computed table.
  */
 
 gsize
-ipset_node_memory_size(ipset_node_id_t node);
+ipset_node_cache_memory_usage(ipset_node_cache_t *cache);
+
+/**
+ * Return whether the cache can allocate this many more bytes without
+ * exceeding its memory limit.
+ */
 
+gboolean
+ipset_node_cache_has_room(ipset_node_cache_t *cache, gsize bytes);
 
-/*-----------------------------------------------------------------------
- * Terminal nodes
+/**
+ * Free up as much memory as we can, by shrinking the computed table
+ * and then collecting garbage.  Like ipset_node_cache_collect(), this
+ * can only be called when every node that we care about is reachable
+ * from a registered root or an external reference.
+ */
+
+void
+ipset_node_cache_trim(ipset_node_cache_t *cache);
+
+/**
+ * Free up memory when an operation fails.  This is called in the
+ * middle of a set or map operation (between ipset_node_cache_begin()
+ * and ipset_node_cache_end()), at a point where every node that we
+ * care about is reachable from a registered root.  In a normal cache,
+ * this is the same as ipset_node_cache_trim().  In a concurrent
+ * cache, it waits for the other threads' operations to finish, and
+ * then collects garbage and makes room in the unique table.
  */
 
+void
+ipset_node_cache_make_room(ipset_node_cache_t *cache);
+
 /**
- * Return the value of a terminal node.  The result is undefined if
- * the node ID represents a nonterminal.
+ * Make sure that the cache can hold at least this many nonterminals
+ * without having to grow its unique table or node arena.  This is
+ * only a hint; we stop early if we'd exceed the memory limit.
  */
 
-ipset_range_t
-ipset_terminal_value(ipset_node_id_t node_id);
+void
+ipset_node_cache_reserve(ipset_node_cache_t *cache,
+                         gsize node_count);
+
+/**
+ * Make sure that the next node_count unused slots of the cache's node
+ * arena have been allocated.  Returns FALSE if that would exceed the
+ * cache's memory limit.
+ */
 
+gboolean
+ipset_node_cache_arena_reserve(ipset_node_cache_t *cache,
+                               gsize node_count);
 
-/*-----------------------------------------------------------------------
- * Nonterminal nodes
+/**
+ * Make sure that the cache's unique table can hold at least this many
+ * nonterminals without growing.  Unlike normal growth, this moves all
+ * of the existing nodes immediately.
  */
 
+void
+ipset_node_cache_unique_reserve(ipset_node_cache_t *cache,
+                                gsize node_count);
+
 /**
- * A nonterminal BDD node.  This is an inner node of the BDD tree.
- * The node represents one variable in an overall variable assignment.
- * The node has two children: a “low” child and a “high” child.  The
- * low child is the subtree that applies when the node's variable is
- * false or 0; the high child is the subtree that applies when it's
- * true or 1.
- *
- * This type does not take care of ensuring that all BDD nodes are
- * reduced; that is handled by the node_cache_t class.
+ * A snapshot of the size and effectiveness of a node cache's tables.
  */
 
-typedef struct ipset_node
+typedef struct ipset_node_cache_stats
 {
     /**
-     * The variable that this node represents.
+     * Whether the library was built with IPSET_CACHE_STATS.  If not,
+     * the hit, miss, and probe counts are always 0.
      */
 
-    ipset_variable_t  variable;
+    gboolean  counters_enabled;
 
     /**
-     * The subtree node for when the variable is false.
+     * The number of live nonterminals, and how many of them test each
+     * variable.
      */
 
-    ipset_node_id_t  low;
+    gsize  node_count;
+    gsize  level_counts[IPSET_VARIABLE_COUNT];
 
     /**
-     * The subtree node for when the variable is true.
+     * The number of slots in the unique table (including one that's
+     * still being migrated away from), and the fraction of them that
+     * hold a live node.
      */
 
-    ipset_node_id_t  high;
+    gsize  unique_capacity;
+    double  unique_load_factor;
 
-} ipset_node_t;
+    /**
+     * Unique table lookup counts, and the average number of slots
+     * examined per lookup.
+     */
 
-/**
- * Return the node struct of a nonterminal node.  The result is
- * undefined if the node ID represents a terminal.
- */
+    guint64  unique_hits;
+    guint64  unique_misses;
+    double  unique_avg_probe_length;
 
-ipset_node_t *
-ipset_nonterminal_node(ipset_node_id_t node_id);
+    /**
+     * The number of entries in the computed table, and the hit and
+     * miss counts for each operation.
+     */
+
+    gsize  op_cache_size;
+    guint64  op_hits[IPSET_OP_COUNT];
+    guint64  op_misses[IPSET_OP_COUNT];
+
+    /**
+     * The number of bytes allocated for the node arena, the unique
+     * table, and the computed table.
+     */
+
+    gsize  arena_bytes;
+    gsize  unique_bytes;
+    gsize  op_cache_bytes;
+
+} ipset_node_cache_stats_t;
 
 /**
- * Print out a node object.
+ * Fill in a snapshot of a node cache's statistics.  This walks the
+ * whole node arena, so it isn't meant to be called often.
  */
 
 void
-ipset_node_fprint(FILE *stream, ipset_node_t *node);
+ipset_node_cache_get_stats(ipset_node_cache_t *cache,
+                           ipset_node_cache_stats_t *stats);
 
 /**
- * Return a hash value for a node.
+ * Reset a node cache's hit, miss, and probe counters to 0.
  */
 
-guint
-ipset_node_hash(ipset_node_t *node);
+void
+ipset_node_cache_reset_stats(ipset_node_cache_t *cache);
 
 /**
- * Test two nodes for equality.
+ * Initialize a unique table with the given number of slots, which
+ * must be a power of two.
  */
 
-gboolean
-ipset_node_equal(const ipset_node_t *node1,
-                 const ipset_node_t *node2);
-
+void
+ipset_unique_table_init(ipset_unique_table_t *table,
+                        guint32 capacity);
 
-/*-----------------------------------------------------------------------
- * Node caches
+/**
+ * Free the memory used by a unique table.
  */
 
+void
+ipset_unique_table_done(ipset_unique_table_t *table);
+
 /**
- * A cache for BDD nodes.  By creating and retrieving nodes through
- * the cache, we ensure that a BDD is reduced.
+ * Create a new node cache.
  */
 
-typedef struct ipset_node_cache
-{
-    /**
-     * A cache of the nonterminal nodes, keyed by their contents.
-     */
-
-    GHashTable  *node_cache;
+ipset_node_cache_t *
+ipset_node_cache_new();
 
-    /**
-     * A cache of the results of the AND operation.
-     */
+/**
+ * Create a new node cache whose computed table has room for
+ * (roughly) the given number of entries.  The size is rounded up to
+ * a power of two.
+ */
 
-    GHashTable  *and_cache;
+ipset_node_cache_t *
+ipset_node_cache_new_sized(gsize op_cache_size);
 
-    /**
-     * A cache of the results of the OR operation.
-     */
+/**
+ * Create a new node cache that can be used from several threads at
+ * once.  Nodes are added to the unique table without taking any
+ * locks, and each thread gets its own computed table, so operations
+ * in different threads don't get in each other's way.
+ *
+ * A concurrent cache doesn't keep track of reference counts, since
+ * updating them would mean writing to shared nodes.  Instead, only
+ * the nodes that are reachable from a registered root are kept alive.
+ * Nodes are never released by ipset_node_decref(); they're reclaimed
+ * by the garbage collector, which waits until no operations are
+ * running.  Every operation that creates nodes must be bracketed by
+ * ipset_node_cache_begin() and ipset_node_cache_end(), and must store
+ * its result in a registered root before it ends.
+ *
+ * The node arena isn't subject to the memory limit, and the hit,
+ * miss, and probe counters aren't updated.
+ */
 
-    GHashTable  *or_cache;
+ipset_node_cache_t *
+ipset_node_cache_new_concurrent();
 
-    /**
-     * A cache of the results of the ITE operation.
-     */
+/**
+ * Mark the start and end of an operation that creates nodes.  In a
+ * concurrent cache, this holds the operation lock for reading.  In
+ * any other cache, it does nothing.
+ */
 
-    GHashTable  *ite_cache;
+void
+ipset_node_cache_begin(ipset_node_cache_t *cache);
 
-} ipset_node_cache_t;
+void
+ipset_node_cache_end(ipset_node_cache_t *cache);
 
 /**
- * Convert between an index in the node vector, and the ID of the
- * corresponding nonterminal.  (Nonterminals have IDs < 0)
+ * In a concurrent cache, wait for every running operation to finish,
+ * and keep any new ones from starting, until
+ * ipset_node_cache_exclusive_end() is called.  This also gathers up
+ * the state that threads update on their own, so that the rest of
+ * the library can treat the cache like a normal one in between.
  */
 
-gsize
-ipset_node_id_to_index(ipset_node_id_t id);
+void
+ipset_node_cache_exclusive_begin(ipset_node_cache_t *cache);
 
 /**
- * Convert between the ID of a nonterminal and its index in the node
- * vector.  (Nonterminals have IDs < 0)
+ * Let operations run again in a concurrent cache.  Before letting
+ * them in, we make sure that there's room in the unique table, and
+ * that released nodes can be reused.
  */
 
-ipset_node_id_t
-ipset_index_to_node_id(gsize index);
+void
+ipset_node_cache_exclusive_end(ipset_node_cache_t *cache);
 
 /**
- * Create a new node cache.
+ * Free a node cache.
  */
 
-ipset_node_cache_t *
-ipset_node_cache_new();
+void
+ipset_node_cache_free(ipset_node_cache_t *cache);
 
 /**
- * Free a node cache.
+ * Set the number of threads that a single BDD operation can use,
+ * starting or stopping helper threads as needed.  This must not be
+ * called while an operation is running in the cache.
  */
 
 void
-ipset_node_cache_free(ipset_node_cache_t *cache);
+ipset_node_cache_set_threads(ipset_node_cache_t *cache,
+                             guint thread_count);
 
 /**
  * Create a new terminal node with the given value, returning its ID.
@@ -311,7 +1467,11 @@ ipset_node_cache_terminal(ipset_node_cache_t *cache,
 /**
  * Create a new nonterminal node with the given contents, returning
  * its ID.  This function ensures that there is only one node with the
- * given contents in this cache.
+ * given contents in this cache.  A newly created node holds a
+ * reference to each of its children, but has no references itself;
+ * use ipset_node_incref() to keep it alive.  Returns IPSET_NULL_NODE
+ * if either child is IPSET_NULL_NODE, or if the node can't be created
+ * without exceeding the cache's memory limit.
  */
 
 ipset_node_id_t
@@ -321,6 +1481,129 @@ ipset_node_cache_nonterminal(ipset_node_cache_t *cache,
                              ipset_node_id_t high);
 
 
+/**
+ * Add a reference to a node, returning the node's ID.  Each root of a
+ * set or map holds a reference to its node, as does each parent of a
+ * nonterminal.  Terminals aren't reference counted, so this is a
+ * no-op for them.
+ */
+
+ipset_node_id_t
+ipset_node_incref(ipset_node_cache_t *cache,
+                  ipset_node_id_t node);
+
+/**
+ * Remove a reference to a node.  If this was the last reference, the
+ * node is released, which in turn removes its references to its
+ * children.  A released node's ID must not be used again.
+ */
+
+void
+ipset_node_decref(ipset_node_cache_t *cache,
+                  ipset_node_id_t node);
+
+/**
+ * Throw away all of the memoized results of the BDD operators.
+ */
+
+void
+ipset_node_cache_flush_operations(ipset_node_cache_t *cache);
+
+
+/**
+ * Register a root location with the garbage collector.  The location
+ * must stay valid, and must always hold a valid node ID, until it's
+ * unregistered with ipset_node_cache_remove_root().
+ */
+
+void
+ipset_node_cache_add_root(ipset_node_cache_t *cache,
+                          ipset_node_id_t *root);
+
+/**
+ * Unregister a root location with the garbage collector.
+ */
+
+void
+ipset_node_cache_remove_root(ipset_node_cache_t *cache,
+                             ipset_node_id_t *root);
+
+/**
+ * Run the garbage collector, returning the number of nodes that were
+ * reclaimed.  A node survives if it's reachable from a registered
+ * root, or from a node that has more references than it has parents
+ * (which means that something outside of the node cache is holding
+ * onto it).  Every other nonterminal is removed from the unique
+ * table, and any computed table entries that refer to a reclaimed
+ * node are thrown away.
+ *
+ * This must only be called when there are no unreferenced nodes that
+ * the caller still cares about — for instance, not in the middle of
+ * a BDD operation.
+ */
+
+gsize
+ipset_node_cache_collect(ipset_node_cache_t *cache);
+
+/**
+ * Run the garbage collector if the unique table has grown past the
+ * cache's collection threshold.  If most of the nodes survive, the
+ * threshold is raised, so that we don't keep collecting a cache that
+ * legitimately needs to be large.
+ */
+
+void
+ipset_node_cache_collect_if_needed(ipset_node_cache_t *cache);
+
+
+/**
+ * Move the nodes of a BDD into a contiguous block at the end of the
+ * node arena, in depth-first order, so that the nodes visited by a
+ * lookup share as few cache lines as possible.  Every parent node
+ * and registered root that points at a moved node is updated, so
+ * this can only be called when every node that we care about is
+ * reachable from a registered root or an external reference.  Nodes
+ * that are held by an external reference stay where they are.
+ * Returns the number of nodes that were moved.
+ */
+
+gsize
+ipset_node_cache_compact(ipset_node_cache_t *cache,
+                         ipset_node_id_t root);
+
+/**
+ * Return the terminal value that stands for a 64-bit payload in this
+ * node cache, adding the payload to the cache's dictionary if it
+ * isn't there yet.  Payloads are never removed from the dictionary,
+ * so a cache can hold up to 2^31 distinct payloads over its lifetime.
+ */
+
+ipset_range_t
+ipset_node_cache_payload_value(ipset_node_cache_t *cache,
+                               guint64 payload);
+
+/**
+ * Return the payload that a terminal value stands for.  Values that
+ * aren't in the cache's dictionary stand for a payload of 0.
+ */
+
+guint64
+ipset_node_cache_payload(ipset_node_cache_t *cache,
+                         ipset_range_t value);
+
+/**
+ * Copy a BDD from one node cache into another, returning the ID of
+ * the copy's root in the destination cache.  Nodes that are shared
+ * within the source BDD are only copied once.  The result isn't
+ * referenced by anything yet.
+ */
+
+ipset_node_id_t
+ipset_node_cache_import(ipset_node_cache_t *dst,
+                        ipset_node_cache_t *src,
+                        ipset_node_id_t src_root);
+
+
 /**
  * Load a BDD from an input stream.  The error field is filled in with
  * a GError object is the BDD can't be read for any reason.
@@ -361,107 +1644,152 @@ ipset_node_cache_save_dot(FILE *stream,
  * BDD operators
  */
 
+/*
+ * Each of the operators returns IPSET_NULL_NODE if it can't create
+ * the nodes of the result without exceeding the cache's memory limit.
+ * If the cache's thread_count is more than 1, and it doesn't have a
+ * memory limit, operations whose operands each have at least
+ * parallel_min_nodes nodes are spread across several threads.
+ */
+
 /**
- * The key for a cache that memoizes the results of a binary BDD
- * operator.
+ * Calculate the logical AND (∧) of two BDDs.
  */
 
-typedef struct ipset_binary_key
-{
-    ipset_node_id_t  lhs;
-    ipset_node_id_t  rhs;
-} ipset_binary_key_t;
+ipset_node_id_t
+ipset_node_cache_and(ipset_node_cache_t *cache,
+                     ipset_node_id_t lhs,
+                     ipset_node_id_t rhs);
 
 /**
- * Return a hash value for a binary operator key.
+ * Calculate the logical OR (∨) of two BDDs.
  */
 
-guint
-ipset_binary_key_hash(ipset_binary_key_t *key);
+ipset_node_id_t
+ipset_node_cache_or(ipset_node_cache_t *cache,
+                    ipset_node_id_t lhs,
+                    ipset_node_id_t rhs);
 
 /**
- * Test two binary operator keys for equality.
+ * Calculate the exclusive OR (⊕) of two BDDs.
  */
 
-gboolean
-ipset_binary_key_equal(const ipset_binary_key_t *key1,
-                       const ipset_binary_key_t *key2);
+ipset_node_id_t
+ipset_node_cache_xor(ipset_node_cache_t *cache,
+                     ipset_node_id_t lhs,
+                     ipset_node_id_t rhs);
 
 /**
- * Fill in the key for a commutative binary BDD operator.  This
- * ensures that reversed operands yield the same key.
+ * Calculate the difference (lhs ∧ ¬rhs) of two Boolean BDDs.  Since
+ * negating the RHS is free, this is a single AND pass, and shares its
+ * computed table entries with ipset_node_cache_and().
  */
 
-void
-ipset_binary_key_commutative(ipset_binary_key_t *key,
-                             ipset_node_id_t lhs,
-                             ipset_node_id_t rhs);
+ipset_node_id_t
+ipset_node_cache_and_not(ipset_node_cache_t *cache,
+                         ipset_node_id_t lhs,
+                         ipset_node_id_t rhs);
 
 /**
- * The key for a cache that memoizes the results of a trinary BDD
- * operator.
+ * Calculate the IF-THEN-ELSE of three BDDs.  The first BDD should
+ * only have 0 and 1 (FALSE and TRUE) in its range.
  */
 
-typedef struct ipset_trinary_key
-{
-    ipset_node_id_t  f;
-    ipset_node_id_t  g;
-    ipset_node_id_t  h;
-} ipset_trinary_key_t;
+ipset_node_id_t
+ipset_node_cache_ite(ipset_node_cache_t *cache,
+                     ipset_node_id_t f,
+                     ipset_node_id_t g,
+                     ipset_node_id_t h);
 
 /**
- * Return a hash value for a trinary operator key.
+ * Calculate the logical OR of any number of Boolean BDDs, walking all
+ * of them at once.  Unlike a chain of ipset_node_cache_or() calls,
+ * this doesn't build any intermediate BDDs, other than ones that are
+ * part of the result.  It keeps its own table of intermediate
+ * results, and doesn't touch the cache's computed table.  An empty
+ * list of operands yields FALSE.
  */
 
-guint
-ipset_trinary_key_hash(ipset_trinary_key_t *key);
+ipset_node_id_t
+ipset_node_cache_or_many(ipset_node_cache_t *cache,
+                         const ipset_node_id_t *operands,
+                         gsize count);
 
 /**
- * Test two trinary operator keys for equality.
+ * Existentially quantify away every variable from first_variable
+ * onward in a Boolean BDD.  The result is TRUE for an assignment of
+ * the earlier variables if the original BDD is TRUE for that
+ * assignment and any assignment of the later variables.  Since the
+ * variables are quantified in one pass, this takes time proportional
+ * to the number of nodes above first_variable.
  */
 
-gboolean
-ipset_trinary_key_equal(const ipset_trinary_key_t *key1,
-                        const ipset_trinary_key_t *key2);
+ipset_node_id_t
+ipset_node_cache_exists_from(ipset_node_cache_t *cache,
+                             ipset_node_id_t node_id,
+                             ipset_variable_t first_variable);
 
 /**
- * Fill in the key for a trinary BDD operator.
+ * Simplify a Boolean BDD using a care set, with the restrict operator
+ * of Coudert and Madre.  The result agrees with f wherever care is
+ * TRUE, and can be anything wherever care is FALSE.  Results are
+ * memoized in the node cache's computed table.  Restrict is a
+ * heuristic: the result is usually smaller than f, but it isn't
+ * guaranteed to be.
  */
 
-void
-ipset_trinary_key_init(ipset_trinary_key_t *key,
-                       ipset_node_id_t f,
-                       ipset_node_id_t g,
-                       ipset_node_id_t h);
+ipset_node_id_t
+ipset_node_cache_restrict(ipset_node_cache_t *cache,
+                          ipset_node_id_t f,
+                          ipset_node_id_t care);
 
 /**
- * Calculate the logical AND (∧) of two BDDs.
+ * A function that combines the values of two terminals.
  */
 
-ipset_node_id_t
-ipset_node_cache_and(ipset_node_cache_t *cache,
-                     ipset_node_id_t lhs,
-                     ipset_node_id_t rhs);
+typedef ipset_range_t
+(*ipset_terminal_combiner_t)(ipset_range_t lhs_value,
+                             ipset_range_t rhs_value,
+                             gpointer user_data);
 
 /**
- * Calculate the logical OR (∨) of two BDDs.
+ * Combine two BDDs, which can have any values in their ranges, one
+ * terminal pair at a time.  For every assignment of the variables,
+ * the result's value is the combiner applied to the two operands'
+ * values.  Results are memoized in the node cache's computed table,
+ * but only for the rest of the call, since the next call might use a
+ * different combiner.  The combiner can be called more than once for
+ * the same pair of values, so it should always give the same answer
+ * for them.
  */
 
 ipset_node_id_t
-ipset_node_cache_or(ipset_node_cache_t *cache,
-                    ipset_node_id_t lhs,
-                    ipset_node_id_t rhs);
+ipset_node_cache_combine(ipset_node_cache_t *cache,
+                         ipset_node_id_t lhs,
+                         ipset_node_id_t rhs,
+                         ipset_terminal_combiner_t combiner,
+                         gpointer user_data);
 
 /**
- * Calculate the IF-THEN-ELSE of three BDDs.  The first BDD should
- * only have 0 and 1 (FALSE and TRUE) in its range.
+ * A function that computes a new value for a terminal.
+ */
+
+typedef ipset_range_t
+(*ipset_terminal_mapper_t)(ipset_range_t value, gpointer user_data);
+
+/**
+ * Rebuild a BDD, which can have any values in its range, with each
+ * terminal replaced by the mapper's value for it.  Results are
+ * memoized in the node cache's computed table for the rest of the
+ * call.  The mapper can be called more than once for the same value,
+ * so it should always give the same answer for it.
  */
 
 ipset_node_id_t
-ipset_node_cache_ite(ipset_node_cache_t *cache,
-                     ipset_node_id_t f,
-                     ipset_node_id_t g,
-                     ipset_node_id_t h);
+ipset_node_cache_map_terminals(ipset_node_cache_t *cache,
+                               ipset_node_id_t node_id,
+                               ipset_terminal_mapper_t mapper,
+                               gpointer user_data);
 
 
 /*-----------------------------------------------------------------------
@@ -499,7 +1827,8 @@ ipset_bit_array_assignment(gconstpointer user_data,
  */
 
 ipset_range_t
-ipset_node_evaluate(ipset_node_id_t node,
+ipset_node_evaluate(ipset_node_cache_t *cache,
+                    ipset_node_id_t node,
                     ipset_assignment_func_t assignment,
                     gconstpointer user_data);
 
@@ -698,6 +2027,12 @@ typedef struct ipset_bdd_iterator
 
     gboolean finished;
 
+    /**
+     * The node cache that the BDD's nodes live in.
+     */
+
+    ipset_node_cache_t  *cache;
+
     /**
      * The sequence of nonterminal nodes leading to the current
      * terminal.
@@ -730,7 +2065,8 @@ typedef struct ipset_bdd_iterator
  */
 
 ipset_bdd_iterator_t *
-ipset_node_iterate(ipset_node_id_t root);
+ipset_node_iterate(ipset_node_cache_t *cache,
+                   ipset_node_id_t root);
 
 
 /**
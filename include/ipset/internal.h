@@ -34,10 +34,24 @@ extern ipset_node_cache_t *ipset_cache;
  */
 
 ipset_node_id_t
-ipset_ipv4_make_ip_bdd(gpointer addr, guint netmask);
+ipset_ipv4_make_ip_bdd(ipset_node_cache_t *cache,
+                       gpointer addr, guint netmask);
 
 ipset_node_id_t
-ipset_ipv6_make_ip_bdd(gpointer addr, guint netmask);
+ipset_ipv6_make_ip_bdd(ipset_node_cache_t *cache,
+                       gpointer addr, guint netmask);
+
+
+/**
+ * Return the part of a set's BDD that holds one kind of address.
+ * Variable 0 is TRUE for IPv4 addresses and FALSE for IPv6; if the
+ * BDD doesn't test it, both kinds share the whole BDD.
+ */
+
+ipset_node_id_t
+ipset_address_kind_bdd(ipset_node_cache_t *cache,
+                       ipset_node_id_t node_id,
+                       gboolean ipv4);
 
 
 #endif  /* IPSET_INTERNAL_H */
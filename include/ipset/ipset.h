@@ -19,16 +19,30 @@
 #include <ipset/internal.h>
 
 
+/**
+ * A context holds all of the BDD nodes for a group of IP sets and
+ * maps.  Sets and maps can only be combined or compared with other
+ * sets and maps in the same context.  Unless you ask for a specific
+ * context, everything lives in a single default context, which is
+ * created by ipset_init_library().
+ */
+
+typedef ipset_node_cache_t  ipset_context_t;
+
+
 typedef struct ip_set
 {
+    ipset_context_t  *cache;
     ipset_node_id_t  set_bdd;
 } ip_set_t;
 
 
 typedef struct ip_map
 {
+    ipset_context_t  *cache;
     ipset_node_id_t  map_bdd;
     ipset_node_id_t  default_bdd;
+    gboolean  payloads;
 } ip_map_t;
 
 
@@ -43,6 +57,231 @@ typedef struct ip_map
 
 int ipset_init_library();
 
+/**
+ * Initializes the library, giving its computed table (which memoizes
+ * the results of the BDD operations) room for the given number of
+ * entries.  Larger tables use more memory, but can make it
+ * faster to build large sets.  If the library has already been
+ * initialized, the size is ignored.
+ */
+
+int ipset_init_library_sized(gsize op_cache_size);
+
+/**
+ * Initializes the library so that the default context can be used
+ * from several threads at once.  See ipset_context_new_concurrent()
+ * for details.  If the library has already been initialized, the
+ * existing context is kept as is.
+ */
+
+int ipset_init_library_concurrent();
+
+/**
+ * Reclaims the memory used by BDD nodes that no longer belong to any
+ * IP set or map.  Returns the number of nodes that were reclaimed.
+ * The library also does this automatically, once the number of nodes
+ * crosses the threshold set by ipset_cache_set_gc_threshold().
+ */
+
+gsize
+ipset_cache_collect();
+
+/**
+ * Sets the number of BDD nodes that can exist before the library
+ * automatically reclaims unused ones.  A threshold of 0 turns off
+ * automatic collection.
+ */
+
+void
+ipset_cache_set_gc_threshold(gsize threshold);
+
+/**
+ * Preallocates enough space for the given number of BDD nodes.  If
+ * you know roughly how large a set is going to be (for instance,
+ * because you're about to load a large list of networks), this avoids
+ * repeatedly growing the library's internal tables while it's built.
+ */
+
+void
+ipset_cache_reserve(gsize node_count);
+
+/**
+ * Statistics about the size and effectiveness of a context's internal
+ * tables: how many BDD nodes there are (in total, and for each
+ * variable), how full the node table is, how often each table finds
+ * what it's looking for, and how much memory each one uses.  The hit,
+ * miss, and probe counts are only collected if the library was built
+ * with the --enable-cache-stats option; the counters_enabled field
+ * tells you whether that's the case.
+ */
+
+typedef ipset_node_cache_stats_t  ipset_cache_stats_t;
+
+/**
+ * Fills in the statistics for the default context.
+ */
+
+void
+ipset_cache_stats(ipset_cache_stats_t *stats);
+
+/**
+ * Resets the default context's hit, miss, and probe counts to 0.
+ */
+
+void
+ipset_cache_reset_stats();
+
+/**
+ * Limits the number of bytes that the default context's internal
+ * tables can use.  A limit of 0 (the default) means there's no limit.
+ * If an operation would exceed the limit, the library first shrinks
+ * its caches of operation results, and then reclaims unused BDD
+ * nodes.  If that doesn't free up enough memory, the operation fails,
+ * leaving the set or map unchanged, and ipset_cache_out_of_memory()
+ * will return TRUE until the next operation.
+ */
+
+void
+ipset_cache_set_memory_limit(gsize bytes);
+
+/**
+ * Returns whether the most recent operation in the default context
+ * failed because it would have exceeded the memory limit.
+ */
+
+gboolean
+ipset_cache_out_of_memory();
+
+/**
+ * Sets the number of threads that the default context can use for a
+ * single set or map operation.  Large unions, intersections, and so
+ * on are split up into independent pieces, which are shared out
+ * between the threads.  The extra threads are started here, and wait
+ * for work until the thread count changes again.  Operations on
+ * small sets stay on the calling thread; see
+ * ipset_cache_set_parallel_min_nodes().  With 1 thread (the
+ * default), everything runs on the calling thread.  This doesn't
+ * make the library safe to call from several threads at once; each
+ * context must still only be used by one thread at a time.
+ * Operations in a context with a memory limit always run on a single
+ * thread.
+ */
+
+void
+ipset_cache_set_threads(guint thread_count);
+
+/**
+ * Sets how many levels at the top of each BDD operation in the
+ * default context are split into independent pieces when it runs on
+ * several threads.  Each level can double the number of pieces; the
+ * default is IPSET_DEFAULT_PARALLEL_DEPTH.
+ */
+
+void
+ipset_cache_set_parallel_depth(guint depth);
+
+/**
+ * Sets how big the sets or maps in an operation in the default
+ * context have to be before it runs on several threads.  Each operand
+ * must have at least about this many BDD nodes; the default is
+ * IPSET_DEFAULT_PARALLEL_MIN_NODES.  With 0, every operation is
+ * split up.
+ */
+
+void
+ipset_cache_set_parallel_min_nodes(guint min_nodes);
+
+
+/*---------------------------------------------------------------------
+ * Context functions
+ */
+
+/**
+ * Creates a new context, separate from the default one.  Returns NULL
+ * if we can't allocate a new instance.
+ */
+
+ipset_context_t *
+ipset_context_new();
+
+/**
+ * Creates a new context that several threads can use at once.
+ * Different threads can add to, or otherwise modify, different sets
+ * and maps in the context at the same time, without any locking of
+ * their own.  A set or map that isn't being modified can be read, or
+ * used as the second operand of a set operation, from any thread.
+ * Each set or map must still only be modified by one thread at a
+ * time, and compacting a set must not overlap with any other use of
+ * the context.
+ *
+ * Garbage is collected whenever a thread goes over the collection
+ * threshold, once the other threads' operations have finished.  The
+ * memory limit doesn't apply to the nodes themselves, only to the
+ * tables that index them.  Returns NULL if we can't allocate a new
+ * instance.
+ */
+
+ipset_context_t *
+ipset_context_new_concurrent();
+
+/**
+ * Frees a context, and all of the BDD nodes in it, in one go.  Any
+ * sets or maps that still live in the context become invalid, and
+ * must not be used (or finalized) afterwards.
+ */
+
+void
+ipset_context_free(ipset_context_t *ctx);
+
+/**
+ * Fills in the statistics for a context.
+ */
+
+void
+ipset_context_stats(ipset_context_t *ctx, ipset_cache_stats_t *stats);
+
+/**
+ * Limits the number of bytes that a context's internal tables can
+ * use.  See ipset_cache_set_memory_limit() for details.
+ */
+
+void
+ipset_context_set_memory_limit(ipset_context_t *ctx, gsize bytes);
+
+/**
+ * Returns whether the most recent operation in a context failed
+ * because it would have exceeded the memory limit.
+ */
+
+gboolean
+ipset_context_out_of_memory(ipset_context_t *ctx);
+
+/**
+ * Sets the number of threads that a context can use for a single
+ * operation.  See ipset_cache_set_threads() for details.
+ */
+
+void
+ipset_context_set_threads(ipset_context_t *ctx, guint thread_count);
+
+/**
+ * Sets how many levels of each operation in a context are split into
+ * independent pieces.  See ipset_cache_set_parallel_depth().
+ */
+
+void
+ipset_context_set_parallel_depth(ipset_context_t *ctx, guint depth);
+
+/**
+ * Sets how big the operands of an operation in a context have to be
+ * before it runs on several threads.  See
+ * ipset_cache_set_parallel_min_nodes().
+ */
+
+void
+ipset_context_set_parallel_min_nodes(ipset_context_t *ctx,
+                                     guint min_nodes);
+
 
 /*---------------------------------------------------------------------
  * IP set functions
@@ -56,6 +295,21 @@ int ipset_init_library();
 void
 ipset_init(ip_set_t *set);
 
+/**
+ * Initializes a new IP set in the given context.
+ */
+
+void
+ipset_init_in(ipset_context_t *ctx, ip_set_t *set);
+
+/**
+ * Initializes a new IP set in the given context, with the same
+ * contents as another set, which can live in a different context.
+ */
+
+void
+ipset_init_import(ipset_context_t *ctx, ip_set_t *set, ip_set_t *src);
+
 /**
  * Finalize an IP set, freeing any space used to represent the set
  * internally.  Doesn't deallocate the ip_set_t itself, so this is
@@ -73,6 +327,13 @@ ipset_done(ip_set_t *set);
 ip_set_t *
 ipset_new();
 
+/**
+ * Creates a new empty IP set on the heap, in the given context.
+ */
+
+ip_set_t *
+ipset_new_in(ipset_context_t *ctx);
+
 /**
  * Finalize and free a heap-allocated IP set, freeing any space used
  * to represent the set internally.
@@ -81,6 +342,16 @@ ipset_new();
 void
 ipset_free(ip_set_t *set);
 
+/**
+ * Rearranges the memory used by an IP set, so that the parts of it
+ * that are used to look up any single address sit close together.
+ * This makes lookups faster in a set that was built up gradually.
+ * Any iterators over sets or maps in the same context become invalid.
+ */
+
+void
+ipset_compact(ip_set_t *set);
+
 /**
  * Returns whether the IP set is empty.
  */
@@ -89,14 +360,16 @@ gboolean
 ipset_is_empty(ip_set_t *set);
 
 /**
- * Returns whether two IP sets are equal.
+ * Returns whether two IP sets are equal.  The sets must be in the same
+ * context.
  */
 
 gboolean
 ipset_is_equal(ip_set_t *set1, ip_set_t *set2);
 
 /**
- * Returns whether two IP sets are not equal.
+ * Returns whether two IP sets are not equal.  The sets must be in the
+ * same context.
  */
 
 gboolean
@@ -112,6 +385,141 @@ ipset_is_not_equal(ip_set_t *set1, ip_set_t *set2);
 gsize
 ipset_memory_size(ip_set_t *set);
 
+/**
+ * Returns whether every address in set1 is also in set2.  The sets
+ * must be in the same context.  Like ipset_is_disjoint() and
+ * ipset_intersects(), this walks both sets' BDDs at once, and stops
+ * as soon as it knows the answer, without building anything.
+ */
+
+gboolean
+ipset_is_subset(ip_set_t *set1, ip_set_t *set2);
+
+/**
+ * Returns whether two sets have no addresses in common.
+ */
+
+gboolean
+ipset_is_disjoint(ip_set_t *set1, ip_set_t *set2);
+
+/**
+ * Returns whether two sets have at least one address in common.
+ */
+
+gboolean
+ipset_intersects(ip_set_t *set1, ip_set_t *set2);
+
+/**
+ * An unsigned 128-bit count of IP addresses.  The value is
+ * high * 2^64 + low.
+ */
+
+typedef ipset_node_count_t  ipset_count_t;
+
+/**
+ * Returns the number of IPv4 addresses in an IP set.  This counts
+ * the paths through the set's BDD, without listing the addresses or
+ * building anything, so it's fast even for sets that contain huge
+ * networks.
+ */
+
+guint64
+ipset_ipv4_count(ip_set_t *set);
+
+/**
+ * Returns the number of IPv6 addresses in an IP set.  The only count
+ * that doesn't fit into 128 bits is the one for a set that contains
+ * every IPv6 address; that count saturates at 2^128 - 1.
+ */
+
+ipset_count_t
+ipset_ipv6_count(ip_set_t *set);
+
+/**
+ * Returns the number of addresses in an IP set that start with the
+ * first netmask bits of addr.  A netmask of 0 counts every address
+ * of the same kind as addr; a netmask that's out of range gives a
+ * count of 0.
+ */
+
+ipset_count_t
+ipset_count_within(ip_set_t *set, ipset_ip_t *addr, guint netmask);
+
+/**
+ * Finds the index'th address in an IP set (counting from 0), and
+ * stores it into addr.  The IPv4 addresses in the set come first,
+ * followed by the IPv6 addresses, each in numeric order.  Returns
+ * FALSE if the set doesn't have that many addresses.  This counts
+ * the paths through the set's whole BDD each time; use an
+ * ipset_counter_t to look up several addresses.
+ */
+
+gboolean
+ipset_nth(ip_set_t *set, ipset_count_t index, ipset_ip_t *addr);
+
+/**
+ * Returns the number of addresses in an IP set that come before
+ * addr, in the same order that ipset_nth() uses.  addr doesn't have
+ * to be in the set; if it is, ipset_nth() of the result gives back
+ * addr.
+ */
+
+ipset_count_t
+ipset_rank(ip_set_t *set, ipset_ip_t *addr);
+
+/**
+ * Remembers the path counts of an IP set's BDD between calls, so
+ * that after the first count, each ipset_counter_nth() or
+ * ipset_counter_rank() takes one step per address bit.  If the set
+ * changes, or its context is compacted, the counter starts over on
+ * its next call.  The set must outlive the counter.
+ */
+
+typedef struct ipset_counter  ipset_counter_t;
+
+/**
+ * Creates a new counter for an IP set.
+ */
+
+ipset_counter_t *
+ipset_counter_new(ip_set_t *set);
+
+/**
+ * Frees a counter.
+ */
+
+void
+ipset_counter_free(ipset_counter_t *counter);
+
+/**
+ * Like ipset_nth(), but using a counter's path counts.
+ */
+
+gboolean
+ipset_counter_nth(ipset_counter_t *counter,
+                  ipset_count_t index,
+                  ipset_ip_t *addr);
+
+/**
+ * Like ipset_rank(), but using a counter's path counts.
+ */
+
+ipset_count_t
+ipset_counter_rank(ipset_counter_t *counter, ipset_ip_t *addr);
+
+/**
+ * Chooses n addresses from an IP set uniformly at random (with
+ * replacement), using rng as the source of randomness, and stores
+ * them into the out array, which must have room for n addresses.
+ * The path counts of the set's BDD are computed once, and then each
+ * sample takes one step per address bit, so this doesn't have to
+ * list the set's addresses.  Returns the number of addresses chosen,
+ * which is 0 if the set is empty.
+ */
+
+gsize
+ipset_sample(ip_set_t *set, GRand *rng, gsize n, ipset_ip_t *out);
+
 /**
  * Saves an IP set to disk.  Returns a boolean indicating whether the
  * operation was successful.
@@ -141,6 +549,15 @@ ip_set_t *
 ipset_load(FILE *stream,
            GError **err);
 
+/**
+ * Loads an IP set from a stream into the given context.
+ */
+
+ip_set_t *
+ipset_load_in(ipset_context_t *ctx,
+              FILE *stream,
+              GError **err);
+
 /**
  * Adds a single IPv4 address to an IP set.  We don't care what
  * specific type is used to represent the address; elem should be a
@@ -209,6 +626,128 @@ ipset_ip_add(ip_set_t *set, ipset_ip_t *addr);
 gboolean
 ipset_ip_add_network(ip_set_t *set, ipset_ip_t *addr, guint netmask);
 
+/**
+ * Replaces an IP set with its union with another set.  The sets must
+ * be in the same context.  If there isn't enough memory for the
+ * result, the set is left unchanged, and the context's out-of-memory
+ * flag is set.
+ */
+
+void
+ipset_union(ip_set_t *set, ip_set_t *other);
+
+/**
+ * Replaces an IP set with its intersection with another set.
+ */
+
+void
+ipset_intersect(ip_set_t *set, ip_set_t *other);
+
+/**
+ * Removes every address in another IP set from this one.
+ */
+
+void
+ipset_difference(ip_set_t *set, ip_set_t *other);
+
+/**
+ * Replaces an IP set with its symmetric difference with another set.
+ */
+
+void
+ipset_xor(ip_set_t *set, ip_set_t *other);
+
+/**
+ * Replaces an IP set with its complement — every IPv4 and IPv6
+ * address that isn't in the set.  This takes constant time, and
+ * never needs any new memory, since a set and its complement share
+ * all of their storage.
+ */
+
+void
+ipset_complement(ip_set_t *set);
+
+/**
+ * Simplifies a set using a care set.  Afterwards, the set still
+ * contains the same addresses from care_set as before, but may or
+ * may not contain any address outside of care_set, whichever makes
+ * the set's BDD smallest.  This is useful when a set is only ever
+ * queried with addresses from some known range.  This is a heuristic,
+ * so the BDD usually shrinks, but it isn't guaranteed to.  If there
+ * isn't enough memory for the result, the set is left as it was.
+ */
+
+void
+ipset_minimize(ip_set_t *set, ip_set_t *care_set);
+
+/**
+ * Creates a new IP set on the heap that's the union of two sets.  The
+ * new set is in the same context as the others.  Returns NULL if
+ * there isn't enough memory for the result.
+ */
+
+ip_set_t *
+ipset_union_new(ip_set_t *set1, ip_set_t *set2);
+
+/**
+ * Creates a new IP set on the heap that's the intersection of two
+ * sets.
+ */
+
+ip_set_t *
+ipset_intersect_new(ip_set_t *set1, ip_set_t *set2);
+
+/**
+ * Creates a new IP set on the heap that contains the addresses in
+ * set1 that aren't in set2.
+ */
+
+ip_set_t *
+ipset_difference_new(ip_set_t *set1, ip_set_t *set2);
+
+/**
+ * Creates a new IP set on the heap that's the symmetric difference of
+ * two sets.
+ */
+
+ip_set_t *
+ipset_xor_new(ip_set_t *set1, ip_set_t *set2);
+
+/**
+ * Creates a new IP set on the heap that's the complement of a set.
+ */
+
+ip_set_t *
+ipset_complement_new(ip_set_t *set);
+
+/**
+ * Creates a new IP set on the heap that's the union of any number of
+ * sets, which must all be in the same context.  This walks all of the
+ * sets at once, so it's faster than a chain of ipset_union() calls,
+ * and doesn't build any intermediate sets.  The result is in the
+ * same context as the sets.  The list can't be empty, since there'd
+ * be no way to tell which context the result belongs in.  Returns
+ * NULL if there isn't enough memory for the result.
+ */
+
+ip_set_t *
+ipset_union_many(ip_set_t **sets, gsize count);
+
+/**
+ * Creates a new IP set on the heap that holds every IPv4 network of
+ * the given prefix length that contains an IPv4 address in the set,
+ * and likewise for IPv6.  (For instance, with prefix lengths 24 and
+ * 48, an address in 10.1.2.0/24 puts all of 10.1.2.0/24 into the
+ * result.)  This works directly on the set's BDD, so it takes time
+ * proportional to the size of the BDD, not the number of addresses
+ * in the set.  A prefix length longer than the address leaves that
+ * kind of address alone.  Returns NULL if there isn't enough memory
+ * for the result.
+ */
+
+ip_set_t *
+ipset_coarsen(ip_set_t *set, guint v4_prefixlen, guint v6_prefixlen);
+
 
 /**
  * An internal state type used by the
@@ -345,6 +884,24 @@ ipset_iterator_advance(ipset_iterator_t *iterator);
 void
 ipmap_init(ip_map_t *map, gint default_value);
 
+/**
+ * Initializes a new IP map in the given context.
+ */
+
+void
+ipmap_init_in(ipset_context_t *ctx, ip_map_t *map, gint default_value);
+
+/**
+ * Initializes a new IP map in the given context, with the same
+ * contents (and default value) as another map, which can live in a
+ * different context.  If the source map holds 64-bit payloads, so
+ * does the new map, and its payloads are added to the new context's
+ * dictionary.
+ */
+
+void
+ipmap_init_import(ipset_context_t *ctx, ip_map_t *map, ip_map_t *src);
+
 /**
  * Finalize an IP map, freeing any space used to represent the map
  * internally.  Doesn't deallocate the ip_map_t itself, so this is
@@ -363,6 +920,13 @@ ipmap_done(ip_map_t *map);
 ip_map_t *
 ipmap_new(gint default_value);
 
+/**
+ * Creates a new empty IP map on the heap, in the given context.
+ */
+
+ip_map_t *
+ipmap_new_in(ipset_context_t *ctx, gint default_value);
+
 /**
  * Finalize and free a heap-allocated IP map, freeing any space used
  * to represent the map internally.
@@ -371,6 +935,16 @@ ipmap_new(gint default_value);
 void
 ipmap_free(ip_map_t *map);
 
+/**
+ * Rearranges the memory used by an IP map, so that the parts of it
+ * that are used to look up any single address sit close together.
+ * This makes lookups faster in a map that was built up gradually.
+ * Any iterators over sets or maps in the same context become invalid.
+ */
+
+void
+ipmap_compact(ip_map_t *map);
+
 /**
  * Returns whether the IP map is empty.  A map is considered empty if
  * every input is mapped to the default value.
@@ -380,14 +954,16 @@ gboolean
 ipmap_is_empty(ip_map_t *map);
 
 /**
- * Returns whether two IP maps are equal.
+ * Returns whether two IP maps are equal.  The maps must be in the same
+ * context.
  */
 
 gboolean
 ipmap_is_equal(ip_map_t *map1, ip_map_t *map2);
 
 /**
- * Returns whether two IP maps are not equal.
+ * Returns whether two IP maps are not equal.  The maps must be in the
+ * same context.
  */
 
 gboolean
@@ -403,6 +979,129 @@ ipmap_is_not_equal(ip_map_t *map1, ip_map_t *map2);
 gsize
 ipmap_memory_size(ip_map_t *map);
 
+/**
+ * The built-in ways that ipmap_merge() can combine two maps' values
+ * for an address.
+ */
+
+typedef enum ipmap_merge_op
+{
+    /** The larger of the two values. */
+    IPMAP_MERGE_MAX,
+
+    /** The smaller of the two values. */
+    IPMAP_MERGE_MIN,
+
+    /** The sum of the two values. */
+    IPMAP_MERGE_SUM,
+
+    /**
+     * The first map's value, unless it's the first map's default, in
+     * which case the second map's value.  This lays the first map
+     * over the second, like a per-tenant override of a base policy.
+     */
+    IPMAP_MERGE_PREFER_LEFT,
+
+    /**
+     * Whichever value isn't its own map's default, preferring the
+     * first map's.  If both maps have their defaults, the result is
+     * the destination map's default.
+     */
+    IPMAP_MERGE_PREFER_NON_DEFAULT
+} ipmap_merge_op_t;
+
+/**
+ * A user-supplied function that combines two maps' values for an
+ * address.  It can be called more than once for the same pair of
+ * values, so it should always give the same answer for them.
+ */
+
+typedef gint
+(*ipmap_merge_func_t)(gint value1, gint value2, gpointer user_data);
+
+/**
+ * Replaces the contents of dst with a combination of two other maps:
+ * each address maps to the result of combining its values in map1
+ * and map2.  All three maps must be in the same context, but dst can
+ * be the same map as either of the others.  The combination is
+ * computed directly on the maps' BDDs, so it takes time proportional
+ * to their size, not to the number of addresses.  dst keeps its own
+ * default value.  If there isn't enough memory for the result, dst is
+ * left as it was.
+ *
+ * For maps of 64-bit payloads, the values that are combined are the
+ * context's indices for the payloads, so only the PREFER_LEFT and
+ * PREFER_NON_DEFAULT operations make sense.
+ */
+
+void
+ipmap_merge(ip_map_t *dst,
+            ip_map_t *map1,
+            ip_map_t *map2,
+            ipmap_merge_op_t op);
+
+/**
+ * Replaces the contents of dst with a combination of two other maps,
+ * using a user-supplied function to combine their values.  See
+ * ipmap_merge() for details.
+ */
+
+void
+ipmap_merge_func(ip_map_t *dst,
+                 ip_map_t *map1,
+                 ip_map_t *map2,
+                 ipmap_merge_func_t func,
+                 gpointer user_data);
+
+/**
+ * A user-supplied test of a map's value, for ipmap_select().
+ */
+
+typedef gboolean
+(*ipmap_predicate_t)(gint value, gpointer user_data);
+
+/**
+ * Creates a new IP set on the heap, in the same context as a map,
+ * that holds every address whose value in the map satisfies a
+ * predicate.  The predicate is only called once for each distinct
+ * value in the map (give or take), rather than once for each address
+ * or network, since the set is computed directly from the map's BDD.
+ * Returns NULL if there isn't enough memory for the result.
+ */
+
+ip_set_t *
+ipmap_select(ip_map_t *map, ipmap_predicate_t predicate, gpointer user_data);
+
+/**
+ * Creates a new IP set on the heap that holds every address that a
+ * map sends to the given value.
+ */
+
+ip_set_t *
+ipmap_select_value(ip_map_t *map, gint value);
+
+/**
+ * A user-supplied function that computes a new value for a map, for
+ * ipmap_transform().
+ */
+
+typedef gint
+(*ipmap_transform_func_t)(gint value, gpointer user_data);
+
+/**
+ * Replaces each value in a map, including its default value, with
+ * the result of a function.  Like ipmap_select(), this works directly
+ * on the map's BDD, so the function is only called about once per
+ * distinct value.  It should always give the same answer for the same
+ * value.  If there isn't enough memory for the result, the map is
+ * left as it was.
+ */
+
+void
+ipmap_transform(ip_map_t *map,
+                ipmap_transform_func_t func,
+                gpointer user_data);
+
 /**
  * Saves an IP map to disk.  Returns a boolean indicating whether the
  * operation was successful.
@@ -422,6 +1121,88 @@ ip_map_t *
 ipmap_load(FILE *stream,
            GError **err);
 
+/**
+ * Loads an IP map from disk into the given context.
+ */
+
+ip_map_t *
+ipmap_load_in(ipset_context_t *ctx,
+              FILE *stream,
+              GError **err);
+
+/**
+ * Initializes a new IP map whose values are 64-bit payloads, rather
+ * than gints.  Each distinct payload is stored once, in a dictionary
+ * that belongs to the map's context, and the map's BDD refers to the
+ * payload's entry in the dictionary.  The *_uint64 and *_ptr
+ * functions must be used to read and write the values of this kind
+ * of map.  Payloads only have meaning within their own context, so
+ * these maps can't be loaded back in after being saved.
+ * ipmap_init_import() adds the payloads to the new context's
+ * dictionary.
+ */
+
+void
+ipmap_init_uint64(ip_map_t *map, guint64 default_value);
+
+/**
+ * Initializes a new IP map of 64-bit payloads in the given context.
+ * The default value is added to that context's dictionary.
+ */
+
+void
+ipmap_init_uint64_in(ipset_context_t *ctx, ip_map_t *map,
+                     guint64 default_value);
+
+/**
+ * Creates a new empty IP map on the heap, whose values are 64-bit
+ * payloads.
+ */
+
+ip_map_t *
+ipmap_new_uint64(guint64 default_value);
+
+/**
+ * Creates a new empty IP map of 64-bit payloads on the heap, in the
+ * given context.
+ */
+
+ip_map_t *
+ipmap_new_uint64_in(ipset_context_t *ctx, guint64 default_value);
+
+/**
+ * Initializes a new IP map whose values are opaque pointers.  This is
+ * the same as ipmap_init_uint64(), except that the payloads are
+ * pointers.
+ */
+
+void
+ipmap_init_ptr(ip_map_t *map, gpointer default_value);
+
+/**
+ * Initializes a new IP map of opaque pointers in the given context.
+ */
+
+void
+ipmap_init_ptr_in(ipset_context_t *ctx, ip_map_t *map,
+                  gpointer default_value);
+
+/**
+ * Creates a new empty IP map on the heap, whose values are opaque
+ * pointers.
+ */
+
+ip_map_t *
+ipmap_new_ptr(gpointer default_value);
+
+/**
+ * Creates a new empty IP map of opaque pointers on the heap, in the
+ * given context.
+ */
+
+ip_map_t *
+ipmap_new_ptr_in(ipset_context_t *ctx, gpointer default_value);
+
 /**
  * Adds a single IPv4 address to an IP map, with the given value.  We
  * don't care what specific type is used to represent the address;
@@ -457,6 +1238,59 @@ ipmap_ipv4_set_network(ip_map_t *map,
 gint
 ipmap_ipv4_get(ip_map_t *map, gpointer elem);
 
+/**
+ * Adds a single IPv4 address to an IP map whose values are 64-bit
+ * payloads.
+ */
+
+void
+ipmap_ipv4_set_uint64(ip_map_t *map, gpointer elem, guint64 value);
+
+/**
+ * Adds a network of IPv4 addresses to an IP map whose values are
+ * 64-bit payloads.
+ */
+
+void
+ipmap_ipv4_set_network_uint64(ip_map_t *map,
+                              gpointer elem,
+                              guint netmask,
+                              guint64 value);
+
+/**
+ * Returns the 64-bit payload that an IPv4 address is mapped to in
+ * the map.
+ */
+
+guint64
+ipmap_ipv4_get_uint64(ip_map_t *map, gpointer elem);
+
+/**
+ * Adds a single IPv4 address to an IP map whose values are
+ * pointers.
+ */
+
+void
+ipmap_ipv4_set_ptr(ip_map_t *map, gpointer elem, gpointer value);
+
+/**
+ * Adds a network of IPv4 addresses to an IP map whose values are
+ * pointers.
+ */
+
+void
+ipmap_ipv4_set_network_ptr(ip_map_t *map,
+                           gpointer elem,
+                           guint netmask,
+                           gpointer value);
+
+/**
+ * Returns the pointer that an IPv4 address is mapped to in the map.
+ */
+
+gpointer
+ipmap_ipv4_get_ptr(ip_map_t *map, gpointer elem);
+
 /**
  * Adds a single IPv6 address to an IP map, with the given value.  We
  * don't care what specific type is used to represent the address;
@@ -492,6 +1326,59 @@ ipmap_ipv6_set_network(ip_map_t *map,
 gint
 ipmap_ipv6_get(ip_map_t *map, gpointer elem);
 
+/**
+ * Adds a single IPv6 address to an IP map whose values are 64-bit
+ * payloads.
+ */
+
+void
+ipmap_ipv6_set_uint64(ip_map_t *map, gpointer elem, guint64 value);
+
+/**
+ * Adds a network of IPv6 addresses to an IP map whose values are
+ * 64-bit payloads.
+ */
+
+void
+ipmap_ipv6_set_network_uint64(ip_map_t *map,
+                              gpointer elem,
+                              guint netmask,
+                              guint64 value);
+
+/**
+ * Returns the 64-bit payload that an IPv6 address is mapped to in
+ * the map.
+ */
+
+guint64
+ipmap_ipv6_get_uint64(ip_map_t *map, gpointer elem);
+
+/**
+ * Adds a single IPv6 address to an IP map whose values are
+ * pointers.
+ */
+
+void
+ipmap_ipv6_set_ptr(ip_map_t *map, gpointer elem, gpointer value);
+
+/**
+ * Adds a network of IPv6 addresses to an IP map whose values are
+ * pointers.
+ */
+
+void
+ipmap_ipv6_set_network_ptr(ip_map_t *map,
+                           gpointer elem,
+                           guint netmask,
+                           gpointer value);
+
+/**
+ * Returns the pointer that an IPv6 address is mapped to in the map.
+ */
+
+gpointer
+ipmap_ipv6_get_ptr(ip_map_t *map, gpointer elem);
+
 /**
  * Adds a single generic IP address to an IP map, with the given
  * value.
@@ -74,7 +74,7 @@ ipset.ipmap_init_ptr.argtypes = [c_void_p, c_void_p]
 ipset.ipmap_done.argtypes = [c_void_p]
 ipset.ipmap_new.argtypes = [c_long]
 ipset.ipmap_new.restype = c_void_p
-ipset.ipmap_new.argtypes = [c_void_p]
+ipset.ipmap_new_ptr.argtypes = [c_void_p]
 ipset.ipmap_new_ptr.restype = c_void_p
 ipset.ipmap_free.argtypes = [c_void_p]
 
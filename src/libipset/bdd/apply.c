@@ -0,0 +1,1954 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/logging.h>
+
+
+guint64
+ipset_op_key_hash(const ipset_op_key_t *key)
+{
+    /*
+     * The node hash mixes in its “variable” parameter separately
+     * from the two children, so we fold the operation into the first
+     * operand and pass it in there.
+     */
+
+    return ipset_node_hash64
+        (key->f ^ (key->op * 0x9e3779b9u), key->g, key->h);
+}
+
+
+gboolean
+ipset_op_key_equal(const ipset_op_key_t *key1,
+                   const ipset_op_key_t *key2)
+{
+    if (key1 == key2)
+        return TRUE;
+
+    return
+        (key1->op == key2->op) &&
+        (key1->f == key2->f) &&
+        (key1->g == key2->g) &&
+        (key1->h == key2->h);
+}
+
+
+/**
+ * The names of the operations, for debugging messages.
+ */
+
+static const char  *OP_NAMES[IPSET_OP_COUNT] =
+{
+    "AND", "OR", "XOR", "ITE", "EXISTS", "RESTRICT", "COMBINE", "MAP"
+};
+
+
+/**
+ * Return how many of an operation's operands are BDDs that we split
+ * at each step.  The rest are carried along unchanged.
+ */
+
+static inline guint
+op_arity(guint32 op)
+{
+    switch (op)
+    {
+        case IPSET_OP_ITE:
+            return 3;
+
+        case IPSET_OP_EXISTS:
+        case IPSET_OP_MAP:
+            return 1;
+
+        default:
+            return 2;
+    }
+}
+
+
+/**
+ * Returns whether a node is known to only have 0 and 1 in its range.
+ * This is the only case where x ∧ 1 = x, x ∨ 1 = 1 and x ⊕ 1 = ¬x
+ * hold, since the binary operators act bitwise on the values of
+ * multi-valued terminals.
+ */
+
+static gboolean
+is_boolean(ipset_node_cache_t *cache, ipset_node_id_t node_id)
+{
+    if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE)
+    {
+        ipset_range_t  value = ipset_terminal_value(node_id);
+        return (value == 0) || (value == 1);
+    }
+
+    return ipset_node_cache_get_nonterminal(cache, node_id)->boolean;
+}
+
+
+/**
+ * Try to compute the result of a binary operation without recursing.
+ * Returns IPSET_NULL_NODE if this isn't a trivial case.  We only
+ * need to check for a terminal in the LHS, since the operands of
+ * every binary operator are sorted so that a terminal comes first.
+ */
+
+static ipset_node_id_t
+binary_terminal_case(ipset_node_cache_t *cache,
+                     ipset_op_t op,
+                     ipset_node_id_t lhs,
+                     ipset_node_id_t rhs)
+{
+    gboolean  lhs_terminal =
+        (ipset_node_get_type(lhs) == IPSET_TERMINAL_NODE);
+    gboolean  rhs_terminal =
+        (ipset_node_get_type(rhs) == IPSET_TERMINAL_NODE);
+
+    /*
+     * When both nodes are terminal, we apply the operator to the
+     * terminals' values, and construct a new terminal from the
+     * result.  Note that we do not verify that the operator returns
+     * a positive value.
+     */
+
+    if (lhs_terminal && rhs_terminal)
+    {
+        ipset_range_t  lhs_value = ipset_terminal_value(lhs);
+        ipset_range_t  rhs_value = ipset_terminal_value(rhs);
+        ipset_range_t  new_value;
+
+        switch (op)
+        {
+            case IPSET_OP_AND:
+                new_value = lhs_value & rhs_value;
+                break;
+
+            case IPSET_OP_OR:
+                new_value = lhs_value | rhs_value;
+                break;
+
+            default:
+                new_value = lhs_value ^ rhs_value;
+                break;
+        }
+
+        return ipset_node_cache_terminal(cache, new_value);
+    }
+
+    /*
+     * A nonterminal can only be complemented if it's Boolean, so if
+     * the operands are complements of each other, we know the answer:
+     *
+     *   x ∧ ¬x = 0     x ∨ ¬x = 1     x ⊕ ¬x = 1
+     */
+
+    ipset_range_t  lhs_value =
+        lhs_terminal? ipset_terminal_value(lhs): -1;
+
+    if (!lhs_terminal && (lhs == ipset_node_not(rhs)))
+        return ipset_node_cache_terminal(cache, op != IPSET_OP_AND);
+
+    switch (op)
+    {
+        case IPSET_OP_AND:
+            /*
+             * 0 ∧ x = 0,  x ∧ x = x,  1 ∧ x = x (Boolean x)
+             */
+
+            if (lhs_value == 0)
+                return lhs;
+
+            if (lhs == rhs)
+                return lhs;
+
+            if ((lhs_value == 1) && is_boolean(cache, rhs))
+                return rhs;
+
+            break;
+
+        case IPSET_OP_OR:
+            /*
+             * 0 ∨ x = x,  x ∨ x = x,  1 ∨ x = 1 (Boolean x)
+             */
+
+            if ((lhs_value == 0) || (lhs == rhs))
+                return rhs;
+
+            if ((lhs_value == 1) && is_boolean(cache, rhs))
+                return lhs;
+
+            break;
+
+        case IPSET_OP_XOR:
+            /*
+             * 0 ⊕ x = x,  x ⊕ x = 0,  1 ⊕ x = ¬x (Boolean x)
+             */
+
+            if (lhs_value == 0)
+                return rhs;
+
+            if (lhs == rhs)
+                return ipset_node_cache_terminal(cache, 0);
+
+            if ((lhs_value == 1) && is_boolean(cache, rhs))
+                return ipset_node_not(rhs);
+
+            break;
+
+        default:
+            break;
+    }
+
+    return IPSET_NULL_NODE;
+}
+
+
+/**
+ * Try to compute the result of an ITE without recursing.  Returns
+ * IPSET_NULL_NODE if this isn't a trivial case.
+ */
+
+static ipset_node_id_t
+ite_terminal_case(ipset_node_cache_t *cache,
+                  ipset_node_id_t f,
+                  ipset_node_id_t g,
+                  ipset_node_id_t h)
+{
+    /*
+     * If F is a terminal, then we're in one of the following two
+     * cases:
+     *
+     *   ITE(1,G,H) = G
+     *   ITE(0,G,H) = H
+     */
+
+    if (ipset_node_get_type(f) == IPSET_TERMINAL_NODE)
+    {
+        ipset_range_t  f_value = ipset_terminal_value(f);
+        return (f_value == 0)? h: g;
+    }
+
+    /*
+     * ITE(F,G,G) == G
+     */
+
+    if (g == h)
+        return g;
+
+    /*
+     * ITE(F,1,0) = F
+     * ITE(F,0,1) = ¬F
+     */
+
+    if ((ipset_node_get_type(g) == IPSET_TERMINAL_NODE) &&
+        (ipset_node_get_type(h) == IPSET_TERMINAL_NODE))
+    {
+        ipset_range_t  g_value = ipset_terminal_value(g);
+        ipset_range_t  h_value = ipset_terminal_value(h);
+
+        if ((g_value == 1) && (h_value == 0))
+            return f;
+
+        if ((g_value == 0) && (h_value == 1))
+            return ipset_node_not(f);
+    }
+
+    return IPSET_NULL_NODE;
+}
+
+
+/**
+ * Try to compute the result of an EXISTS without recursing.  Returns
+ * IPSET_NULL_NODE if this isn't a trivial case.
+ */
+
+static ipset_node_id_t
+exists_terminal_case(ipset_node_cache_t *cache,
+                     ipset_node_id_t f,
+                     ipset_variable_t first_variable)
+{
+    if (ipset_node_get_type(f) == IPSET_TERMINAL_NODE)
+        return f;
+
+    /*
+     * A nonterminal in a reduced BDD is never constant, so there's
+     * always some assignment of its variables that reaches TRUE.  If
+     * we're quantifying away every variable that it tests, the result
+     * is TRUE.
+     */
+
+    if (ipset_node_cache_get_nonterminal(cache, f)->variable >=
+        first_variable)
+    {
+        return ipset_node_cache_terminal(cache, TRUE);
+    }
+
+    return IPSET_NULL_NODE;
+}
+
+
+/**
+ * Return the variable that a node tests, or G_MAXUINT for a terminal,
+ * which comes after every variable.
+ */
+
+static inline ipset_variable_t
+top_variable(ipset_node_cache_t *cache, ipset_node_id_t node_id)
+{
+    if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE)
+        return G_MAXUINT;
+
+    return ipset_node_cache_get_nonterminal(cache, node_id)->variable;
+}
+
+
+/**
+ * Try to compute the result of a RESTRICT without recursing.  Returns
+ * IPSET_NULL_NODE if this isn't a trivial case.  Whenever the care
+ * set rules out one branch of f's top variable, we skip the test
+ * entirely and move on to the other branch, rewriting the key as we
+ * go, so that every path to the same subproblem shares a computed
+ * table entry.
+ */
+
+static ipset_node_id_t
+restrict_terminal_case(ipset_node_cache_t *cache, ipset_op_key_t *key)
+{
+    ipset_node_id_t  n_false = ipset_node_cache_terminal(cache, FALSE);
+    ipset_node_id_t  n_true = ipset_node_cache_terminal(cache, TRUE);
+
+    while (TRUE)
+    {
+        ipset_node_id_t  f = key->f;
+        ipset_node_id_t  care = key->g;
+
+        /*
+         * If nothing matters, any BDD will do, so we use the smallest.
+         * If everything matters, or f is constant, f can't be
+         * simplified.  If f agrees with the care set, or with its
+         * complement, it's constant wherever we care.
+         */
+
+        if (care == n_false)
+            return n_false;
+
+        if ((care == n_true) ||
+            (ipset_node_get_type(f) == IPSET_TERMINAL_NODE))
+        {
+            return f;
+        }
+
+        if (f == care)
+            return n_true;
+
+        if (f == ipset_node_not(care))
+            return n_false;
+
+        ipset_node_t  *f_node = ipset_node_cache_get_nonterminal(cache, f);
+
+        if (top_variable(cache, care) != f_node->variable)
+            return IPSET_NULL_NODE;
+
+        ipset_node_t  *care_node =
+            ipset_node_cache_get_nonterminal(cache, care);
+        ipset_node_id_t  care_low = ipset_node_low(care_node, care);
+        ipset_node_id_t  care_high = ipset_node_high(care_node, care);
+
+        if (care_low == n_false)
+        {
+            key->f = ipset_node_high(f_node, f);
+            key->g = care_high;
+        } else if (care_high == n_false) {
+            key->f = ipset_node_low(f_node, f);
+            key->g = care_low;
+        } else {
+            return IPSET_NULL_NODE;
+        }
+    }
+}
+
+
+/**
+ * Rewrite the operands of an ITE into a standard form, so that
+ * equivalent ITEs share a computed table entry.  Some ITEs are
+ * really binary operations, in which case we rewrite the whole key,
+ * so that they share entries with the binary operators, too.
+ */
+
+static void
+normalize_ite(ipset_node_cache_t *cache, ipset_op_key_t *key)
+{
+    ipset_node_id_t  f = key->f;
+    ipset_node_id_t  g = key->g;
+    ipset_node_id_t  h = key->h;
+
+    if (ipset_node_get_type(f) == IPSET_TERMINAL_NODE)
+        return;
+
+    /*
+     * F is Boolean, so it's 1 wherever we choose G, and 0 wherever we
+     * choose H:
+     *
+     *   ITE(F,F,H) = ITE(F,1,H)     ITE(F,¬F,H) = ITE(F,0,H)
+     *   ITE(F,G,F) = ITE(F,G,0)     ITE(F,G,¬F) = ITE(F,G,1)
+     */
+
+    if (g == f)
+        g = ipset_node_cache_terminal(cache, 1);
+    else if (g == ipset_node_not(f))
+        g = ipset_node_cache_terminal(cache, 0);
+
+    if (h == f)
+        h = ipset_node_cache_terminal(cache, 0);
+    else if (h == ipset_node_not(f))
+        h = ipset_node_cache_terminal(cache, 1);
+
+    /*
+     * ITE(¬F,G,H) = ITE(F,H,G).  This holds for any G and H, so it
+     * helps map operations, too.
+     */
+
+    if (f & IPSET_NODE_COMPLEMENT_BIT)
+    {
+        ipset_node_id_t  temp = g;
+        f = ipset_node_regular(f);
+        g = h;
+        h = temp;
+    }
+
+    key->f = f;
+    key->g = g;
+    key->h = h;
+
+    /*
+     * If G and H are Boolean, a few more ITEs can be written in terms
+     * of the binary operators:
+     *
+     *   ITE(F,G,0) = F ∧ G      ITE(F,1,H) = F ∨ H
+     *   ITE(F,0,H) = ¬F ∧ H     ITE(F,G,1) = ¬F ∨ G
+     *   ITE(F,¬H,H) = F ⊕ H
+     */
+
+    if (g == h)
+        return;
+
+    gboolean  g_boolean = is_boolean(cache, g);
+    gboolean  h_boolean = is_boolean(cache, h);
+    ipset_range_t  g_value =
+        (ipset_node_get_type(g) == IPSET_TERMINAL_NODE)?
+        ipset_terminal_value(g): -1;
+    ipset_range_t  h_value =
+        (ipset_node_get_type(h) == IPSET_TERMINAL_NODE)?
+        ipset_terminal_value(h): -1;
+
+    if ((h_value == 0) && g_boolean)
+    {
+        key->op = IPSET_OP_AND;
+    } else if ((g_value == 1) && h_boolean) {
+        key->op = IPSET_OP_OR;
+        key->g = h;
+    } else if ((g_value == 0) && h_boolean) {
+        key->op = IPSET_OP_AND;
+        key->f = ipset_node_not(f);
+        key->g = h;
+    } else if ((h_value == 1) && g_boolean) {
+        key->op = IPSET_OP_OR;
+        key->f = ipset_node_not(f);
+    } else if (g_boolean && (g == ipset_node_not(h))) {
+        key->op = IPSET_OP_XOR;
+        key->g = h;
+    } else {
+        return;
+    }
+
+    key->h = IPSET_NULL_NODE;
+}
+
+
+/**
+ * Normalize the operands of an operation, and then try to compute its
+ * result without recursing.  Returns IPSET_NULL_NODE if this isn't a
+ * trivial case.  Normalizing an ITE might turn it into a binary
+ * operation, so the caller has to check the key's operation
+ * afterwards.
+ */
+
+static ipset_node_id_t
+trivial_case(ipset_node_cache_t *cache, ipset_op_key_t *key)
+{
+    if (key->op == IPSET_OP_EXISTS)
+        return exists_terminal_case(cache, key->f, key->g);
+
+    if (key->op == IPSET_OP_RESTRICT)
+        return restrict_terminal_case(cache, key);
+
+    if (key->op == IPSET_OP_ITE)
+    {
+        normalize_ite(cache, key);
+
+        if (key->op == IPSET_OP_ITE)
+            return ite_terminal_case(cache, key->f, key->g, key->h);
+    }
+
+    /*
+     * The binary operators are all commutative, so we sort their
+     * operands.  This means that reversed operands yield the same
+     * computed table key, and that a terminal operand is always on
+     * the left.  (Terminal IDs have their LSB set, and nonterminal
+     * IDs don't, so sorting by ID alone doesn't put terminals first.)
+     */
+
+    gboolean  f_terminal =
+        (ipset_node_get_type(key->f) == IPSET_TERMINAL_NODE);
+    gboolean  g_terminal =
+        (ipset_node_get_type(key->g) == IPSET_TERMINAL_NODE);
+
+    if ((g_terminal && !f_terminal) ||
+        ((g_terminal == f_terminal) && (key->f > key->g)))
+    {
+        ipset_node_id_t  temp = key->f;
+        key->f = key->g;
+        key->g = temp;
+    }
+
+    return binary_terminal_case(cache, key->op, key->f, key->g);
+}
+
+
+/**
+ * Hint to the CPU that we're going to need some memory soon.
+ */
+
+#if defined(__GNUC__)
+#define PREFETCH(addr)  __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr)  ((void) 0)
+#endif
+
+
+/**
+ * The tables that one thread of the apply engine works with.  A
+ * serial operation uses the node cache's own computed table and work
+ * stack.  Each thread of a parallel operation gets a private computed
+ * table and stack, so that the threads never have to coordinate
+ * their lookups.
+ */
+
+typedef struct apply_state
+{
+    ipset_node_cache_t  *cache;
+    ipset_op_entry_t  *op_cache;
+    guint32  op_cache_size;
+    guint32  *epoch;
+    ipset_apply_frame_t  *stack;
+
+    /**
+     * When several threads are creating nodes at once, they take
+     * turns holding this lock.  NULL for a serial operation.
+     */
+
+    GMutex  *lock;
+
+    /**
+     * Where to count computed table hits and misses.
+     */
+
+    ipset_node_cache_counters_t  *counters;
+
+    /**
+     * If not NULL, each computed table slot that we fill in is added
+     * to this list.
+     */
+
+    GArray  *stored;
+
+    /**
+     * The user-supplied function that a COMBINE or MAP uses to
+     * compute its terminal values, and the user data to pass to it.
+     */
+
+    ipset_terminal_combiner_t  combiner;
+    ipset_terminal_mapper_t  mapper;
+    gpointer  user_data;
+
+    /**
+     * Where to get the token for an operation that uses a
+     * user-supplied function.
+     */
+
+    guint32  *token;
+} apply_state_t;
+
+#if defined(IPSET_CACHE_STATS)
+#define OP_STAT_INC(state, counter)  ((state)->counters->counter++)
+#else
+#define OP_STAT_INC(state, counter)  ((void) 0)
+#endif
+
+
+/**
+ * Set up the state for an operation that runs on the calling thread.
+ */
+
+static void
+serial_state_init(apply_state_t *state, ipset_node_cache_t *cache)
+{
+    state->cache = cache;
+    state->op_cache = cache->op_cache;
+    state->op_cache_size = cache->op_cache_size;
+    state->epoch = &cache->op_cache_epoch;
+    state->stack = cache->apply_stack;
+    state->lock = NULL;
+    state->counters = &cache->counters;
+    state->stored = NULL;
+    state->combiner = NULL;
+    state->mapper = NULL;
+    state->user_data = NULL;
+    state->token = &cache->op_token;
+}
+
+
+/**
+ * The private computed table and work stack that a thread uses for
+ * its operations in a concurrent cache.  A thread only keeps one of
+ * these, for whichever concurrent cache it used last; if it moves on
+ * to a different cache, or the cache's computed table is flushed, it
+ * flushes its own table, too.
+ */
+
+typedef struct thread_state
+{
+    guint  serial;
+    guint32  cache_epoch;
+    guint32  epoch;
+    guint32  token;
+    ipset_op_entry_t  *op_cache;
+    guint32  op_cache_size;
+    ipset_apply_frame_t  *stack;
+    ipset_node_cache_counters_t  counters;
+} thread_state_t;
+
+
+static void
+thread_state_free(gpointer user_data)
+{
+    thread_state_t  *thread_state = (thread_state_t *) user_data;
+
+    g_free(thread_state->op_cache);
+    g_free(thread_state->stack);
+    g_free(thread_state);
+}
+
+
+static GPrivate  thread_states = G_PRIVATE_INIT(thread_state_free);
+
+
+/**
+ * Set up the state for an operation in a concurrent cache, using the
+ * calling thread's private tables.
+ */
+
+static void
+concurrent_state_init(apply_state_t *state, ipset_node_cache_t *cache)
+{
+    thread_state_t  *thread_state =
+        (thread_state_t *) g_private_get(&thread_states);
+
+    if (thread_state == NULL)
+    {
+        thread_state = g_new0(thread_state_t, 1);
+        thread_state->stack =
+            g_new(ipset_apply_frame_t, IPSET_VARIABLE_COUNT);
+        g_private_set(&thread_states, thread_state);
+    }
+
+    /*
+     * The table follows the size of the cache's own table, so that
+     * ipset_node_cache_trim() shrinks it, too.
+     */
+
+    if (thread_state->op_cache_size != cache->op_cache_size)
+    {
+        g_free(thread_state->op_cache);
+        thread_state->op_cache_size = cache->op_cache_size;
+        thread_state->op_cache =
+            g_new0(ipset_op_entry_t, thread_state->op_cache_size);
+        thread_state->epoch = 1;
+        thread_state->serial = 0;
+    }
+
+    if ((thread_state->serial != cache->serial) ||
+        (thread_state->cache_epoch != cache->op_cache_epoch))
+    {
+        thread_state->serial = cache->serial;
+        thread_state->cache_epoch = cache->op_cache_epoch;
+        thread_state->epoch++;
+
+        if (G_UNLIKELY(thread_state->epoch == 0))
+        {
+            memset(thread_state->op_cache, 0,
+                   thread_state->op_cache_size *
+                   sizeof(ipset_op_entry_t));
+            thread_state->epoch = 1;
+        }
+    }
+
+    state->cache = cache;
+    state->op_cache = thread_state->op_cache;
+    state->op_cache_size = thread_state->op_cache_size;
+    state->epoch = &thread_state->epoch;
+    state->stack = thread_state->stack;
+    state->lock = NULL;
+    state->counters = &thread_state->counters;
+    state->stored = NULL;
+    state->combiner = NULL;
+    state->mapper = NULL;
+    state->user_data = NULL;
+    state->token = &thread_state->token;
+}
+
+
+/**
+ * Set up the state for an operation in a node cache.
+ */
+
+static void
+apply_state_init(apply_state_t *state, ipset_node_cache_t *cache)
+{
+    if (cache->concurrent)
+        concurrent_state_init(state, cache);
+    else
+        serial_state_init(state, cache);
+}
+
+
+/**
+ * Return a new token for an operation that uses a user-supplied
+ * function.  Entries for the same operands with a different token
+ * never match, so each call only sees its own results.  Once the
+ * tokens wrap around, an old entry could match a new call, so we
+ * empty the computed table.
+ */
+
+static guint32
+next_token(apply_state_t *state)
+{
+    if (G_UNLIKELY(++(*state->token) == 0))
+    {
+        (*state->epoch)++;
+
+        if (G_UNLIKELY(*state->epoch == 0))
+        {
+            memset(state->op_cache, 0,
+                   state->op_cache_size * sizeof(ipset_op_entry_t));
+            *state->epoch = 1;
+        }
+
+        *state->token = 1;
+    }
+
+    return *state->token;
+}
+
+
+/**
+ * Try to compute the result of an operation that uses a user-supplied
+ * function without recursing.  Returns IPSET_NULL_NODE if this isn't
+ * a trivial case.  The function can do anything with its values, so
+ * we don't know any identities that would let us stop early, and we
+ * can't reorder the operands.
+ */
+
+static ipset_node_id_t
+callback_terminal_case(apply_state_t *state, const ipset_op_key_t *key)
+{
+    if (key->op == IPSET_OP_MAP)
+    {
+        if (ipset_node_get_type(key->f) != IPSET_TERMINAL_NODE)
+            return IPSET_NULL_NODE;
+
+        ipset_range_t  value = state->mapper
+            (ipset_terminal_value(key->f), state->user_data);
+        return ipset_node_cache_terminal(state->cache, value);
+    }
+
+    if ((ipset_node_get_type(key->f) == IPSET_TERMINAL_NODE) &&
+        (ipset_node_get_type(key->g) == IPSET_TERMINAL_NODE))
+    {
+        ipset_range_t  value = state->combiner
+            (ipset_terminal_value(key->f), ipset_terminal_value(key->g),
+             state->user_data);
+        return ipset_node_cache_terminal(state->cache, value);
+    }
+
+    return IPSET_NULL_NODE;
+}
+
+
+/**
+ * Normalize the operands in a computed table key, and then look for
+ * the result of the operation, without recursing.  Returns
+ * IPSET_NULL_NODE if this isn't a trivial case, and the result isn't
+ * in the computed table; in that case, slot is filled in with where
+ * the result should be stored once we've computed it.
+ */
+
+static ipset_node_id_t
+find_result(apply_state_t *state, ipset_op_key_t *key, guint32 *slot)
+{
+    ipset_node_id_t  result;
+
+    g_d_debug("Applying %s(%u, %u, %u)",
+              OP_NAMES[key->op], key->f, key->g, key->h);
+
+    if ((key->op == IPSET_OP_COMBINE) || (key->op == IPSET_OP_MAP))
+        result = callback_terminal_case(state, key);
+    else
+        result = trivial_case(state->cache, key);
+
+    if (result != IPSET_NULL_NODE)
+    {
+        g_d_debug("Trivial result = %u", result);
+        return result;
+    }
+
+    /*
+     * Check to see if we've already performed the operation on these
+     * operands.  A cached result might refer to a node that has
+     * since been released, in which case we have to recompute it.
+     */
+
+    *slot = (guint32) ipset_op_key_hash(key) & (state->op_cache_size - 1);
+    ipset_op_entry_t  *entry = &state->op_cache[*slot];
+
+    if ((entry->epoch == *state->epoch) &&
+        ipset_op_key_equal(&entry->key, key) &&
+        !ipset_node_cache_is_released(state->cache, entry->result))
+    {
+        g_d_debug("Existing result = %u", entry->result);
+        OP_STAT_INC(state, op_hits[key->op]);
+        return entry->result;
+    }
+
+    OP_STAT_INC(state, op_misses[key->op]);
+    return IPSET_NULL_NODE;
+}
+
+
+/**
+ * Remember the result of an operation in the computed table.  We
+ * don't remember a failure; there might be room for the result later
+ * on.
+ */
+
+static void
+store_result(apply_state_t *state,
+             const ipset_op_key_t *key,
+             guint32 slot,
+             ipset_node_id_t result)
+{
+    if (result != IPSET_NULL_NODE)
+    {
+        ipset_op_entry_t  *entry = &state->op_cache[slot];
+        entry->key = *key;
+        entry->result = result;
+        entry->epoch = *state->epoch;
+
+        if (state->stored != NULL)
+            g_array_append_val(state->stored, slot);
+    }
+}
+
+
+/**
+ * Split the operands of an operation on their lowest variable, which
+ * ensures that our BDDs remain ordered.  Each operand that starts
+ * with the split variable contributes its low and high subtrees;
+ * every other operand is used as is in both halves.  The operands
+ * array is overwritten with the low halves, and the high halves are
+ * put into high.  Returns the split variable.
+ */
+
+static ipset_variable_t
+split_operands(ipset_node_cache_t *cache,
+               guint arity,
+               ipset_node_id_t *operands,
+               ipset_node_id_t *high)
+{
+    ipset_node_t  *nodes[3] = { NULL, NULL, NULL };
+    ipset_variable_t  variable = G_MAXUINT;
+    guint  i;
+
+    for (i = 0; i < arity; i++)
+    {
+        if (ipset_node_get_type(operands[i]) == IPSET_NONTERMINAL_NODE)
+        {
+            nodes[i] = ipset_node_cache_get_nonterminal
+                (cache, operands[i]);
+
+            if (nodes[i]->variable < variable)
+                variable = nodes[i]->variable;
+        }
+    }
+
+    /*
+     * We'll need the high subtrees' nodes soon, so ask for them now.
+     */
+
+    for (i = 0; i < arity; i++)
+    {
+        if ((nodes[i] != NULL) && (nodes[i]->variable == variable))
+        {
+            high[i] = ipset_node_high(nodes[i], operands[i]);
+            operands[i] = ipset_node_low(nodes[i], operands[i]);
+
+            if (ipset_node_get_type(high[i]) == IPSET_NONTERMINAL_NODE)
+            {
+                PREFETCH(ipset_node_cache_get_nonterminal
+                         (cache, high[i]));
+            }
+        } else {
+            high[i] = operands[i];
+        }
+    }
+
+    return variable;
+}
+
+
+/**
+ * Create a nonterminal for the result of an operation.
+ */
+
+static ipset_node_id_t
+make_node(apply_state_t *state,
+          ipset_variable_t variable,
+          ipset_node_id_t low,
+          ipset_node_id_t high)
+{
+    ipset_node_id_t  result;
+
+    if (state->lock == NULL)
+        return ipset_node_cache_nonterminal
+            (state->cache, variable, low, high);
+
+    g_mutex_lock(state->lock);
+    result = ipset_node_cache_nonterminal
+        (state->cache, variable, low, high);
+    g_mutex_unlock(state->lock);
+
+    return result;
+}
+
+
+/**
+ * Apply an operation to its operands.  Binary operations pass
+ * IPSET_NULL_NODE for h.
+ *
+ * This is the usual recursive apply algorithm, but instead of
+ * recursing, we keep an explicit stack of frames.  Each step of the
+ * outer loop looks at one set of operands.  If we can answer it
+ * right away (because it's a trivial case, or it's in the computed
+ * table), we hand the answer to the frame at the top of the stack.
+ * Otherwise, we push a new frame, and move on to the low cofactors of
+ * the operands.  Once a frame has both of its halves, we build its
+ * result node, store it in the computed table, and pop the frame,
+ * handing its result to the frame below it.  Normalizing an ITE can
+ * turn it into a binary operation, so each frame keeps track of its
+ * own operation.
+ *
+ * RESTRICT needs one more trick.  If the care set tests a variable
+ * that f doesn't, we can quantify that variable away from the care
+ * set first, and then restrict f to what's left.  We push a chained
+ * frame for that, whose first half is the OR of the care set's
+ * halves, and whose second half is the RESTRICT that uses it.
+ */
+
+static ipset_node_id_t
+apply(apply_state_t *state,
+      ipset_op_t op,
+      ipset_node_id_t f,
+      ipset_node_id_t g,
+      ipset_node_id_t h)
+{
+    guint32  depth = 0;
+
+    while (TRUE)
+    {
+        ipset_node_id_t  result;
+        ipset_op_key_t  key;
+        guint32  slot = 0;
+
+        key.f = f;
+        key.g = g;
+        key.h = h;
+        key.op = op;
+
+        result = find_result(state, &key, &slot);
+
+        if (result == IPSET_NULL_NODE)
+        {
+            ipset_apply_frame_t  *frame = &state->stack[depth++];
+            ipset_node_id_t  operands[3] = { key.f, key.g, key.h };
+
+            /*
+             * Any operands that we don't split are the same in both
+             * halves.
+             */
+
+            frame->key = key;
+            frame->slot = slot;
+            frame->low_result = IPSET_NULL_NODE;
+            frame->chained = FALSE;
+
+            if ((key.op == IPSET_OP_RESTRICT) &&
+                (top_variable(state->cache, key.g) <
+                 top_variable(state->cache, key.f)))
+            {
+                ipset_node_t  *care_node =
+                    ipset_node_cache_get_nonterminal(state->cache, key.g);
+
+                frame->chained = TRUE;
+                frame->variable = care_node->variable;
+                frame->high[0] = key.f;
+
+                op = IPSET_OP_OR;
+                f = ipset_node_low(care_node, key.g);
+                g = ipset_node_high(care_node, key.g);
+                h = IPSET_NULL_NODE;
+                continue;
+            }
+
+            frame->high[0] = key.f;
+            frame->high[1] = key.g;
+            frame->high[2] = key.h;
+            frame->variable = split_operands
+                (state->cache, op_arity(key.op), operands, frame->high);
+
+            op = key.op;
+            f = operands[0];
+            g = operands[1];
+            h = operands[2];
+            continue;
+        }
+
+        /*
+         * We have a result, so hand it to the frames on the stack,
+         * finishing off any frames that now have both halves.
+         */
+
+        while (TRUE)
+        {
+            if (depth == 0)
+                return result;
+
+            ipset_apply_frame_t  *frame = &state->stack[depth - 1];
+
+            /*
+             * If we ran out of memory, give up on the whole thing.
+             */
+
+            if (result == IPSET_NULL_NODE)
+                return IPSET_NULL_NODE;
+
+            if (frame->low_result == IPSET_NULL_NODE)
+            {
+                /*
+                 * This was the low half; move on to the high half.
+                 */
+
+                frame->low_result = result;
+                op = frame->key.op;
+                f = frame->high[0];
+
+                if (frame->chained)
+                {
+                    g = result;
+                    h = IPSET_NULL_NODE;
+                } else {
+                    g = frame->high[1];
+                    h = frame->high[2];
+                }
+
+                break;
+            }
+
+            if (!frame->chained)
+            {
+                result = make_node
+                    (state, frame->variable, frame->low_result, result);
+                g_d_debug("NEW result = %u", result);
+            }
+
+            store_result(state, &frame->key, frame->slot, result);
+            depth--;
+        }
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Parallel operations
+ */
+
+/**
+ * One independent piece of a parallel operation.
+ */
+
+typedef struct parallel_task
+{
+    ipset_op_key_t  key;
+    ipset_node_id_t  result;
+} parallel_task_t;
+
+/**
+ * The shared state of a parallel operation.
+ */
+
+typedef struct parallel_job
+{
+    ipset_node_cache_t  *cache;
+
+    /**
+     * How many levels of the result we split into tasks.
+     */
+
+    guint  depth;
+
+    /**
+     * The tasks, and the index of the next one that a thread should
+     * claim.
+     */
+
+    GArray  *tasks;
+    gint  next_task;
+
+    /**
+     * Maps the key of each operation in the top levels of the result
+     * to one more than the index of its task, or to 0 if it's split
+     * up further.
+     */
+
+    GHashTable  *planned;
+
+    /**
+     * Set once any task runs out of memory, so that the rest of the
+     * threads can stop early.
+     */
+
+    gint  failed;
+
+    /**
+     * Serializes node creation in the shared node cache.
+     */
+
+    GMutex  lock;
+} parallel_job_t;
+
+/**
+ * One of the threads that work on a cache's parallel operations.  A
+ * worker keeps its computed table and work stack for as long as the
+ * cache keeps its threads.  Each operation starts with an empty
+ * table, though, since nodes might have been released and reused
+ * since the last one.
+ */
+
+typedef struct apply_worker
+{
+    apply_state_t  state;
+    guint32  epoch;
+    ipset_node_cache_counters_t  counters;
+    ipset_apply_pool_t  *pool;
+    GThread  *thread;
+} apply_worker_t;
+
+/**
+ * The workers for a cache's parallel operations.  The calling thread
+ * of an operation acts as the first worker; each of the others has a
+ * thread of its own, which sleeps between operations.
+ */
+
+struct ipset_apply_pool
+{
+    guint  worker_count;
+    apply_worker_t  *workers;
+
+    /**
+     * Set while an operation is using the workers.  In a concurrent
+     * cache, an operation that finds them busy runs on its own
+     * thread instead.
+     */
+
+    gint  busy;
+
+    /**
+     * The current operation.  Each time the generation changes, the
+     * threads wake up and work on the job, and the last one to finish
+     * lets the calling thread know.
+     */
+
+    GMutex  lock;
+    GCond  start;
+    GCond  done;
+    parallel_job_t  *job;
+    guint  generation;
+    guint  running;
+    gboolean  stopping;
+};
+
+
+static guint
+op_key_hash(gconstpointer key)
+{
+    return (guint) ipset_op_key_hash((const ipset_op_key_t *) key);
+}
+
+
+static gboolean
+op_key_equal(gconstpointer key1, gconstpointer key2)
+{
+    return ipset_op_key_equal
+        ((const ipset_op_key_t *) key1, (const ipset_op_key_t *) key2);
+}
+
+
+static void
+plan_insert(parallel_job_t *job, const ipset_op_key_t *key, guint value)
+{
+    ipset_op_key_t  *copy = g_new(ipset_op_key_t, 1);
+    *copy = *key;
+    g_hash_table_insert(job->planned, copy, GUINT_TO_POINTER(value));
+}
+
+
+/**
+ * Walk the top levels of an operation, turning each operation that
+ * we can't answer right away at the bottom of those levels into a
+ * task.
+ */
+
+static void
+plan_tasks(parallel_job_t *job,
+           apply_state_t *state,
+           ipset_op_key_t key,
+           guint level)
+{
+    guint32  slot;
+
+    if (find_result(state, &key, &slot) != IPSET_NULL_NODE)
+        return;
+
+    guint  arity = (key.op == IPSET_OP_ITE)? 3: 2;
+
+    if (g_hash_table_lookup_extended(job->planned, &key, NULL, NULL))
+        return;
+
+    if (level == job->depth)
+    {
+        parallel_task_t  task;
+        task.key = key;
+        task.result = IPSET_NULL_NODE;
+        g_array_append_val(job->tasks, task);
+        plan_insert(job, &key, job->tasks->len);
+        return;
+    }
+
+    plan_insert(job, &key, 0);
+
+    ipset_node_id_t  operands[3] = { key.f, key.g, key.h };
+    ipset_node_id_t  high[3];
+    split_operands(state->cache, arity, operands, high);
+
+    ipset_op_key_t  low_key = { operands[0], operands[1], operands[2],
+                                key.op };
+    ipset_op_key_t  high_key = { high[0], high[1], high[2], key.op };
+
+    if (arity == 2)
+    {
+        low_key.h = IPSET_NULL_NODE;
+        high_key.h = IPSET_NULL_NODE;
+    }
+
+    plan_tasks(job, state, low_key, level + 1);
+    plan_tasks(job, state, high_key, level + 1);
+}
+
+
+/**
+ * Walk the top levels of an operation again, once every task is
+ * done, and build the nodes that join the tasks' results together.
+ * The same operands can turn up at more than one level, so we use a
+ * task's result wherever its operands appear.  If we reach the bottom
+ * level with operands that don't have a task (because they were in
+ * the computed table during planning, but have since fallen out of
+ * it), we compute them here.
+ */
+
+static ipset_node_id_t
+join_tasks(parallel_job_t *job,
+           apply_state_t *state,
+           ipset_op_key_t key,
+           guint level)
+{
+    ipset_node_id_t  result;
+    guint32  slot;
+    gpointer  value;
+
+    result = find_result(state, &key, &slot);
+    if (result != IPSET_NULL_NODE)
+        return result;
+
+    guint  arity = (key.op == IPSET_OP_ITE)? 3: 2;
+
+    if (g_hash_table_lookup_extended(job->planned, &key, NULL, &value) &&
+        (GPOINTER_TO_UINT(value) > 0))
+    {
+        guint  index = GPOINTER_TO_UINT(value) - 1;
+        result = g_array_index(job->tasks, parallel_task_t, index).result;
+        store_result(state, &key, slot, result);
+        return result;
+    }
+
+    if (level == job->depth)
+    {
+        result = apply(state, key.op, key.f, key.g, key.h);
+        store_result(state, &key, slot, result);
+        return result;
+    }
+
+    ipset_node_id_t  operands[3] = { key.f, key.g, key.h };
+    ipset_node_id_t  high[3];
+    ipset_variable_t  variable =
+        split_operands(state->cache, arity, operands, high);
+
+    ipset_op_key_t  low_key = { operands[0], operands[1], operands[2],
+                                key.op };
+    ipset_op_key_t  high_key = { high[0], high[1], high[2], key.op };
+
+    if (arity == 2)
+    {
+        low_key.h = IPSET_NULL_NODE;
+        high_key.h = IPSET_NULL_NODE;
+    }
+
+    ipset_node_id_t  low_result =
+        join_tasks(job, state, low_key, level + 1);
+    if (low_result == IPSET_NULL_NODE)
+        return IPSET_NULL_NODE;
+
+    ipset_node_id_t  high_result =
+        join_tasks(job, state, high_key, level + 1);
+    if (high_result == IPSET_NULL_NODE)
+        return IPSET_NULL_NODE;
+
+    result = make_node(state, variable, low_result, high_result);
+    store_result(state, &key, slot, result);
+    return result;
+}
+
+
+/**
+ * Work on the tasks of a parallel operation.  Rather than giving each
+ * worker a fixed share of the tasks, the workers claim tasks one at a
+ * time from a shared counter, so that a worker that finishes its
+ * tasks early picks up the slack from the others.
+ */
+
+static void
+run_worker(apply_worker_t *worker, parallel_job_t *job)
+{
+    while (!g_atomic_int_get(&job->failed))
+    {
+        gint  index = g_atomic_int_add(&job->next_task, 1);
+        if (index >= (gint) job->tasks->len)
+            break;
+
+        parallel_task_t  *task =
+            &g_array_index(job->tasks, parallel_task_t, index);
+
+        task->result = apply(&worker->state, task->key.op,
+                             task->key.f, task->key.g, task->key.h);
+
+        if (task->result == IPSET_NULL_NODE)
+            g_atomic_int_set(&job->failed, TRUE);
+    }
+}
+
+
+/**
+ * The main loop of each of a pool's threads.
+ */
+
+static gpointer
+worker_thread(gpointer user_data)
+{
+    apply_worker_t  *worker = (apply_worker_t *) user_data;
+    ipset_apply_pool_t  *pool = worker->pool;
+    guint  generation = 0;
+
+    g_mutex_lock(&pool->lock);
+
+    while (TRUE)
+    {
+        while (!pool->stopping && (pool->generation == generation))
+            g_cond_wait(&pool->start, &pool->lock);
+
+        if (pool->stopping)
+            break;
+
+        generation = pool->generation;
+        parallel_job_t  *job = pool->job;
+        g_mutex_unlock(&pool->lock);
+
+        run_worker(worker, job);
+
+        g_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+            g_cond_signal(&pool->done);
+    }
+
+    g_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+static ipset_apply_pool_t *
+pool_new(ipset_node_cache_t *cache, guint worker_count)
+{
+    ipset_apply_pool_t  *pool = g_new0(ipset_apply_pool_t, 1);
+    guint  i;
+
+    g_d_debug("Starting %u apply threads", worker_count - 1);
+
+    pool->worker_count = worker_count;
+    pool->workers = g_new0(apply_worker_t, worker_count);
+    g_mutex_init(&pool->lock);
+    g_cond_init(&pool->start);
+    g_cond_init(&pool->done);
+
+    /*
+     * Give each worker its own computed table, splitting up the room
+     * that the shared table uses.
+     */
+
+    guint32  op_cache_size = cache->op_cache_size;
+    while ((op_cache_size > IPSET_MIN_WORKER_OP_CACHE_SIZE) &&
+           (op_cache_size > cache->op_cache_size / worker_count))
+    {
+        op_cache_size >>= 1;
+    }
+
+    if (op_cache_size < IPSET_MIN_WORKER_OP_CACHE_SIZE)
+        op_cache_size = IPSET_MIN_WORKER_OP_CACHE_SIZE;
+
+    for (i = 0; i < worker_count; i++)
+    {
+        apply_worker_t  *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        worker->epoch = 1;
+        worker->state.cache = cache;
+        worker->state.op_cache =
+            g_new0(ipset_op_entry_t, op_cache_size);
+        worker->state.op_cache_size = op_cache_size;
+        worker->state.epoch = &worker->epoch;
+        worker->state.stack =
+            g_new(ipset_apply_frame_t, IPSET_VARIABLE_COUNT);
+        worker->state.lock = NULL;
+        worker->state.counters = &worker->counters;
+        worker->state.stored = g_array_new(FALSE, FALSE, sizeof(guint32));
+        worker->state.combiner = NULL;
+        worker->state.mapper = NULL;
+        worker->state.user_data = NULL;
+        worker->state.token = NULL;
+    }
+
+    for (i = 1; i < worker_count; i++)
+    {
+        pool->workers[i].thread = g_thread_new
+            ("ipset-apply", worker_thread, &pool->workers[i]);
+    }
+
+    return pool;
+}
+
+
+static void
+pool_free(ipset_apply_pool_t *pool)
+{
+    guint  i;
+
+    g_mutex_lock(&pool->lock);
+    pool->stopping = TRUE;
+    g_cond_broadcast(&pool->start);
+    g_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->worker_count; i++)
+    {
+        apply_worker_t  *worker = &pool->workers[i];
+
+        if (worker->thread != NULL)
+            g_thread_join(worker->thread);
+
+        g_free(worker->state.op_cache);
+        g_free(worker->state.stack);
+        g_array_free(worker->state.stored, TRUE);
+    }
+
+    g_cond_clear(&pool->start);
+    g_cond_clear(&pool->done);
+    g_mutex_clear(&pool->lock);
+    g_free(pool->workers);
+    g_free(pool);
+}
+
+
+void
+ipset_node_cache_set_threads(ipset_node_cache_t *cache,
+                             guint thread_count)
+{
+    thread_count = MAX(thread_count, 1);
+
+    if ((cache->apply_pool != NULL) &&
+        (cache->apply_pool->worker_count == thread_count))
+    {
+        return;
+    }
+
+    if (cache->apply_pool != NULL)
+    {
+        pool_free(cache->apply_pool);
+        cache->apply_pool = NULL;
+    }
+
+    cache->thread_count = thread_count;
+
+    if (thread_count > 1)
+        cache->apply_pool = pool_new(cache, thread_count);
+}
+
+
+/**
+ * Get a worker ready for a new operation: empty its computed table,
+ * and forget which slots it filled in last time.
+ */
+
+static void
+worker_reset(apply_worker_t *worker, parallel_job_t *job)
+{
+    worker->epoch++;
+
+    if (G_UNLIKELY(worker->epoch == 0))
+    {
+        memset(worker->state.op_cache, 0,
+               worker->state.op_cache_size * sizeof(ipset_op_entry_t));
+        worker->epoch = 1;
+    }
+
+    g_array_set_size(worker->state.stored, 0);
+    worker->state.lock = job->cache->concurrent? NULL: &job->lock;
+}
+
+
+/**
+ * Once an operation is done, copy the results that a worker computed
+ * into the calling thread's computed table, so that later operations
+ * can use them.
+ */
+
+static void
+worker_merge(apply_worker_t *worker, apply_state_t *state)
+{
+    guint  i;
+
+    for (i = 0; i < worker->state.stored->len; i++)
+    {
+        guint32  slot = g_array_index(worker->state.stored, guint32, i);
+        ipset_op_entry_t  *entry = &worker->state.op_cache[slot];
+
+        store_result(state, &entry->key,
+                     (guint32) ipset_op_key_hash(&entry->key) &
+                     (state->op_cache_size - 1),
+                     entry->result);
+    }
+
+#if defined(IPSET_CACHE_STATS)
+    guint  op;
+    for (op = 0; op < IPSET_OP_COUNT; op++)
+    {
+        state->counters->op_hits[op] += worker->counters.op_hits[op];
+        state->counters->op_misses[op] += worker->counters.op_misses[op];
+        worker->counters.op_hits[op] = 0;
+        worker->counters.op_misses[op] = 0;
+    }
+#endif
+}
+
+
+/**
+ * Run each task of a parallel operation, using the cache's workers if
+ * they're free.
+ */
+
+static void
+run_tasks(parallel_job_t *job, apply_state_t *serial_state)
+{
+    ipset_node_cache_t  *cache = job->cache;
+    ipset_apply_pool_t  *pool = cache->apply_pool;
+    guint  i;
+
+    /*
+     * There's no point waking up any threads if there's only one task
+     * to run.
+     */
+
+    if ((job->tasks->len < 2) ||
+        !g_atomic_int_compare_and_exchange(&pool->busy, FALSE, TRUE))
+    {
+        for (i = 0; i < job->tasks->len; i++)
+        {
+            parallel_task_t  *task =
+                &g_array_index(job->tasks, parallel_task_t, i);
+            task->result = apply(serial_state, task->key.op,
+                                 task->key.f, task->key.g, task->key.h);
+        }
+
+        return;
+    }
+
+    g_d_debug("Running %u tasks on %u threads",
+              job->tasks->len, pool->worker_count);
+
+    for (i = 0; i < pool->worker_count; i++)
+        worker_reset(&pool->workers[i], job);
+
+    /*
+     * The calling thread does its share of the work, too.  Nodes
+     * created by the threads don't reference their children until
+     * everyone's done.  (A concurrent cache doesn't count references,
+     * and doesn't need a lock to create nodes.)
+     */
+
+    if (!cache->concurrent)
+        cache->deferred_nodes = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+    g_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->running = pool->worker_count - 1;
+    pool->generation++;
+    g_cond_broadcast(&pool->start);
+    g_mutex_unlock(&pool->lock);
+
+    run_worker(&pool->workers[0], job);
+
+    g_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+        g_cond_wait(&pool->done, &pool->lock);
+    pool->job = NULL;
+    g_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->worker_count; i++)
+        worker_merge(&pool->workers[i], serial_state);
+
+    g_atomic_int_set(&pool->busy, FALSE);
+
+    GArray  *deferred_nodes = cache->deferred_nodes;
+    cache->deferred_nodes = NULL;
+
+    if (deferred_nodes == NULL)
+        return;
+
+    for (i = 0; i < deferred_nodes->len; i++)
+    {
+        guint32  index = g_array_index(deferred_nodes, guint32, i);
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, ipset_index_to_node_id(index));
+
+        ipset_node_incref(cache, node->low);
+        ipset_node_incref(cache, node->high);
+    }
+
+    g_array_free(deferred_nodes, TRUE);
+}
+
+
+/**
+ * Apply an operation using several threads.  We split the top levels
+ * of the operation into independent tasks, run the tasks in
+ * parallel, and then join their results together.  While the tasks
+ * are running, the threads take turns creating nodes, but they can
+ * read existing nodes at any time: nodes never move, and nothing is
+ * released until the operation is done.
+ */
+
+static ipset_node_id_t
+parallel_apply(apply_state_t *state,
+               ipset_op_t op,
+               ipset_node_id_t f,
+               ipset_node_id_t g,
+               ipset_node_id_t h)
+{
+    ipset_node_cache_t  *cache = state->cache;
+    parallel_job_t  job;
+    ipset_op_key_t  key = { f, g, h, op };
+
+    job.cache = cache;
+    job.depth = MIN(cache->parallel_depth, IPSET_MAX_PARALLEL_DEPTH);
+    job.tasks = g_array_new(FALSE, FALSE, sizeof(parallel_task_t));
+    job.next_task = 0;
+    job.planned = g_hash_table_new_full
+        (op_key_hash, op_key_equal, g_free, NULL);
+    job.failed = FALSE;
+    g_mutex_init(&job.lock);
+
+    plan_tasks(&job, state, key, 0);
+    run_tasks(&job, state);
+
+    ipset_node_id_t  result = job.failed? IPSET_NULL_NODE:
+        join_tasks(&job, state, key, 0);
+
+    g_mutex_clear(&job.lock);
+    g_hash_table_destroy(job.planned);
+    g_array_free(job.tasks, TRUE);
+
+    return result;
+}
+
+
+/**
+ * Check whether each of an operation's nonterminal operands has at
+ * least min_nodes nodes.  How much work an operation does depends
+ * mostly on its smallest operand, so we walk all of the operands in
+ * step, and stop as soon as one of them runs out of nodes.  That
+ * keeps the check cheap for small operations on large BDDs, such as
+ * adding one address to a big set.
+ *
+ * We don't keep track of which nodes we've already seen, so a node
+ * that's reachable along several paths is counted once for each of
+ * them.  That makes the counts an upper bound, but it means the walk
+ * doesn't need to allocate anything: each path's variables are in
+ * increasing order, so a depth-first walk never has more than
+ * IPSET_VARIABLE_COUNT + 1 nodes on its stack.
+ */
+
+static gboolean
+operands_are_large(ipset_node_cache_t *cache,
+                   guint arity,
+                   const ipset_node_id_t *operands,
+                   guint min_nodes)
+{
+    ipset_node_id_t  stacks[3][IPSET_VARIABLE_COUNT + 1];
+    guint  depths[3] = { 0, 0, 0 };
+    guint  counts[3] = { 0, 0, 0 };
+    gboolean  done[3] = { TRUE, TRUE, TRUE };
+    guint  walking = 0;
+    guint  i;
+
+    if (min_nodes == 0)
+        return TRUE;
+
+    for (i = 0; i < arity; i++)
+    {
+        if (ipset_node_get_type(operands[i]) == IPSET_NONTERMINAL_NODE)
+        {
+            stacks[i][depths[i]++] = operands[i];
+            done[i] = FALSE;
+            walking++;
+        }
+    }
+
+    if (walking == 0)
+        return FALSE;
+
+    /*
+     * Each round visits one more node of each operand that hasn't
+     * reached min_nodes yet.
+     */
+
+    while (walking > 0)
+    {
+        for (i = 0; i < arity; i++)
+        {
+            if (done[i])
+                continue;
+
+            if (depths[i] == 0)
+                return FALSE;
+
+            ipset_node_id_t  node_id = stacks[i][--depths[i]];
+            ipset_node_t  *node =
+                ipset_node_cache_get_nonterminal(cache, node_id);
+
+            if (ipset_node_get_type(node->low) == IPSET_NONTERMINAL_NODE)
+                stacks[i][depths[i]++] = node->low;
+
+            if (ipset_node_get_type(node->high) == IPSET_NONTERMINAL_NODE)
+                stacks[i][depths[i]++] = node->high;
+
+            if (++counts[i] == min_nodes)
+            {
+                done[i] = TRUE;
+                walking--;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+
+/**
+ * Apply an operation in a node cache, using several threads if the
+ * cache allows it, and the operands are big enough to make it
+ * worthwhile.
+ */
+
+static ipset_node_id_t
+cache_apply(ipset_node_cache_t *cache,
+            ipset_op_t op,
+            ipset_node_id_t f,
+            ipset_node_id_t g,
+            ipset_node_id_t h)
+{
+    apply_state_t  state;
+
+    apply_state_init(&state, cache);
+
+    /*
+     * The threads' private computed tables would be on top of the
+     * memory limit, so if there's a limit, we stay on this thread.
+     * Only the Boolean operators are split up into tasks; the rest
+     * always run on the calling thread.
+     */
+
+    if ((cache->apply_pool != NULL) && (cache->parallel_depth > 0) &&
+        (cache->memory_limit == 0) && (op <= IPSET_OP_ITE))
+    {
+        ipset_node_id_t  operands[3] = { f, g, h };
+
+        if (operands_are_large
+            (cache, op_arity(op), operands, cache->parallel_min_nodes))
+        {
+            return parallel_apply(&state, op, f, g, h);
+        }
+    }
+
+    return apply(&state, op, f, g, h);
+}
+
+
+ipset_node_id_t
+ipset_node_cache_and(ipset_node_cache_t *cache,
+                     ipset_node_id_t lhs,
+                     ipset_node_id_t rhs)
+{
+    return cache_apply(cache, IPSET_OP_AND, lhs, rhs, IPSET_NULL_NODE);
+}
+
+
+ipset_node_id_t
+ipset_node_cache_or(ipset_node_cache_t *cache,
+                    ipset_node_id_t lhs,
+                    ipset_node_id_t rhs)
+{
+    return cache_apply(cache, IPSET_OP_OR, lhs, rhs, IPSET_NULL_NODE);
+}
+
+
+ipset_node_id_t
+ipset_node_cache_xor(ipset_node_cache_t *cache,
+                     ipset_node_id_t lhs,
+                     ipset_node_id_t rhs)
+{
+    return cache_apply(cache, IPSET_OP_XOR, lhs, rhs, IPSET_NULL_NODE);
+}
+
+
+ipset_node_id_t
+ipset_node_cache_and_not(ipset_node_cache_t *cache,
+                         ipset_node_id_t lhs,
+                         ipset_node_id_t rhs)
+{
+    return cache_apply(cache, IPSET_OP_AND,
+                       lhs, ipset_node_not(rhs), IPSET_NULL_NODE);
+}
+
+
+ipset_node_id_t
+ipset_node_cache_ite(ipset_node_cache_t *cache,
+                     ipset_node_id_t f,
+                     ipset_node_id_t g,
+                     ipset_node_id_t h)
+{
+    return cache_apply(cache, IPSET_OP_ITE, f, g, h);
+}
+
+
+ipset_node_id_t
+ipset_node_cache_exists_from(ipset_node_cache_t *cache,
+                             ipset_node_id_t node_id,
+                             ipset_variable_t first_variable)
+{
+    g_d_debug("Quantifying away variables from %u onward in BDD %u",
+              first_variable, node_id);
+    return cache_apply(cache, IPSET_OP_EXISTS,
+                       node_id, first_variable, IPSET_NULL_NODE);
+}
+
+
+ipset_node_id_t
+ipset_node_cache_restrict(ipset_node_cache_t *cache,
+                          ipset_node_id_t f,
+                          ipset_node_id_t care)
+{
+    g_d_debug("Restricting BDD %u to care set %u", f, care);
+    return cache_apply(cache, IPSET_OP_RESTRICT, f, care, IPSET_NULL_NODE);
+}
+
+
+ipset_node_id_t
+ipset_node_cache_combine(ipset_node_cache_t *cache,
+                         ipset_node_id_t lhs,
+                         ipset_node_id_t rhs,
+                         ipset_terminal_combiner_t combiner,
+                         gpointer user_data)
+{
+    apply_state_t  state;
+
+    apply_state_init(&state, cache);
+    state.combiner = combiner;
+    state.user_data = user_data;
+
+    g_d_debug("Combining BDDs %u and %u", lhs, rhs);
+    return apply(&state, IPSET_OP_COMBINE, lhs, rhs, next_token(&state));
+}
+
+
+ipset_node_id_t
+ipset_node_cache_map_terminals(ipset_node_cache_t *cache,
+                               ipset_node_id_t node_id,
+                               ipset_terminal_mapper_t mapper,
+                               gpointer user_data)
+{
+    apply_state_t  state;
+
+    apply_state_init(&state, cache);
+    state.mapper = mapper;
+    state.user_data = user_data;
+
+    g_d_debug("Mapping the terminals of BDD %u", node_id);
+    return apply(&state, IPSET_OP_MAP,
+                 node_id, IPSET_NULL_NODE, next_token(&state));
+}
@@ -13,9 +13,12 @@
 
 #include <glib.h>
 
+#if GLIB_MINOR_VERSION < 14
+#define G_QUEUE_INIT { NULL, NULL, 0 }
+#endif
+
 #include <ipset/bdd/nodes.h>
 #include <ipset/logging.h>
-#include "../hash.c.in"
 
 
 GQuark
@@ -31,12 +34,11 @@ ipset_node_get_type(ipset_node_id_t node)
     /*
      * The ID of a terminal node has its LSB set to 1, and has the
      * terminal value stored in the remaining bits.  The ID of a
-     * nonterminal node is simply a pointer to the node struct.
+     * nonterminal node has its LSB set to 0, and has the node's arena
+     * index stored in the remaining bits.
      */
 
-    guint  node_int = GPOINTER_TO_UINT(node);
-
-    if ((node_int & 1) == 1)
+    if ((node & 1) == 1)
     {
         return IPSET_TERMINAL_NODE;
     } else {
@@ -53,26 +55,49 @@ ipset_terminal_value(ipset_node_id_t node_id)
      * terminal value stored in the remaining bits.
      */
 
-    guint  node_int = GPOINTER_TO_UINT(node_id);
-    return (gint) (node_int >> 1);
+    return (gint) (node_id >> 1);
+}
+
+
+/**
+ * Return the location of the node with the given arena index.  Chunk
+ * k of the arena holds IPSET_NODE_CHUNK_BASE_SIZE × 2^k nodes, so if
+ * we offset the index by the size of the first chunk, the position
+ * of the offset index's highest set bit tells us which chunk the node
+ * lives in.
+ */
+
+static inline ipset_node_t *
+arena_node(ipset_node_cache_t *cache, guint32 index)
+{
+    guint32  offset_index = index + IPSET_NODE_CHUNK_BASE_SIZE;
+    guint  top_bit = g_bit_storage(offset_index) - 1;
+    guint  chunk = top_bit - IPSET_NODE_CHUNK_BASE_BITS;
+    return &cache->chunks[chunk][offset_index - (1u << top_bit)];
 }
 
 
 ipset_node_t *
-ipset_nonterminal_node(ipset_node_id_t node_id)
+ipset_node_cache_get_nonterminal(ipset_node_cache_t *cache,
+                                 ipset_node_id_t node_id)
 {
-    /*
-     * The ID of a nonterminal node is simply a pointer to the node
-     * struct.
-     */
+    return arena_node(cache, ipset_node_id_to_index(node_id));
+}
 
-    return (ipset_node_t *) node_id;
+
+gboolean
+ipset_node_cache_is_released(ipset_node_cache_t *cache,
+                             ipset_node_id_t node_id)
+{
+    return
+        (ipset_node_get_type(node_id) == IPSET_NONTERMINAL_NODE) &&
+        arena_node(cache, ipset_node_id_to_index(node_id))->released;
 }
 
 
 void ipset_node_fprint(FILE *stream, ipset_node_t *node)
 {
-    fprintf(stream, "nonterminal(%u,%p,%p)",
+    fprintf(stream, "nonterminal(%u,%u,%u)",
             node->variable, node->low, node->high);
 }
 
@@ -80,11 +105,8 @@ void ipset_node_fprint(FILE *stream, ipset_node_t *node)
 guint
 ipset_node_hash(ipset_node_t *node)
 {
-    guint  hash = 0;
-    combine_hash(&hash, node->variable);
-    combine_hash(&hash, g_direct_hash(node->low));
-    combine_hash(&hash, g_direct_hash(node->high));
-    return hash;
+    return (guint) ipset_node_hash64
+        (node->variable, node->low, node->high);
 }
 
 
@@ -104,25 +126,73 @@ ipset_node_equal(const ipset_node_t *node1,
 
 ipset_node_cache_t *
 ipset_node_cache_new()
+{
+    return ipset_node_cache_new_sized(IPSET_DEFAULT_OP_CACHE_SIZE);
+}
+
+
+ipset_node_cache_t *
+ipset_node_cache_new_sized(gsize op_cache_size)
 {
     ipset_node_cache_t  *cache;
 
     cache = g_slice_new(ipset_node_cache_t);
-    cache->node_cache =
-        g_hash_table_new((GHashFunc) ipset_node_hash,
-                         (GEqualFunc) ipset_node_equal);
+    memset(cache->chunks, 0, sizeof(cache->chunks));
 
-    cache->and_cache =
-        g_hash_table_new((GHashFunc) ipset_binary_key_hash,
-                         (GEqualFunc) ipset_binary_key_equal);
+    /*
+     * Index 0 is never handed out, so that a node ID of 0 can be used
+     * as IPSET_NULL_NODE.
+     */
 
-    cache->or_cache =
-        g_hash_table_new((GHashFunc) ipset_binary_key_hash,
-                         (GEqualFunc) ipset_binary_key_equal);
+    cache->next_index = 1;
+    cache->free_indices = g_array_new(FALSE, FALSE, sizeof(guint32));
+    cache->pending_indices = g_array_new(FALSE, FALSE, sizeof(guint32));
 
-    cache->ite_cache =
-        g_hash_table_new((GHashFunc) ipset_trinary_key_hash,
-                         (GEqualFunc) ipset_trinary_key_equal);
+    ipset_unique_table_init(&cache->unique,
+                            IPSET_UNIQUE_INITIAL_CAPACITY);
+    ipset_unique_table_init(&cache->old_unique, 0);
+    cache->migrate_index = 0;
+
+    cache->roots = g_hash_table_new(NULL, NULL);
+    cache->compactions = 0;
+    cache->gc_threshold = IPSET_DEFAULT_GC_THRESHOLD;
+    memset(&cache->counters, 0, sizeof(cache->counters));
+    cache->memory_limit = 0;
+    cache->out_of_memory = FALSE;
+
+    memset(cache->payload_chunks, 0, sizeof(cache->payload_chunks));
+    cache->payload_count = 0;
+    cache->payload_values =
+        g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    ipset_node_cache_payload_value(cache, 0);
+
+    /*
+     * The computed table starts out zeroed, and epoch 0 is never
+     * current, so every entry starts out invalid.
+     */
+
+    cache->op_cache_size = 1;
+    while ((cache->op_cache_size < op_cache_size) &&
+           (cache->op_cache_size < (1u << 31)))
+    {
+        cache->op_cache_size <<= 1;
+    }
+
+    cache->op_cache_epoch = 1;
+    cache->op_cache = g_new0(ipset_op_entry_t, cache->op_cache_size);
+    cache->op_token = 0;
+
+    cache->apply_stack =
+        g_new(ipset_apply_frame_t, IPSET_VARIABLE_COUNT);
+    cache->thread_count = 1;
+    cache->apply_pool = NULL;
+    cache->parallel_min_nodes = IPSET_DEFAULT_PARALLEL_MIN_NODES;
+    cache->parallel_depth = IPSET_DEFAULT_PARALLEL_DEPTH;
+    cache->deferred_nodes = NULL;
+
+    cache->concurrent = FALSE;
+    cache->shared_free_count = 0;
+    cache->serial = 0;
 
     return cache;
 }
@@ -131,10 +201,38 @@ ipset_node_cache_new()
 void
 ipset_node_cache_free(ipset_node_cache_t *cache)
 {
-    g_hash_table_destroy(cache->node_cache);
-    g_hash_table_destroy(cache->and_cache);
-    g_hash_table_destroy(cache->or_cache);
-    g_hash_table_destroy(cache->ite_cache);
+    guint  i;
+
+    ipset_node_cache_set_threads(cache, 1);
+
+    for (i = 0; i < IPSET_NODE_CHUNK_COUNT; i++)
+    {
+        if (cache->chunks[i] != NULL)
+        {
+            g_free(cache->chunks[i]);
+        }
+    }
+
+    g_array_free(cache->free_indices, TRUE);
+    g_array_free(cache->pending_indices, TRUE);
+    ipset_unique_table_done(&cache->unique);
+    ipset_unique_table_done(&cache->old_unique);
+    g_hash_table_destroy(cache->roots);
+    for (i = 0; i < IPSET_PAYLOAD_CHUNK_COUNT; i++)
+    {
+        g_free(cache->payload_chunks[i]);
+    }
+
+    g_hash_table_destroy(cache->payload_values);
+    g_free(cache->op_cache);
+    g_free(cache->apply_stack);
+
+    if (cache->concurrent)
+    {
+        g_rw_lock_clear(&cache->operation_lock);
+        g_mutex_clear(&cache->table_lock);
+    }
+
     g_slice_free(ipset_node_cache_t, cache);
 }
 
@@ -150,13 +248,361 @@ ipset_node_cache_terminal(ipset_node_cache_t *cache,
 
     g_d_debug("Creating terminal node for %d", value);
 
-    guint  node_int = (guint) value;
-    node_int <<= 1;
-    node_int |= 1;
+    ipset_node_id_t  node_id = (guint32) value;
+    node_id <<= 1;
+    node_id |= 1;
+
+    g_d_debug("Node ID is %u", node_id);
+
+    return node_id;
+}
+
 
-    g_d_debug("Node ID is %p", GUINT_TO_POINTER(node_int));
+void
+ipset_node_cache_flush_operations(ipset_node_cache_t *cache)
+{
+    /*
+     * Moving to a new epoch invalidates every entry at once.  If the
+     * epoch wraps around, though, we have to clear the table for
+     * real, since it might contain entries from the new epoch's
+     * previous lifetime.
+     */
+
+    g_d_debug("Flushing computed table");
+    cache->op_cache_epoch++;
 
-    return GUINT_TO_POINTER(node_int);
+    if (G_UNLIKELY(cache->op_cache_epoch == 0))
+    {
+        memset(cache->op_cache, 0,
+               cache->op_cache_size * sizeof(ipset_op_entry_t));
+        cache->op_cache_epoch = 1;
+    }
+}
+
+
+gsize
+ipset_node_cache_memory_usage(ipset_node_cache_t *cache)
+{
+    gsize  result = 0;
+    guint  i;
+
+    for (i = 0; i < IPSET_NODE_CHUNK_COUNT; i++)
+    {
+        if (cache->chunks[i] != NULL)
+        {
+            result += ((gsize) IPSET_NODE_CHUNK_BASE_SIZE << i) *
+                sizeof(ipset_node_t);
+        }
+    }
+
+    result +=
+        ((gsize) cache->unique.capacity +
+         (gsize) cache->old_unique.capacity) *
+        sizeof(ipset_unique_slot_t);
+
+    result += (gsize) cache->op_cache_size * sizeof(ipset_op_entry_t);
+
+    return result;
+}
+
+
+gboolean
+ipset_node_cache_has_room(ipset_node_cache_t *cache, gsize bytes)
+{
+    if (cache->memory_limit == 0)
+        return TRUE;
+
+    if (ipset_node_cache_memory_usage(cache) + bytes <=
+        cache->memory_limit)
+    {
+        return TRUE;
+    }
+
+    g_d_debug("Can't allocate %" G_GSIZE_FORMAT
+              " bytes without exceeding the memory limit", bytes);
+    return FALSE;
+}
+
+
+void
+ipset_node_cache_trim(ipset_node_cache_t *cache)
+{
+    /*
+     * The computed table is the only memory we can give up without
+     * losing any nodes, so shrink it first.  It's just a cache, so
+     * the new, smaller table can start out empty.  (In a concurrent
+     * cache, each thread's private table follows suit before its
+     * next operation.)
+     */
+
+    ipset_node_cache_exclusive_begin(cache);
+
+    if (cache->op_cache_size > 1)
+    {
+        cache->op_cache_size /= 2;
+        g_d_debug("Shrinking computed table to %u entries",
+                  cache->op_cache_size);
+
+        g_free(cache->op_cache);
+        cache->op_cache_epoch = 1;
+        cache->op_cache = g_new0(ipset_op_entry_t, cache->op_cache_size);
+    }
+
+    ipset_node_cache_exclusive_end(cache);
+
+    /*
+     * Then reclaim any nodes that aren't reachable anymore, so that
+     * their arena slots can be reused.
+     */
+
+    ipset_node_cache_collect(cache);
+}
+
+
+/**
+ * Make sure that the arena chunk that holds the given index has been
+ * allocated.  Returns FALSE if the chunk would put the cache over its
+ * memory limit.
+ */
+
+static inline gboolean
+arena_ensure_chunk(ipset_node_cache_t *cache, guint32 index)
+{
+    guint32  offset_index = index + IPSET_NODE_CHUNK_BASE_SIZE;
+    guint  top_bit = g_bit_storage(offset_index) - 1;
+    guint  chunk = top_bit - IPSET_NODE_CHUNK_BASE_BITS;
+
+    if (G_UNLIKELY(cache->chunks[chunk] == NULL))
+    {
+        gsize  bytes = (gsize) (1u << top_bit) * sizeof(ipset_node_t);
+        if (!ipset_node_cache_has_room(cache, bytes))
+            return FALSE;
+
+        g_d_debug("Allocating node arena chunk %u (%u nodes)",
+                  chunk, 1u << top_bit);
+        cache->chunks[chunk] = g_new(ipset_node_t, 1u << top_bit);
+    }
+
+    return TRUE;
+}
+
+
+/**
+ * Allocate space for a new nonterminal in the node arena, returning
+ * its index.  We prefer to reuse the slot of a node that has been
+ * released.  Otherwise, we take the next unused slot, allocating a
+ * new chunk if the current one is full.  Index 0 is never a valid
+ * node, so we return that if we can't allocate a new chunk.
+ */
+
+static guint32
+arena_allocate(ipset_node_cache_t *cache)
+{
+    /*
+     * If there aren't any reusable slots, but there are slots that
+     * are waiting for the computed table to forget about them,
+     * flush the table so that we can reuse them.
+     */
+
+    if ((cache->free_indices->len == 0) &&
+        (cache->pending_indices->len > 0))
+    {
+        GArray  *tmp;
+
+        ipset_node_cache_flush_operations(cache);
+
+        tmp = cache->free_indices;
+        cache->free_indices = cache->pending_indices;
+        cache->pending_indices = tmp;
+    }
+
+    if (cache->free_indices->len > 0)
+    {
+        guint  last = cache->free_indices->len - 1;
+        guint32  index =
+            g_array_index(cache->free_indices, guint32, last);
+        g_array_set_size(cache->free_indices, last);
+        return index;
+    }
+
+    guint32  index = cache->next_index;
+    if (G_UNLIKELY(index > IPSET_NODE_MAX_INDEX))
+        return 0;
+
+    if (!arena_ensure_chunk(cache, index))
+        return 0;
+
+    cache->next_index++;
+    return index;
+}
+
+
+/**
+ * Allocate space for a new nonterminal in the node arena of a
+ * concurrent cache.  This is the same as arena_allocate(), except
+ * that several threads can call it at once.  Threads claim released
+ * slots by atomically counting down the number of free slots, and
+ * then new slots by atomically counting up the next unused index.
+ * The free list is only refilled while no operations are running, so
+ * a slot can't be claimed twice.
+ */
+
+static guint32
+concurrent_arena_allocate(ipset_node_cache_t *cache)
+{
+    gint  free_count = g_atomic_int_add(&cache->shared_free_count, -1);
+
+    if (free_count > 0)
+        return g_array_index(cache->free_indices, guint32, free_count - 1);
+
+    guint32  index = (guint32) g_atomic_int_add
+        ((gint *) &cache->next_index, 1);
+    if (G_UNLIKELY(index > IPSET_NODE_MAX_INDEX))
+        return 0;
+
+    /*
+     * If the chunk for this index hasn't been allocated yet, several
+     * threads might try to allocate it at once.  Only one of them
+     * gets to install its chunk; the others throw theirs away.
+     */
+
+    guint32  offset_index = index + IPSET_NODE_CHUNK_BASE_SIZE;
+    guint  top_bit = g_bit_storage(offset_index) - 1;
+    guint  chunk = top_bit - IPSET_NODE_CHUNK_BASE_BITS;
+
+    if (G_UNLIKELY(g_atomic_pointer_get(&cache->chunks[chunk]) == NULL))
+    {
+        ipset_node_t  *new_chunk = g_new(ipset_node_t, 1u << top_bit);
+
+        if (!g_atomic_pointer_compare_and_exchange
+            (&cache->chunks[chunk], NULL, new_chunk))
+        {
+            g_free(new_chunk);
+        }
+    }
+
+    return index;
+}
+
+
+/**
+ * Create a nonterminal in a concurrent cache.  The contents have
+ * already been normalized.
+ */
+
+static ipset_node_id_t
+concurrent_nonterminal(ipset_node_cache_t *cache,
+                       ipset_variable_t variable,
+                       ipset_node_id_t low,
+                       ipset_node_id_t high,
+                       gboolean boolean)
+{
+    ipset_unique_slot_t  *slot;
+    ipset_node_id_t  found_id = ipset_node_cache_unique_claim
+        (cache, variable, low, high, &slot);
+
+    if (found_id != IPSET_NULL_NODE)
+        return found_id;
+
+    if (G_UNLIKELY(slot == NULL))
+    {
+        g_d_debug("Unique table is full for nonterminal(%u,%u,%u)",
+                  variable, low, high);
+        return IPSET_NULL_NODE;
+    }
+
+    guint32  index = concurrent_arena_allocate(cache);
+    if (G_UNLIKELY(index == 0))
+    {
+        ipset_node_cache_unique_abandon(cache, slot);
+        return IPSET_NULL_NODE;
+    }
+
+    /*
+     * No other thread can see the node until we publish its slot, so
+     * we can fill it in without any synchronization.  We don't add
+     * references to the children; see
+     * ipset_node_cache_new_concurrent().
+     */
+
+    ipset_node_t  *real_node = arena_node(cache, index);
+    real_node->variable = variable;
+    real_node->released = FALSE;
+    real_node->boolean = boolean;
+    real_node->refcount = 0;
+    real_node->low = low;
+    real_node->high = high;
+
+    ipset_node_id_t  new_id = ipset_index_to_node_id(index);
+    ipset_node_cache_unique_publish(cache, slot, new_id, real_node);
+    return new_id;
+}
+
+
+void
+ipset_node_cache_reserve(ipset_node_cache_t *cache,
+                         gsize node_count)
+{
+    g_d_debug("Reserving space for %" G_GSIZE_FORMAT " nodes",
+              node_count);
+
+    ipset_node_cache_exclusive_begin(cache);
+    ipset_node_cache_unique_reserve(cache, node_count);
+    ipset_node_cache_arena_reserve(cache, node_count);
+    ipset_node_cache_exclusive_end(cache);
+}
+
+
+gboolean
+ipset_node_cache_arena_reserve(ipset_node_cache_t *cache,
+                               gsize node_count)
+{
+    /*
+     * Allocate every arena chunk that we'd need to hold this many
+     * new nodes.
+     */
+
+    guint32  index = cache->next_index;
+    guint32  last_index = index + node_count - 1;
+
+    if (node_count == 0)
+        return TRUE;
+
+    if (((guint64) index + node_count - 1) > IPSET_NODE_MAX_INDEX)
+        return FALSE;
+
+    while (index <= last_index)
+    {
+        if (!arena_ensure_chunk(cache, index))
+            return FALSE;
+
+        /*
+         * Skip ahead to the first index of the next chunk.
+         */
+
+        guint32  offset_index = index + IPSET_NODE_CHUNK_BASE_SIZE;
+        guint  top_bit = g_bit_storage(offset_index) - 1;
+        index = (2u << top_bit) - IPSET_NODE_CHUNK_BASE_SIZE;
+    }
+
+    return TRUE;
+}
+
+
+/**
+ * Return whether every terminal reachable from a node is 0 or 1.
+ */
+
+static inline gboolean
+node_is_boolean(ipset_node_cache_t *cache, ipset_node_id_t node_id)
+{
+    if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE)
+    {
+        ipset_range_t  value = ipset_terminal_value(node_id);
+        return (value == 0) || (value == 1);
+    }
+
+    return arena_node(cache, ipset_node_id_to_index(node_id))->boolean;
 }
 
 
@@ -166,6 +612,17 @@ ipset_node_cache_nonterminal(ipset_node_cache_t *cache,
                              ipset_node_id_t low,
                              ipset_node_id_t high)
 {
+    /*
+     * If we weren't able to create one of the subtrees, we can't
+     * create this node either.
+     */
+
+    if (G_UNLIKELY((low == IPSET_NULL_NODE) ||
+                   (high == IPSET_NULL_NODE)))
+    {
+        return IPSET_NULL_NODE;
+    }
+
     /*
      * Don't allow any nonterminals whose low and high subtrees are
      * the same, since the nonterminal would be redundant.
@@ -173,53 +630,195 @@ ipset_node_cache_nonterminal(ipset_node_cache_t *cache,
 
     if (G_UNLIKELY(low == high))
     {
-        g_d_debug("Skipping nonterminal(%u,%p,%p)",
+        g_d_debug("Skipping nonterminal(%u,%u,%u)",
                   variable, low, high);
         return low;
     }
 
+    /*
+     * A Boolean node is always stored with an uncomplemented low
+     * subtree.  (For a terminal, being complemented means being
+     * TRUE.)  If the caller asks for a node whose low subtree is
+     * complemented, we store the negation of the node instead, and
+     * return a complemented ID for it.  That way, each Boolean
+     * function has exactly one representation.
+     */
+
+    gboolean  boolean =
+        node_is_boolean(cache, low) && node_is_boolean(cache, high);
+    ipset_node_id_t  complement = 0;
+
+    if (boolean && ((low & IPSET_NODE_COMPLEMENT_BIT) != 0))
+    {
+        low = ipset_node_not(low);
+        high = ipset_node_not(high);
+        complement = IPSET_NODE_COMPLEMENT_BIT;
+    }
+
     /*
      * Check to see if there's already a nonterminal with these
      * contents in the cache.
      */
 
-    g_d_debug("Searching for nonterminal(%u,%p,%p)",
+    g_d_debug("Searching for nonterminal(%u,%u,%u)",
               variable, low, high);
 
-    ipset_node_t  search_node;
-    search_node.variable = variable;
-    search_node.low = low;
-    search_node.high = high;
+    if (cache->concurrent)
+    {
+        ipset_node_id_t  result = concurrent_nonterminal
+            (cache, variable, low, high, boolean);
+        return (result == IPSET_NULL_NODE)? result: (result | complement);
+    }
 
-    gpointer  found_node;
-    gboolean  node_exists =
-        g_hash_table_lookup_extended(cache->node_cache,
-                                     &search_node,
-                                     &found_node,
-                                     NULL);
+    ipset_node_id_t  found_id =
+        ipset_node_cache_unique_lookup(cache, variable, low, high);
 
-    if (node_exists)
+    if (found_id != IPSET_NULL_NODE)
     {
         /*
          * There's already a node with these contents, so return its
          * ID.
          */
 
-        g_d_debug("Existing node, ID = %p", found_node);
-        return found_node;
+        g_d_debug("Existing node, ID = %u", found_id);
+        return found_id | complement;
     } else {
         /*
          * This node doesn't exist yet.  Allocate a permanent copy of
-         * the node, add it to the cache, and then return its ID.
+         * the node in the arena, add it to the cache, and then return
+         * its ID.
          */
 
-        ipset_node_t  *real_node = g_slice_new(ipset_node_t);
-        memcpy(real_node, &search_node, sizeof(ipset_node_t));
+        guint32  index = arena_allocate(cache);
+        if (G_UNLIKELY(index == 0))
+        {
+            g_d_debug("Out of memory for nonterminal(%u,%u,%u)",
+                      variable, low, high);
+            return IPSET_NULL_NODE;
+        }
+
+        ipset_node_id_t  new_id = ipset_index_to_node_id(index);
+        ipset_node_t  *real_node = arena_node(cache, index);
+        real_node->variable = variable;
+        real_node->released = FALSE;
+        real_node->boolean = boolean;
+        real_node->refcount = 0;
+        real_node->low = low;
+        real_node->high = high;
+
+        if (G_UNLIKELY(!ipset_node_cache_unique_insert
+                       (cache, new_id, real_node)))
+        {
+            /*
+             * The unique table is full, and can't grow, so give the
+             * arena slot back.  Nothing else has seen this node yet,
+             * so the slot can be reused right away.
+             */
+
+            g_d_debug("Out of memory for nonterminal(%u,%u,%u)",
+                      variable, low, high);
+            real_node->released = TRUE;
+            g_array_append_val(cache->free_indices, index);
+            return IPSET_NULL_NODE;
+        }
+
+        if (G_UNLIKELY(cache->deferred_nodes != NULL))
+        {
+            g_array_append_val(cache->deferred_nodes, index);
+        } else {
+            ipset_node_incref(cache, low);
+            ipset_node_incref(cache, high);
+        }
+
+        g_d_debug("NEW node, ID = %u", new_id);
+        return new_id | complement;
+    }
+}
+
+
+ipset_node_id_t
+ipset_node_incref(ipset_node_cache_t *cache,
+                  ipset_node_id_t node_id)
+{
+    /*
+     * A concurrent cache doesn't count references at all.
+     */
+
+    if ((ipset_node_get_type(node_id) == IPSET_NONTERMINAL_NODE) &&
+        !cache->concurrent)
+    {
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, node_id);
+
+        if (G_LIKELY(node->refcount < IPSET_NODE_MAX_REFCOUNT))
+        {
+            node->refcount++;
+        }
+    }
+
+    return node_id;
+}
+
+
+void
+ipset_node_decref(ipset_node_cache_t *cache,
+                  ipset_node_id_t node_id)
+{
+    /*
+     * We release nodes iteratively rather than recursively; whenever
+     * a node's last reference disappears, we push its children onto
+     * a stack so that we can remove their references, too.
+     */
+
+    GQueue  stack = G_QUEUE_INIT;
+
+    /*
+     * A concurrent cache only releases nodes when collecting garbage.
+     */
+
+    if (cache->concurrent)
+        return;
+
+    g_queue_push_head(&stack, GUINT_TO_POINTER(node_id));
+
+    while (!g_queue_is_empty(&stack))
+    {
+        node_id = GPOINTER_TO_UINT(g_queue_pop_head(&stack));
+
+        if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE)
+            continue;
+
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, node_id);
+
+        /*
+         * Saturated nodes are never released, since we've lost track
+         * of how many references they really have.
+         */
+
+        if (node->refcount == IPSET_NODE_MAX_REFCOUNT)
+            continue;
+
+        g_assert(node->refcount > 0);
+        node->refcount--;
+        if (node->refcount > 0)
+            continue;
+
+        /*
+         * That was the last reference, so remove the node from the
+         * unique table, and put its arena slot on the pending list.
+         */
+
+        g_d_debug("Releasing node %u", node_id);
+
+        ipset_node_cache_unique_remove(cache, node);
+        node->released = TRUE;
 
-        g_hash_table_insert(cache->node_cache, real_node, NULL);
+        guint32  index = ipset_node_id_to_index(node_id);
+        g_array_append_val(cache->pending_indices, index);
 
-        g_d_debug("NEW node, ID = %p", real_node);
-        return real_node;
+        g_queue_push_head(&stack, GUINT_TO_POINTER(node->low));
+        g_queue_push_head(&stack, GUINT_TO_POINTER(node->high));
     }
 }
 
@@ -242,13 +841,14 @@ ipset_bit_array_assignment(gconstpointer user_data,
 
 
 ipset_range_t
-ipset_node_evaluate(ipset_node_id_t node_id,
+ipset_node_evaluate(ipset_node_cache_t *cache,
+                    ipset_node_id_t node_id,
                     ipset_assignment_func_t assignment,
                     gconstpointer user_data)
 {
     ipset_node_id_t  curr_node_id = node_id;
 
-    g_d_debug("Evaluating BDD node %p", node_id);
+    g_d_debug("Evaluating BDD node %u", node_id);
 
     /*
      * As long as the current node is a nonterminal, we have to check
@@ -261,7 +861,8 @@ ipset_node_evaluate(ipset_node_id_t node_id,
          * We have to look up this variable in the assignment.
          */
 
-        ipset_node_t  *node = ipset_nonterminal_node(curr_node_id);
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, curr_node_id);
         gboolean  this_value = assignment(user_data, node->variable);
 
         g_d_debug("Variable %u has value %s", node->variable,
@@ -274,14 +875,14 @@ ipset_node_evaluate(ipset_node_id_t node_id,
              * so trace down the high subtree.
              */
 
-            curr_node_id = node->high;
+            curr_node_id = ipset_node_high(node, curr_node_id);
         } else {
             /*
              * This node's variable is false in the assignment vector,
              * so trace down the low subtree.
              */
 
-            curr_node_id = node->low;
+            curr_node_id = ipset_node_low(node, curr_node_id);
         }
     }
 
@@ -39,14 +39,15 @@ add_node(ipset_bdd_iterator_t *iterator,
          * the node's variable to FALSE in the assignment.
          */
 
-        ipset_node_t  *node = ipset_nonterminal_node(node_id);
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (iterator->cache, node_id);
 
         g_array_append_val(iterator->stack, node_id);
         ipset_assignment_set(iterator->assignment,
                              node->variable,
                              FALSE);
 
-        node_id = node->low;
+        node_id = ipset_node_low(node, node_id);
     }
 
     /*
@@ -59,7 +60,8 @@ add_node(ipset_bdd_iterator_t *iterator,
 
 
 ipset_bdd_iterator_t *
-ipset_node_iterate(ipset_node_id_t root)
+ipset_node_iterate(ipset_node_cache_t *cache,
+                   ipset_node_id_t root)
 {
     /*
      * First allocate the iterator itself, and all of its contained
@@ -70,6 +72,7 @@ ipset_node_iterate(ipset_node_id_t root)
 
     iterator = g_slice_new(ipset_bdd_iterator_t);
     iterator->finished = FALSE;
+    iterator->cache = cache;
     iterator->stack =
         g_array_new(FALSE, FALSE, sizeof(ipset_node_id_t));
     iterator->assignment = ipset_assignment_new();
@@ -124,7 +127,8 @@ ipset_bdd_iterator_advance(ipset_bdd_iterator_t *iterator)
                           iterator->stack->len - 1);
 
         ipset_node_t  *last_node =
-            ipset_nonterminal_node(last_node_id);
+            ipset_node_cache_get_nonterminal
+            (iterator->cache, last_node_id);
 
         ipset_tribool_t  current_value =
             ipset_assignment_get(iterator->assignment,
@@ -165,7 +169,8 @@ ipset_bdd_iterator_advance(ipset_bdd_iterator_t *iterator)
                                  last_node->variable,
                                  IPSET_TRUE);
 
-            add_node(iterator, last_node->high);
+            add_node(iterator,
+                     ipset_node_high(last_node, last_node_id));
             return;
         }
     }
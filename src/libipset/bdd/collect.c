@@ -0,0 +1,348 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/logging.h>
+
+
+void
+ipset_node_cache_add_root(ipset_node_cache_t *cache,
+                          ipset_node_id_t *root)
+{
+    if (cache->concurrent)
+        g_mutex_lock(&cache->table_lock);
+
+    g_hash_table_insert(cache->roots, root, NULL);
+
+    if (cache->concurrent)
+        g_mutex_unlock(&cache->table_lock);
+}
+
+
+void
+ipset_node_cache_remove_root(ipset_node_cache_t *cache,
+                             ipset_node_id_t *root)
+{
+    if (cache->concurrent)
+        g_mutex_lock(&cache->table_lock);
+
+    g_hash_table_remove(cache->roots, root);
+
+    if (cache->concurrent)
+        g_mutex_unlock(&cache->table_lock);
+}
+
+
+/**
+ * Add the node stored in a registered root location to the mark
+ * stack.
+ */
+
+static void
+push_root(gpointer key, gpointer value, gpointer user_data)
+{
+    ipset_node_id_t  *root = (ipset_node_id_t *) key;
+    GArray  *stack = (GArray *) user_data;
+
+    g_d_debug("Root %p holds node %u", root, *root);
+    g_array_append_val(stack, *root);
+}
+
+
+/**
+ * Returns whether an entry in the computed table is valid, but refers
+ * to a node that has been released.  Not every operand is a node:
+ * binary operations leave their third operand as IPSET_NULL_NODE,
+ * EXISTS keeps a variable number in its second, and COMBINE and MAP
+ * keep a token in their third.
+ */
+
+static gboolean
+op_entry_is_dead(ipset_node_cache_t *cache, ipset_op_entry_t *entry)
+{
+    if (entry->epoch != cache->op_cache_epoch)
+        return FALSE;
+
+    if (ipset_node_cache_is_released(cache, entry->key.f) ||
+        ipset_node_cache_is_released(cache, entry->result))
+    {
+        return TRUE;
+    }
+
+    switch (entry->key.op)
+    {
+        case IPSET_OP_EXISTS:
+        case IPSET_OP_MAP:
+            return FALSE;
+
+        case IPSET_OP_ITE:
+            return
+                ipset_node_cache_is_released(cache, entry->key.g) ||
+                ipset_node_cache_is_released(cache, entry->key.h);
+
+        default:
+            return ipset_node_cache_is_released(cache, entry->key.g);
+    }
+}
+
+
+/**
+ * Collect garbage.  In a concurrent cache, the caller must hold the
+ * operation lock for writing.
+ */
+
+static gsize
+collect(ipset_node_cache_t *cache)
+{
+    guint32  node_count = cache->next_index;
+    guint32  index;
+    gsize  reclaimed = 0;
+
+    g_d_debug("Collecting garbage (%" G_GSIZE_FORMAT
+              " nodes in the unique table)",
+              ipset_node_cache_node_count(cache));
+
+    /*
+     * First, count how many parents each live node has.  Any node
+     * with more references than parents is being held onto by
+     * someone outside of the node cache.
+     */
+
+    guint32  *parent_counts = g_new0(guint32, node_count);
+
+    for (index = 1; index < node_count; index++)
+    {
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, ipset_index_to_node_id(index));
+
+        if (node->released)
+            continue;
+
+        if (ipset_node_get_type(node->low) == IPSET_NONTERMINAL_NODE)
+            parent_counts[ipset_node_id_to_index(node->low)]++;
+
+        if (ipset_node_get_type(node->high) == IPSET_NONTERMINAL_NODE)
+            parent_counts[ipset_node_id_to_index(node->high)]++;
+    }
+
+    /*
+     * Seed the mark stack with the registered roots, and with any
+     * node that's referenced from outside the node cache.
+     */
+
+    GArray  *stack = g_array_new(FALSE, FALSE, sizeof(ipset_node_id_t));
+
+    if (cache->concurrent)
+        g_mutex_lock(&cache->table_lock);
+
+    g_hash_table_foreach(cache->roots, push_root, stack);
+
+    if (cache->concurrent)
+        g_mutex_unlock(&cache->table_lock);
+
+    for (index = 1; index < node_count; index++)
+    {
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, ipset_index_to_node_id(index));
+
+        if (node->released)
+            continue;
+
+        if ((node->refcount == IPSET_NODE_MAX_REFCOUNT) ||
+            (node->refcount > parent_counts[index]))
+        {
+            ipset_node_id_t  node_id = ipset_index_to_node_id(index);
+            g_array_append_val(stack, node_id);
+        }
+    }
+
+    g_free(parent_counts);
+
+    /*
+     * Mark every node that's reachable from the stack.
+     */
+
+    guint8  *marked = g_new0(guint8, node_count);
+
+    while (stack->len > 0)
+    {
+        ipset_node_id_t  node_id =
+            g_array_index(stack, ipset_node_id_t, stack->len - 1);
+        g_array_set_size(stack, stack->len - 1);
+
+        if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE)
+            continue;
+
+        index = ipset_node_id_to_index(node_id);
+        if (marked[index])
+            continue;
+
+        marked[index] = TRUE;
+
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, node_id);
+        g_array_append_val(stack, node->low);
+        g_array_append_val(stack, node->high);
+    }
+
+    g_array_free(stack, TRUE);
+
+    /*
+     * Sweep away every live node that wasn't marked.  If a dead node
+     * has a child that survives, the child loses the reference that
+     * the dead node was holding.
+     */
+
+    for (index = 1; index < node_count; index++)
+    {
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, ipset_index_to_node_id(index));
+
+        if (node->released || marked[index])
+            continue;
+
+        g_d_debug("Reclaiming node %u", ipset_index_to_node_id(index));
+
+        ipset_node_cache_unique_remove(cache, node);
+        node->released = TRUE;
+        g_array_append_val(cache->pending_indices, index);
+        reclaimed++;
+
+        if (cache->concurrent)
+            continue;
+
+        ipset_node_id_t  children[2] = { node->low, node->high };
+        guint  i;
+
+        for (i = 0; i < 2; i++)
+        {
+            if (ipset_node_get_type(children[i]) == IPSET_TERMINAL_NODE)
+                continue;
+
+            if (!marked[ipset_node_id_to_index(children[i])])
+                continue;
+
+            ipset_node_t  *child = ipset_node_cache_get_nonterminal
+                (cache, children[i]);
+
+            if (child->refcount != IPSET_NODE_MAX_REFCOUNT)
+                child->refcount--;
+        }
+    }
+
+    g_free(marked);
+
+    /*
+     * Purge any computed table entries that mention a released node.
+     * Once that's done, nothing refers to the released nodes anymore,
+     * so their arena slots can be reused right away.  We can't reach
+     * into the threads' private tables in a concurrent cache, so we
+     * flush them all instead.
+     */
+
+    if (cache->concurrent)
+    {
+        if (reclaimed > 0)
+            ipset_node_cache_flush_operations(cache);
+    } else {
+        for (index = 0; index < cache->op_cache_size; index++)
+        {
+            if (op_entry_is_dead(cache, &cache->op_cache[index]))
+                cache->op_cache[index].epoch = 0;
+        }
+    }
+
+    g_array_append_vals(cache->free_indices,
+                        cache->pending_indices->data,
+                        cache->pending_indices->len);
+    g_array_set_size(cache->pending_indices, 0);
+
+    g_d_debug("Reclaimed %" G_GSIZE_FORMAT " nodes (%" G_GSIZE_FORMAT
+              " remaining)",
+              reclaimed, ipset_node_cache_node_count(cache));
+
+    return reclaimed;
+}
+
+
+gsize
+ipset_node_cache_collect(ipset_node_cache_t *cache)
+{
+    gsize  reclaimed;
+
+    ipset_node_cache_exclusive_begin(cache);
+    reclaimed = collect(cache);
+    ipset_node_cache_exclusive_end(cache);
+
+    return reclaimed;
+}
+
+
+/**
+ * Collect garbage, and then adjust the collection threshold.  In a
+ * concurrent cache, the caller must hold the operation lock for
+ * writing.
+ */
+
+static void
+collect_and_adjust(ipset_node_cache_t *cache)
+{
+    collect(cache);
+
+    /*
+     * If the live nodes still take up more than half of the
+     * threshold, raise it so that collections stay infrequent
+     * relative to the size of the cache.
+     */
+
+    gsize  live_count = ipset_node_cache_node_count(cache);
+    if (live_count > cache->gc_threshold / 2)
+    {
+        cache->gc_threshold = live_count * 2;
+        g_d_debug("Raising collection threshold to %" G_GSIZE_FORMAT,
+                  cache->gc_threshold);
+    }
+}
+
+
+void
+ipset_node_cache_collect_if_needed(ipset_node_cache_t *cache)
+{
+    if (cache->gc_threshold == 0)
+        return;
+
+    if (ipset_node_cache_node_count(cache) <= cache->gc_threshold)
+        return;
+
+    if (!cache->concurrent)
+    {
+        collect_and_adjust(cache);
+        return;
+    }
+
+    /*
+     * In a concurrent cache, we're called in the middle of an
+     * operation, so we have to let go of our own hold on the
+     * operation lock first.  Another thread might have collected
+     * garbage while we were waiting for the lock, so we check the
+     * threshold again once we have it.
+     */
+
+    g_rw_lock_reader_unlock(&cache->operation_lock);
+    ipset_node_cache_exclusive_begin(cache);
+
+    if (ipset_node_cache_node_count(cache) > cache->gc_threshold)
+        collect_and_adjust(cache);
+
+    ipset_node_cache_exclusive_end(cache);
+    g_rw_lock_reader_lock(&cache->operation_lock);
+}
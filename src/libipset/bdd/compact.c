@@ -0,0 +1,348 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/logging.h>
+
+
+/**
+ * Count how many registered roots point at each nonterminal.
+ */
+
+static void
+count_root(gpointer key, gpointer value, gpointer user_data)
+{
+    ipset_node_id_t  *root = (ipset_node_id_t *) key;
+    guint32  *root_counts = (guint32 *) user_data;
+
+    if (ipset_node_get_type(*root) == IPSET_NONTERMINAL_NODE)
+        root_counts[ipset_node_id_to_index(*root)]++;
+}
+
+
+/**
+ * Return the new ID of a node that might have been moved.  A
+ * complemented ID stays complemented.
+ */
+
+static inline ipset_node_id_t
+relocate(const guint32 *new_indices, ipset_node_id_t node_id)
+{
+    if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE)
+        return node_id;
+
+    guint32  new_index = new_indices[ipset_node_id_to_index(node_id)];
+    if (new_index == 0)
+        return node_id;
+
+    return ipset_index_to_node_id(new_index) |
+        (node_id & IPSET_NODE_COMPLEMENT_BIT);
+}
+
+
+/**
+ * Point a registered root at the new location of its node.
+ */
+
+static void
+relocate_root(gpointer key, gpointer value, gpointer user_data)
+{
+    ipset_node_id_t  *root = (ipset_node_id_t *) key;
+    const guint32  *new_indices = (const guint32 *) user_data;
+
+    *root = relocate(new_indices, *root);
+}
+
+
+/**
+ * Call a function for each registered root.  In a concurrent cache,
+ * other threads can register roots while we're working, so we hold
+ * the table lock while walking through them.
+ */
+
+static void
+foreach_root(ipset_node_cache_t *cache, GHFunc func, gpointer user_data)
+{
+    if (cache->concurrent)
+        g_mutex_lock(&cache->table_lock);
+
+    g_hash_table_foreach(cache->roots, func, user_data);
+
+    if (cache->concurrent)
+        g_mutex_unlock(&cache->table_lock);
+}
+
+
+static gsize
+compact(ipset_node_cache_t *cache,
+        ipset_node_id_t root)
+{
+    guint32  node_count = cache->next_index;
+    guint32  index;
+
+    if (ipset_node_get_type(root) == IPSET_TERMINAL_NODE)
+        return 0;
+
+    /*
+     * We can only move a node if we can find every reference to it.
+     * References from parent nodes and registered roots are fine,
+     * since we can rewrite those.  A node with any other references
+     * (or whose count has saturated) has to stay where it is.
+     */
+
+    guint32  *known_refs = g_new0(guint32, node_count);
+
+    for (index = 1; index < node_count; index++)
+    {
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, ipset_index_to_node_id(index));
+
+        if (node->released)
+            continue;
+
+        if (ipset_node_get_type(node->low) == IPSET_NONTERMINAL_NODE)
+            known_refs[ipset_node_id_to_index(node->low)]++;
+
+        if (ipset_node_get_type(node->high) == IPSET_NONTERMINAL_NODE)
+            known_refs[ipset_node_id_to_index(node->high)]++;
+    }
+
+    foreach_root(cache, count_root, known_refs);
+
+    /*
+     * Walk the BDD in depth-first order, low branch first, and list
+     * the nodes that we can move.  Placing the nodes in this order
+     * means that each node's low child usually sits right next to it,
+     * and that the top few levels of the BDD, which every lookup
+     * passes through, are packed together.
+     */
+
+    guint8  *visited = g_new0(guint8, node_count);
+    GArray  *order = g_array_new(FALSE, FALSE, sizeof(guint32));
+    GArray  *stack = g_array_new(FALSE, FALSE, sizeof(ipset_node_id_t));
+
+    g_array_append_val(stack, root);
+
+    while (stack->len > 0)
+    {
+        ipset_node_id_t  node_id =
+            g_array_index(stack, ipset_node_id_t, stack->len - 1);
+        g_array_set_size(stack, stack->len - 1);
+
+        if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE)
+            continue;
+
+        index = ipset_node_id_to_index(node_id);
+        if (visited[index])
+            continue;
+
+        visited[index] = TRUE;
+
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, node_id);
+
+        if ((node->refcount != IPSET_NODE_MAX_REFCOUNT) &&
+            (node->refcount <= known_refs[index]))
+        {
+            g_array_append_val(order, index);
+        }
+
+        /*
+         * Push the high child first, so that we visit the low child
+         * next.
+         */
+
+        g_array_append_val(stack, node->high);
+        g_array_append_val(stack, node->low);
+    }
+
+    g_array_free(stack, TRUE);
+    g_free(known_refs);
+
+    gsize  moved = order->len;
+
+    if (moved == 0)
+    {
+        g_d_debug("Can't compact BDD %u", root);
+        g_free(visited);
+        g_array_free(order, TRUE);
+        return 0;
+    }
+
+    /*
+     * The nodes that we're moving, and any released slots, are all
+     * fair game for the new copies.  Released slots that are still
+     * waiting on a flush are fine, too, since we flush the computed
+     * table below.  We reuse the visited array to mark which of the
+     * nodes are moving.
+     */
+
+    memset(visited, 0, node_count);
+
+    guint  i;
+
+    for (i = 0; i < order->len; i++)
+        visited[g_array_index(order, guint32, i)] = TRUE;
+
+    /*
+     * Find the lowest run of available slots that can hold the whole
+     * BDD.  If there isn't one, we use the run at the end of the
+     * arena, and grow the arena by however much more room we need.
+     */
+
+    guint32  run_start = 1;
+    guint32  run_length = 0;
+
+    for (index = 1; index < node_count; index++)
+    {
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, ipset_index_to_node_id(index));
+
+        if (node->released || visited[index])
+        {
+            if (run_length == 0)
+                run_start = index;
+
+            if (++run_length == moved)
+                break;
+        } else {
+            run_length = 0;
+        }
+    }
+
+    g_free(visited);
+
+    if (run_length == 0)
+        run_start = node_count;
+
+    if ((run_length < moved) &&
+        !ipset_node_cache_arena_reserve(cache, moved - run_length))
+    {
+        g_d_debug("Can't compact BDD %u", root);
+        g_array_free(order, TRUE);
+        return 0;
+    }
+
+    if (run_length < moved)
+        cache->next_index += moved - run_length;
+
+    g_d_debug("Compacting %" G_GSIZE_FORMAT " nodes of BDD %u "
+              "into slots %u-%" G_GSIZE_FORMAT,
+              moved, root, run_start, run_start + moved - 1);
+
+    /*
+     * Some of the new slots might be holding nodes that haven't
+     * moved yet, so we copy all of the nodes out of the way first,
+     * and then copy each one into its new slot.
+     */
+
+    ipset_node_t  *copies = g_new(ipset_node_t, moved);
+    guint32  *new_indices = g_new0(guint32, node_count);
+
+    for (i = 0; i < order->len; i++)
+    {
+        guint32  old_index = g_array_index(order, guint32, i);
+        ipset_node_t  *old_node = ipset_node_cache_get_nonterminal
+            (cache, ipset_index_to_node_id(old_index));
+
+        copies[i] = *old_node;
+        old_node->released = TRUE;
+        new_indices[old_index] = run_start + i;
+    }
+
+    for (i = 0; i < order->len; i++)
+    {
+        ipset_node_t  *new_node = ipset_node_cache_get_nonterminal
+            (cache, ipset_index_to_node_id(run_start + i));
+        *new_node = copies[i];
+    }
+
+    g_free(copies);
+    g_array_free(order, TRUE);
+
+    /*
+     * Point every live node, and every registered root, at the new
+     * locations of the nodes that moved.
+     */
+
+    for (index = 1; index < cache->next_index; index++)
+    {
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, ipset_index_to_node_id(index));
+
+        if (node->released)
+            continue;
+
+        node->low = relocate(new_indices, node->low);
+        node->high = relocate(new_indices, node->high);
+    }
+
+    foreach_root(cache, relocate_root, new_indices);
+    g_free(new_indices);
+    cache->compactions++;
+
+    /*
+     * The contents of any node with a moved child have changed, so
+     * the unique table has to be rebuilt.  The computed table might
+     * mention the old IDs, so we flush it, after which the old
+     * slots (and any others waiting on a flush) can be reused.
+     */
+
+    ipset_node_cache_unique_rebuild(cache);
+    ipset_node_cache_flush_operations(cache);
+
+    /*
+     * Give back any empty slots at the end of the arena, and then
+     * rebuild the free list from whatever released slots are left.
+     * We add them from the top down, since we hand out free slots
+     * from the end of the list, and we'd like to fill in the lowest
+     * ones first.
+     */
+
+    while ((cache->next_index > 1) &&
+           ipset_node_cache_get_nonterminal
+           (cache, ipset_index_to_node_id(cache->next_index - 1))
+           ->released)
+    {
+        cache->next_index--;
+    }
+
+    g_array_set_size(cache->free_indices, 0);
+    g_array_set_size(cache->pending_indices, 0);
+
+    for (index = cache->next_index - 1; index >= 1; index--)
+    {
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, ipset_index_to_node_id(index));
+
+        if (node->released)
+            g_array_append_val(cache->free_indices, index);
+    }
+
+    return moved;
+}
+
+
+gsize
+ipset_node_cache_compact(ipset_node_cache_t *cache,
+                         ipset_node_id_t root)
+{
+    gsize  moved;
+
+    ipset_node_cache_exclusive_begin(cache);
+    moved = compact(cache, root);
+    ipset_node_cache_exclusive_end(cache);
+
+    return moved;
+}
@@ -0,0 +1,141 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/logging.h>
+
+
+/**
+ * The serial number of the next concurrent cache.
+ */
+
+static gint  next_serial = 1;
+
+
+ipset_node_cache_t *
+ipset_node_cache_new_concurrent()
+{
+    ipset_node_cache_t  *cache = ipset_node_cache_new();
+
+    cache->concurrent = TRUE;
+    cache->serial = (guint) g_atomic_int_add(&next_serial, 1);
+    cache->shared_free_count = cache->free_indices->len;
+    g_rw_lock_init(&cache->operation_lock);
+    g_mutex_init(&cache->table_lock);
+
+    g_d_debug("Created concurrent node cache %u", cache->serial);
+    return cache;
+}
+
+
+void
+ipset_node_cache_begin(ipset_node_cache_t *cache)
+{
+    if (cache->concurrent)
+        g_rw_lock_reader_lock(&cache->operation_lock);
+}
+
+
+void
+ipset_node_cache_end(ipset_node_cache_t *cache)
+{
+    if (cache->concurrent)
+        g_rw_lock_reader_unlock(&cache->operation_lock);
+}
+
+
+void
+ipset_node_cache_exclusive_begin(ipset_node_cache_t *cache)
+{
+    if (!cache->concurrent)
+        return;
+
+    g_rw_lock_writer_lock(&cache->operation_lock);
+
+    /*
+     * Threads claim free arena slots from the end of the free list,
+     * and then take fresh slots from the end of the arena once the
+     * list runs out.  Trim off the slots that have been claimed, and
+     * undo any overshoot past the largest index.
+     */
+
+    g_array_set_size(cache->free_indices,
+                     MAX(cache->shared_free_count, 0));
+
+    if (cache->next_index > IPSET_NODE_MAX_INDEX + 1)
+        cache->next_index = IPSET_NODE_MAX_INDEX + 1;
+}
+
+
+void
+ipset_node_cache_exclusive_end(ipset_node_cache_t *cache)
+{
+    if (!cache->concurrent)
+        return;
+
+    /*
+     * Released nodes might still appear in the threads' computed
+     * tables.  Moving to a new epoch makes each thread flush its
+     * table before its next operation, after which the released
+     * slots can be reused.
+     */
+
+    if (cache->pending_indices->len > 0)
+    {
+        ipset_node_cache_flush_operations(cache);
+        g_array_append_vals(cache->free_indices,
+                            cache->pending_indices->data,
+                            cache->pending_indices->len);
+        g_array_set_size(cache->pending_indices, 0);
+    }
+
+    ipset_node_cache_unique_make_room(cache);
+
+    cache->shared_free_count = cache->free_indices->len;
+    g_rw_lock_writer_unlock(&cache->operation_lock);
+}
+
+
+void
+ipset_node_cache_make_room(ipset_node_cache_t *cache)
+{
+    if (!cache->concurrent)
+    {
+        ipset_node_cache_trim(cache);
+        return;
+    }
+
+    /*
+     * We have to let go of our own hold on the operation lock before
+     * the collector can take it over.  That's safe, since everything
+     * that we care about is reachable from a root.
+     */
+
+    g_d_debug("Making room in concurrent node cache %u", cache->serial);
+
+    g_rw_lock_reader_unlock(&cache->operation_lock);
+    ipset_node_cache_collect(cache);
+
+    /*
+     * If collecting garbage didn't leave the unique table mostly
+     * empty, the operation that failed might need more room than
+     * that, so we double the table's size, too.
+     */
+
+    ipset_node_cache_exclusive_begin(cache);
+
+    if (ipset_node_cache_node_count(cache) > cache->unique.capacity / 8)
+        ipset_node_cache_unique_reserve(cache, cache->unique.capacity);
+
+    ipset_node_cache_exclusive_end(cache);
+    g_rw_lock_reader_lock(&cache->operation_lock);
+}
@@ -0,0 +1,340 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/logging.h>
+
+
+/*
+ * All of the arithmetic here is modulo 2^128.  Every count that we
+ * produce for a nonterminal is smaller than that, so any intermediate
+ * result that wraps around (such as the 2^128 that we subtract from
+ * when complementing a node that tests variable 1 of 128) still gives
+ * the right answer in the end.
+ */
+
+ipset_node_count_t
+ipset_node_count_add(ipset_node_count_t a, ipset_node_count_t b)
+{
+    ipset_node_count_t  result;
+
+    result.low = a.low + b.low;
+    result.high = a.high + b.high + ((result.low < a.low)? 1: 0);
+    return result;
+}
+
+
+ipset_node_count_t
+ipset_node_count_sub(ipset_node_count_t a, ipset_node_count_t b)
+{
+    ipset_node_count_t  result;
+
+    result.low = a.low - b.low;
+    result.high = a.high - b.high - ((a.low < b.low)? 1: 0);
+    return result;
+}
+
+
+gboolean
+ipset_node_count_less(ipset_node_count_t a, ipset_node_count_t b)
+{
+    return (a.high < b.high) || ((a.high == b.high) && (a.low < b.low));
+}
+
+
+static inline ipset_node_count_t
+count_shift(ipset_node_count_t a, guint shift)
+{
+    ipset_node_count_t  result;
+
+    if (shift == 0)
+    {
+        return a;
+    } else if (shift < 64) {
+        result.high = (a.high << shift) | (a.low >> (64 - shift));
+        result.low = a.low << shift;
+    } else if (shift < 128) {
+        result.high = a.low << (shift - 64);
+        result.low = 0;
+    } else {
+        result.high = 0;
+        result.low = 0;
+    }
+
+    return result;
+}
+
+
+static inline ipset_node_count_t
+count_power(guint exponent)
+{
+    ipset_node_count_t  one = { 0, 1 };
+    return count_shift(one, exponent);
+}
+
+
+/**
+ * Return the variable that a node tests.  Terminals act as if they
+ * test the variable just past the last one that we're counting.
+ */
+
+static inline ipset_variable_t
+node_variable(ipset_node_counter_t *counter, ipset_node_id_t node_id)
+{
+    if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE)
+        return counter->last_variable + 1;
+
+    return ipset_node_cache_get_nonterminal
+        (counter->cache, node_id)->variable;
+}
+
+
+static ipset_node_count_t
+count_node(ipset_node_counter_t *counter, ipset_node_id_t node_id);
+
+
+/**
+ * Count the paths through a node, for the variables starting at
+ * variable.  Any variables that the node skips over can take on
+ * either value, doubling the count for each one.
+ */
+
+static ipset_node_count_t
+count_from(ipset_node_counter_t *counter,
+           ipset_node_id_t node_id,
+           ipset_variable_t variable)
+{
+    return count_shift
+        (count_node(counter, node_id),
+         node_variable(counter, node_id) - variable);
+}
+
+
+/**
+ * Count the paths through a node, for the variables starting at the
+ * one that the node tests.  The memo table holds the counts for
+ * uncomplemented nonterminals; the count for a complemented node is
+ * whatever's left over.
+ */
+
+static ipset_node_count_t
+count_node(ipset_node_counter_t *counter, ipset_node_id_t node_id)
+{
+    if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE)
+    {
+        ipset_node_count_t  count =
+            { 0, (ipset_terminal_value(node_id) != 0)? 1: 0 };
+        return count;
+    }
+
+    ipset_node_id_t  regular = ipset_node_regular(node_id);
+    ipset_node_t  *node =
+        ipset_node_cache_get_nonterminal(counter->cache, regular);
+    ipset_node_count_t  *saved = (ipset_node_count_t *)
+        g_hash_table_lookup(counter->memo, GUINT_TO_POINTER(regular));
+    ipset_node_count_t  count;
+
+    if (saved != NULL)
+    {
+        count = *saved;
+    } else {
+        count = ipset_node_count_add
+            (count_from(counter, node->low, node->variable + 1),
+             count_from(counter, node->high, node->variable + 1));
+
+        saved = g_new(ipset_node_count_t, 1);
+        *saved = count;
+        g_hash_table_insert
+            (counter->memo, GUINT_TO_POINTER(regular), saved);
+    }
+
+    if (regular != node_id)
+    {
+        count = ipset_node_count_sub
+            (count_power(counter->last_variable + 1 - node->variable),
+             count);
+    }
+
+    return count;
+}
+
+
+/**
+ * Find the two subtrees that we reach from a node by setting a
+ * variable to 0 or 1.  If the node doesn't test the variable, both
+ * values lead back to the node itself.
+ */
+
+static void
+split(ipset_node_counter_t *counter,
+      ipset_node_id_t node_id,
+      ipset_variable_t variable,
+      ipset_node_id_t *low,
+      ipset_node_id_t *high)
+{
+    if (node_variable(counter, node_id) != variable)
+    {
+        *low = node_id;
+        *high = node_id;
+        return;
+    }
+
+    ipset_node_t  *node =
+        ipset_node_cache_get_nonterminal(counter->cache, node_id);
+
+    *low = ipset_node_low(node, node_id);
+    *high = ipset_node_high(node, node_id);
+}
+
+
+void
+ipset_node_counter_init(ipset_node_counter_t *counter,
+                        ipset_node_cache_t *cache,
+                        ipset_variable_t last_variable)
+{
+    counter->cache = cache;
+    counter->last_variable = last_variable;
+    counter->memo = g_hash_table_new_full
+        (g_direct_hash, g_direct_equal, NULL, g_free);
+}
+
+
+void
+ipset_node_counter_done(ipset_node_counter_t *counter)
+{
+    g_hash_table_destroy(counter->memo);
+    counter->memo = NULL;
+}
+
+
+ipset_node_count_t
+ipset_node_counter_count(ipset_node_counter_t *counter,
+                         ipset_node_id_t node,
+                         ipset_variable_t first_variable)
+{
+    /*
+     * The only count that doesn't fit is the one for a nonzero
+     * terminal across all 128 variables, so we saturate that one.
+     */
+
+    if ((ipset_node_get_type(node) == IPSET_TERMINAL_NODE) &&
+        (ipset_terminal_value(node) != 0) &&
+        (counter->last_variable + 1 - first_variable >= 128))
+    {
+        ipset_node_count_t  all = { G_MAXUINT64, G_MAXUINT64 };
+        return all;
+    }
+
+    return count_from(counter, node, first_variable);
+}
+
+
+gboolean
+ipset_node_counter_select(ipset_node_counter_t *counter,
+                          ipset_node_id_t node,
+                          ipset_variable_t first_variable,
+                          ipset_node_count_t index,
+                          gpointer assignment)
+{
+    ipset_variable_t  variable;
+
+    if (!ipset_node_count_less
+        (index, ipset_node_counter_count(counter, node, first_variable)))
+    {
+        return FALSE;
+    }
+
+    /*
+     * At each level, the paths through the low subtree come before
+     * the paths through the high one, so the index tells us which
+     * way to go.
+     */
+
+    for (variable = first_variable;
+         variable <= counter->last_variable;
+         variable++)
+    {
+        ipset_node_id_t  low, high;
+        split(counter, node, variable, &low, &high);
+
+        ipset_node_count_t  low_count =
+            count_from(counter, low, variable + 1);
+        gboolean  bit = !ipset_node_count_less(index, low_count);
+
+        if (bit)
+        {
+            index = ipset_node_count_sub(index, low_count);
+            node = high;
+        } else {
+            node = low;
+        }
+
+        IPSET_BIT_SET(assignment, variable - first_variable, bit);
+    }
+
+    return TRUE;
+}
+
+
+ipset_node_count_t
+ipset_node_counter_rank(ipset_node_counter_t *counter,
+                        ipset_node_id_t node,
+                        ipset_variable_t first_variable,
+                        gpointer assignment)
+{
+    ipset_node_count_t  rank = { 0, 0 };
+    ipset_variable_t  variable;
+
+    /*
+     * Whenever the assignment takes a high branch, every path through
+     * the low branch comes before it.
+     */
+
+    for (variable = first_variable;
+         variable <= counter->last_variable;
+         variable++)
+    {
+        ipset_node_id_t  low, high;
+        split(counter, node, variable, &low, &high);
+
+        if (IPSET_BIT_GET(assignment, variable - first_variable))
+        {
+            rank = ipset_node_count_add
+                (rank, count_from(counter, low, variable + 1));
+            node = high;
+        } else {
+            node = low;
+        }
+    }
+
+    return rank;
+}
+
+
+ipset_node_count_t
+ipset_node_path_count(ipset_node_cache_t *cache,
+                      ipset_node_id_t node,
+                      ipset_variable_t first_variable,
+                      ipset_variable_t last_variable)
+{
+    ipset_node_counter_t  counter;
+
+    g_d_debug("Counting paths through BDD %u (variables %u-%u)",
+              node, first_variable, last_variable);
+
+    ipset_node_counter_init(&counter, cache, last_variable);
+    ipset_node_count_t  result =
+        ipset_node_counter_count(&counter, node, first_variable);
+    ipset_node_counter_done(&counter);
+
+    return result;
+}
@@ -0,0 +1,123 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/logging.h>
+
+
+/**
+ * Walk two BDDs at once, looking for an assignment that leads both
+ * of them to a nonzero terminal.  The visited table holds every pair
+ * of operands that we've already shown to be disjoint; as soon as we
+ * find a pair that isn't, the whole walk stops, so we never need to
+ * remember that answer.
+ */
+
+static gboolean
+is_disjoint(ipset_node_cache_t *cache,
+            GHashTable *visited,
+            ipset_node_id_t lhs,
+            ipset_node_id_t rhs)
+{
+    gboolean  lhs_terminal =
+        (ipset_node_get_type(lhs) == IPSET_TERMINAL_NODE);
+    gboolean  rhs_terminal =
+        (ipset_node_get_type(rhs) == IPSET_TERMINAL_NODE);
+
+    if (lhs_terminal && rhs_terminal)
+    {
+        return
+            (ipset_terminal_value(lhs) & ipset_terminal_value(rhs)) == 0;
+    }
+
+    /*
+     * A zero terminal is disjoint from anything.  Otherwise, a
+     * nonterminal in a reduced BDD is never constant, so it overlaps
+     * with any nonzero terminal, and with itself.  (A Boolean BDD
+     * never overlaps with its own complement.)
+     */
+
+    if ((lhs_terminal && (ipset_terminal_value(lhs) == 0)) ||
+        (rhs_terminal && (ipset_terminal_value(rhs) == 0)))
+    {
+        return TRUE;
+    }
+
+    if (lhs_terminal || rhs_terminal || (lhs == rhs))
+        return FALSE;
+
+    if (lhs == ipset_node_not(rhs))
+        return TRUE;
+
+    /*
+     * The question is symmetric, so we put the operands in a standard
+     * order before checking the visited table.
+     */
+
+    if (lhs > rhs)
+    {
+        ipset_node_id_t  temp = lhs;
+        lhs = rhs;
+        rhs = temp;
+    }
+
+    guint64  key = (((guint64) lhs) << 32) | ((guint64) rhs);
+
+    if (g_hash_table_lookup_extended(visited, &key, NULL, NULL))
+        return TRUE;
+
+    ipset_node_t  *lhs_node = ipset_node_cache_get_nonterminal(cache, lhs);
+    ipset_node_t  *rhs_node = ipset_node_cache_get_nonterminal(cache, rhs);
+    ipset_variable_t  variable = MIN(lhs_node->variable, rhs_node->variable);
+
+    ipset_node_id_t  lhs_low = lhs, lhs_high = lhs;
+    ipset_node_id_t  rhs_low = rhs, rhs_high = rhs;
+
+    if (lhs_node->variable == variable)
+    {
+        lhs_low = ipset_node_low(lhs_node, lhs);
+        lhs_high = ipset_node_high(lhs_node, lhs);
+    }
+
+    if (rhs_node->variable == variable)
+    {
+        rhs_low = ipset_node_low(rhs_node, rhs);
+        rhs_high = ipset_node_high(rhs_node, rhs);
+    }
+
+    if (!is_disjoint(cache, visited, lhs_low, rhs_low) ||
+        !is_disjoint(cache, visited, lhs_high, rhs_high))
+    {
+        return FALSE;
+    }
+
+    guint64  *saved_key = g_new(guint64, 1);
+    *saved_key = key;
+    g_hash_table_insert(visited, saved_key, NULL);
+    return TRUE;
+}
+
+
+gboolean
+ipset_node_is_disjoint(ipset_node_cache_t *cache,
+                       ipset_node_id_t lhs,
+                       ipset_node_id_t rhs)
+{
+    GHashTable  *visited = g_hash_table_new_full
+        (g_int64_hash, g_int64_equal, g_free, NULL);
+
+    g_d_debug("Checking whether BDDs %u and %u are disjoint", lhs, rhs);
+    gboolean  result = is_disjoint(cache, visited, lhs, rhs);
+
+    g_hash_table_destroy(visited);
+    return result;
+}
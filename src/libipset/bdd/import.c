@@ -0,0 +1,87 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/logging.h>
+
+
+/**
+ * Copy a single source node into the destination cache, using the
+ * memo table to avoid copying any node more than once.
+ */
+
+static ipset_node_id_t
+import_node(ipset_node_cache_t *dst,
+            ipset_node_cache_t *src,
+            GHashTable *copied,
+            ipset_node_id_t src_id)
+{
+    /*
+     * Terminal node IDs only depend on their value, so they're the
+     * same in every cache.
+     */
+
+    if (ipset_node_get_type(src_id) == IPSET_TERMINAL_NODE)
+        return src_id;
+
+    /*
+     * We copy the uncomplemented node, and then apply the original
+     * ID's complement bit to the copy.
+     */
+
+    ipset_node_id_t  complement = src_id & IPSET_NODE_COMPLEMENT_BIT;
+    src_id = ipset_node_regular(src_id);
+
+    gpointer  found;
+
+    if (g_hash_table_lookup_extended(copied,
+                                     GUINT_TO_POINTER(src_id),
+                                     NULL, &found))
+    {
+        return GPOINTER_TO_UINT(found) ^ complement;
+    }
+
+    ipset_node_t  *node = ipset_node_cache_get_nonterminal(src, src_id);
+
+    ipset_node_id_t  low =
+        import_node(dst, src, copied, node->low);
+    if (low == IPSET_NULL_NODE)
+        return IPSET_NULL_NODE;
+
+    ipset_node_id_t  high =
+        import_node(dst, src, copied, node->high);
+
+    ipset_node_id_t  result = ipset_node_cache_nonterminal
+        (dst, node->variable, low, high);
+
+    g_d_debug("Imported node %u as %u", src_id, result);
+
+    if (result == IPSET_NULL_NODE)
+        return IPSET_NULL_NODE;
+
+    g_hash_table_insert(copied,
+                        GUINT_TO_POINTER(src_id),
+                        GUINT_TO_POINTER(result));
+    return result ^ complement;
+}
+
+
+ipset_node_id_t
+ipset_node_cache_import(ipset_node_cache_t *dst,
+                        ipset_node_cache_t *src,
+                        ipset_node_id_t src_root)
+{
+    GHashTable  *copied = g_hash_table_new(NULL, NULL);
+    ipset_node_id_t  result = import_node(dst, src, copied, src_root);
+    g_hash_table_destroy(copied);
+    return result;
+}
@@ -0,0 +1,499 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/logging.h>
+
+
+/**
+ * The number of operand lists that the walk in or_many() keeps at
+ * once.  Each level splits on a larger variable than the one above
+ * it, so we need one level for each of the 129 variables in an IPv6
+ * set, and one more for the terminals below them.  BDDs with more
+ * variables than that make the stack grow.
+ */
+
+#define OR_MANY_INITIAL_LEVELS  130
+
+/**
+ * An entry in the table that memoizes the results of an N-ary
+ * operation.  The key is a sorted list of operands, which lives in
+ * the table's key buffer starting at offset.  An entry with a count
+ * of 0 is empty.
+ */
+
+typedef struct nary_entry
+{
+    guint64  hash;
+    gsize  offset;
+    gsize  count;
+    ipset_node_id_t  result;
+} nary_entry_t;
+
+/**
+ * An open-addressed table that memoizes the results of an N-ary
+ * operation.  Rather than allocating each key separately, we copy
+ * them all into one buffer.
+ */
+
+typedef struct nary_memo
+{
+    nary_entry_t  *entries;
+    gsize  size;
+    gsize  used;
+    GArray  *keys;
+} nary_memo_t;
+
+
+static void
+nary_memo_init(nary_memo_t *memo)
+{
+    memo->size = 64;
+    memo->used = 0;
+    memo->entries = g_new0(nary_entry_t, memo->size);
+    memo->keys = g_array_new(FALSE, FALSE, sizeof(ipset_node_id_t));
+}
+
+
+static void
+nary_memo_done(nary_memo_t *memo)
+{
+    g_free(memo->entries);
+    g_array_free(memo->keys, TRUE);
+}
+
+
+static guint64
+nary_memo_hash(const ipset_node_id_t *operands, gsize count)
+{
+    guint64  hash = count;
+    gsize  i;
+
+    for (i = 0; i < count; i++)
+    {
+        hash = ipset_node_hash64
+            (0, (ipset_node_id_t) (hash ^ (hash >> 32)), operands[i]);
+    }
+
+    return hash;
+}
+
+
+/**
+ * Find the entry for a list of operands, or the empty entry where it
+ * would go.
+ */
+
+static nary_entry_t *
+nary_memo_find(nary_memo_t *memo, guint64 hash,
+               const ipset_node_id_t *operands, gsize count)
+{
+    gsize  mask = memo->size - 1;
+    gsize  index = (gsize) hash & mask;
+
+    for (;;)
+    {
+        nary_entry_t  *entry = &memo->entries[index];
+
+        if (entry->count == 0)
+            return entry;
+
+        if ((entry->hash == hash) && (entry->count == count) &&
+            (memcmp(&g_array_index(memo->keys, ipset_node_id_t,
+                                   entry->offset),
+                    operands,
+                    count * sizeof(ipset_node_id_t)) == 0))
+        {
+            return entry;
+        }
+
+        index = (index + 1) & mask;
+    }
+}
+
+
+static void
+nary_memo_insert(nary_memo_t *memo, guint64 hash,
+                 const ipset_node_id_t *operands, gsize count,
+                 ipset_node_id_t result)
+{
+    /*
+     * Keep the table at most half full, so that probe sequences stay
+     * short.
+     */
+
+    if (2 * (memo->used + 1) > memo->size)
+    {
+        nary_entry_t  *old_entries = memo->entries;
+        gsize  old_size = memo->size;
+        gsize  i;
+
+        memo->size *= 2;
+        memo->entries = g_new0(nary_entry_t, memo->size);
+
+        for (i = 0; i < old_size; i++)
+        {
+            if (old_entries[i].count != 0)
+            {
+                gsize  index = (gsize) old_entries[i].hash;
+
+                while (memo->entries[index & (memo->size - 1)].count != 0)
+                    index++;
+
+                memo->entries[index & (memo->size - 1)] = old_entries[i];
+            }
+        }
+
+        g_free(old_entries);
+    }
+
+    nary_entry_t  *entry = nary_memo_find(memo, hash, operands, count);
+
+    entry->hash = hash;
+    entry->offset = memo->keys->len;
+    entry->count = count;
+    entry->result = result;
+    g_array_append_vals(memo->keys, operands, count);
+    memo->used++;
+}
+
+
+static int
+compare_node_ids(const void *vid1, const void *vid2)
+{
+    ipset_node_id_t  id1 = *(const ipset_node_id_t *) vid1;
+    ipset_node_id_t  id2 = *(const ipset_node_id_t *) vid2;
+
+    return (id1 < id2)? -1: (id1 > id2)? 1: 0;
+}
+
+
+/**
+ * Simplify a list of OR operands in place: sort them, and remove
+ * duplicates and FALSE terminals.  Returns the new number of
+ * operands, or 0 with operands[0] set to TRUE if the result is
+ * trivially TRUE.
+ */
+
+static gsize
+simplify_or_operands(ipset_node_cache_t *cache,
+                     ipset_node_id_t *operands,
+                     gsize count)
+{
+    ipset_node_id_t  n_false = ipset_node_cache_terminal(cache, FALSE);
+    ipset_node_id_t  n_true = ipset_node_cache_terminal(cache, TRUE);
+    gsize  i;
+    gsize  kept = 0;
+
+    qsort(operands, count, sizeof(ipset_node_id_t), compare_node_ids);
+
+    for (i = 0; i < count; i++)
+    {
+        ipset_node_id_t  operand = operands[i];
+
+        if (operand == n_true)
+        {
+            operands[0] = n_true;
+            return 0;
+        }
+
+        if ((operand == n_false) ||
+            ((kept > 0) && (operands[kept - 1] == operand)))
+        {
+            continue;
+        }
+
+        /*
+         * A node and its complement only differ in the complement
+         * bit, so they end up next to each other.  x ∨ ¬x = 1.
+         */
+
+        if ((kept > 0) && (operands[kept - 1] == ipset_node_not(operand)))
+        {
+            operands[0] = n_true;
+            return 0;
+        }
+
+        operands[kept++] = operand;
+    }
+
+    return kept;
+}
+
+
+/**
+ * One level of the walk in or_many().  Each level's list of operands
+ * lives in the walk's operand stack.
+ */
+
+typedef struct or_frame
+{
+    /**
+     * The number of operands in this level's list, and the list's
+     * hash in the memo table.
+     */
+
+    gsize  count;
+    guint64  hash;
+
+    /**
+     * The variable that we're splitting the operands on.
+     */
+
+    ipset_variable_t  variable;
+
+    /**
+     * Whether we're working on the high half of the result yet, and
+     * the result for the low half once we are.
+     */
+
+    gboolean  high;
+    ipset_node_id_t  low_result;
+} or_frame_t;
+
+
+typedef struct or_walk
+{
+    ipset_node_cache_t  *cache;
+    nary_memo_t  memo;
+
+    /**
+     * The operand stack, with room for width operands at each of the
+     * levels.
+     */
+
+    gsize  width;
+    gsize  level_count;
+    ipset_node_id_t  *operands;
+    or_frame_t  *frames;
+} or_walk_t;
+
+
+static inline ipset_node_id_t *
+level_operands(or_walk_t *walk, gsize level)
+{
+    return walk->operands + level * walk->width;
+}
+
+
+/**
+ * Simplify the list of operands at a level, and see if we can find
+ * its result without splitting it: because it's trivial, or because
+ * we've seen it before.  If we can't, set up the level's frame so
+ * that we can split it.
+ */
+
+static gboolean
+or_start(or_walk_t *walk, gsize level, gsize count,
+         ipset_node_id_t *result)
+{
+    ipset_node_cache_t  *cache = walk->cache;
+    ipset_node_id_t  *operands = level_operands(walk, level);
+
+    count = simplify_or_operands(cache, operands, count);
+
+    if (count == 0)
+    {
+        *result = (operands[0] == ipset_node_cache_terminal(cache, TRUE))?
+            operands[0]: ipset_node_cache_terminal(cache, FALSE);
+        return TRUE;
+    }
+
+    if (count == 1)
+    {
+        *result = operands[0];
+        return TRUE;
+    }
+
+    guint64  hash = nary_memo_hash(operands, count);
+    nary_entry_t  *entry =
+        nary_memo_find(&walk->memo, hash, operands, count);
+
+    if (entry->count != 0)
+    {
+        *result = entry->result;
+        return TRUE;
+    }
+
+    /*
+     * Split every operand on the smallest variable that any of them
+     * tests.  There's at least one nonterminal, since otherwise we
+     * would have had a trivial case.
+     */
+
+    ipset_variable_t  min_variable = G_MAXUINT;
+    gsize  i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (ipset_node_get_type(operands[i]) == IPSET_NONTERMINAL_NODE)
+        {
+            ipset_node_t  *node =
+                ipset_node_cache_get_nonterminal(cache, operands[i]);
+            if (node->variable < min_variable)
+                min_variable = node->variable;
+        }
+    }
+
+    or_frame_t  *frame = &walk->frames[level];
+    frame->count = count;
+    frame->hash = hash;
+    frame->variable = min_variable;
+    frame->high = FALSE;
+    frame->low_result = IPSET_NULL_NODE;
+    return FALSE;
+}
+
+
+/**
+ * Fill in the next level of the operand stack with one half of the
+ * operands at the given level.  Returns the number of operands.
+ */
+
+static gsize
+or_split(or_walk_t *walk, gsize level)
+{
+    ipset_node_cache_t  *cache = walk->cache;
+
+    if (level + 1 >= walk->level_count)
+    {
+        walk->level_count *= 2;
+        walk->operands = g_renew(ipset_node_id_t, walk->operands,
+                                 walk->level_count * walk->width);
+        walk->frames = g_renew(or_frame_t, walk->frames,
+                               walk->level_count);
+    }
+
+    or_frame_t  *frame = &walk->frames[level];
+    ipset_node_id_t  *operands = level_operands(walk, level);
+    ipset_node_id_t  *halves = level_operands(walk, level + 1);
+    gsize  i;
+
+    for (i = 0; i < frame->count; i++)
+    {
+        ipset_node_t  *node = NULL;
+
+        if (ipset_node_get_type(operands[i]) == IPSET_NONTERMINAL_NODE)
+            node = ipset_node_cache_get_nonterminal(cache, operands[i]);
+
+        if ((node != NULL) && (node->variable == frame->variable))
+        {
+            halves[i] = frame->high?
+                ipset_node_high(node, operands[i]):
+                ipset_node_low(node, operands[i]);
+        } else {
+            halves[i] = operands[i];
+        }
+    }
+
+    return frame->count;
+}
+
+
+/**
+ * Calculate the OR of the operands at the bottom of the walk's
+ * operand stack.  Rather than recursing, we work our way down and
+ * back up the stack, one level per variable.  Lists of any length,
+ * including two operands, stay in the walk, so that we only touch
+ * our own memo table, and not the cache's computed table.
+ */
+
+static ipset_node_id_t
+or_many(or_walk_t *walk, gsize count)
+{
+    ipset_node_id_t  result;
+    gsize  level = 0;
+
+    if (or_start(walk, 0, count, &result))
+        return result;
+
+    for (;;)
+    {
+        count = or_split(walk, level);
+
+        if (!or_start(walk, level + 1, count, &result))
+        {
+            level++;
+            continue;
+        }
+
+        /*
+         * We have a result for the level below this one.  Once we
+         * have both halves of a level, build its node and pass it up
+         * to the level above.
+         */
+
+        for (;;)
+        {
+            or_frame_t  *frame = &walk->frames[level];
+
+            if (!frame->high)
+            {
+                frame->low_result = result;
+                frame->high = TRUE;
+                break;
+            }
+
+            result = ipset_node_cache_nonterminal
+                (walk->cache, frame->variable, frame->low_result, result);
+
+            if (result == IPSET_NULL_NODE)
+                return IPSET_NULL_NODE;
+
+            nary_memo_insert(&walk->memo, frame->hash,
+                             level_operands(walk, level), frame->count,
+                             result);
+
+            if (level == 0)
+                return result;
+
+            level--;
+        }
+    }
+}
+
+
+ipset_node_id_t
+ipset_node_cache_or_many(ipset_node_cache_t *cache,
+                         const ipset_node_id_t *operands,
+                         gsize count)
+{
+    or_walk_t  walk;
+
+    if (count == 0)
+        return ipset_node_cache_terminal(cache, FALSE);
+
+    /*
+     * The memo table only lives as long as this call; nothing can be
+     * garbage collected while we're working, so its results stay
+     * valid.
+     */
+
+    walk.cache = cache;
+    nary_memo_init(&walk.memo);
+    walk.width = count;
+    walk.level_count = OR_MANY_INITIAL_LEVELS;
+    walk.operands = g_new(ipset_node_id_t, walk.level_count * count);
+    walk.frames = g_new(or_frame_t, walk.level_count);
+    memcpy(walk.operands, operands, count * sizeof(ipset_node_id_t));
+
+    g_d_debug("Applying OR to %" G_GSIZE_FORMAT " operands", count);
+    ipset_node_id_t  result = or_many(&walk, count);
+
+    g_free(walk.operands);
+    g_free(walk.frames);
+    nary_memo_done(&walk.memo);
+    return result;
+}
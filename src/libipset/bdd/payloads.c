@@ -0,0 +1,102 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/logging.h>
+
+
+/**
+ * Return the location of a payload in the dictionary, in the same
+ * way that the arena finds a node.  Chunk k holds
+ * IPSET_PAYLOAD_CHUNK_BASE_SIZE × 2^k payloads, so the highest set bit
+ * of the offset value tells us which chunk the payload lives in.
+ */
+
+static inline guint64 *
+payload_slot(guint64 **chunks, guint32 value, gboolean allocate)
+{
+    guint32  offset_value = value + IPSET_PAYLOAD_CHUNK_BASE_SIZE;
+    guint  top_bit = g_bit_storage(offset_value) - 1;
+    guint  chunk = top_bit - IPSET_PAYLOAD_CHUNK_BASE_BITS;
+    guint64  *payloads = g_atomic_pointer_get(&chunks[chunk]);
+
+    if (G_UNLIKELY(payloads == NULL))
+    {
+        if (!allocate)
+            return NULL;
+
+        payloads = g_new(guint64, 1u << top_bit);
+        g_atomic_pointer_set(&chunks[chunk], payloads);
+    }
+
+    return &payloads[offset_value - (1u << top_bit)];
+}
+
+
+ipset_range_t
+ipset_node_cache_payload_value(ipset_node_cache_t *cache,
+                               guint64 payload)
+{
+    gpointer  found;
+    ipset_range_t  value;
+
+    if (cache->concurrent)
+        g_mutex_lock(&cache->table_lock);
+
+    if (g_hash_table_lookup_extended(cache->payload_values, &payload,
+                                     NULL, &found))
+    {
+        value = GPOINTER_TO_INT(found);
+        goto done;
+    }
+
+    /*
+     * This is a new payload, so it gets the next unused terminal
+     * value.  We store the payload before publishing the new count,
+     * so that a reader that sees the count will also see the payload.
+     */
+
+    value = cache->payload_count;
+    guint64  *key = g_new(guint64, 1);
+
+    g_d_debug("Adding payload %" G_GUINT64_FORMAT " as value %d",
+              payload, value);
+
+    *payload_slot(cache->payload_chunks, value, TRUE) = payload;
+    g_atomic_int_set(&cache->payload_count, value + 1);
+
+    *key = payload;
+    g_hash_table_insert(cache->payload_values, key,
+                        GINT_TO_POINTER(value));
+
+  done:
+    if (cache->concurrent)
+        g_mutex_unlock(&cache->table_lock);
+
+    return value;
+}
+
+
+guint64
+ipset_node_cache_payload(ipset_node_cache_t *cache,
+                         ipset_range_t value)
+{
+    /*
+     * Payloads never move or change once they've been published, so
+     * we don't need a lock, even in a concurrent cache.
+     */
+
+    if ((value < 0) || (value >= g_atomic_int_get(&cache->payload_count)))
+        return 0;
+
+    return *payload_slot(cache->payload_chunks, value, FALSE);
+}
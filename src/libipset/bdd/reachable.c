@@ -19,7 +19,8 @@
 
 
 gsize
-ipset_node_reachable_count(ipset_node_id_t node)
+ipset_node_reachable_count(ipset_node_cache_t *cache,
+                           ipset_node_id_t node)
 {
     /*
      * Create a set to track when we've visited a given node.
@@ -35,8 +36,9 @@ ipset_node_reachable_count(ipset_node_id_t node)
 
     if (ipset_node_get_type(node) == IPSET_NONTERMINAL_NODE)
     {
-        g_d_debug("Adding node %p to queue", node);
-        g_queue_push_tail(&queue, node);
+        g_d_debug("Adding node %u to queue", node);
+        g_queue_push_tail(&queue,
+                          GUINT_TO_POINTER(ipset_node_regular(node)));
     }
 
     /*
@@ -51,7 +53,7 @@ ipset_node_reachable_count(ipset_node_id_t node)
 
     while (!g_queue_is_empty(&queue))
     {
-        ipset_node_id_t  curr = g_queue_pop_tail(&queue);
+        gpointer  curr = g_queue_pop_tail(&queue);
 
         /*
          * We don't have to do anything if this node is already in the
@@ -60,7 +62,8 @@ ipset_node_reachable_count(ipset_node_id_t node)
 
         if (!g_hash_table_lookup_extended(visited, curr, NULL, NULL))
         {
-            g_d_debug("Visiting node %p for the first time", curr);
+            g_d_debug("Visiting node %u for the first time",
+                      GPOINTER_TO_UINT(curr));
 
             /*
              * Add the node to the visited set.
@@ -79,20 +82,25 @@ ipset_node_reachable_count(ipset_node_id_t node)
              * queue.
              */
 
-            ipset_node_t  *node = ipset_nonterminal_node(curr);
+            ipset_node_t  *node = ipset_node_cache_get_nonterminal
+                (cache, GPOINTER_TO_UINT(curr));
 
             if (ipset_node_get_type(node->low) ==
                 IPSET_NONTERMINAL_NODE)
             {
-                g_d_debug("Adding node %p to queue", node->low);
-                g_queue_push_tail(&queue, node->low);
+                g_d_debug("Adding node %u to queue", node->low);
+                g_queue_push_tail
+                    (&queue,
+                     GUINT_TO_POINTER(ipset_node_regular(node->low)));
             }
 
             if (ipset_node_get_type(node->high) ==
                 IPSET_NONTERMINAL_NODE)
             {
-                g_d_debug("Adding node %p to queue", node->high);
-                g_queue_push_tail(&queue, node->high);
+                g_d_debug("Adding node %u to queue", node->high);
+                g_queue_push_tail
+                    (&queue,
+                     GUINT_TO_POINTER(ipset_node_regular(node->high)));
             }
         }
     }
@@ -107,7 +115,8 @@ ipset_node_reachable_count(ipset_node_id_t node)
 
 
 gsize
-ipset_node_memory_size(ipset_node_id_t node)
+ipset_node_memory_size(ipset_node_cache_t *cache,
+                       ipset_node_id_t node)
 {
-    return ipset_node_reachable_count(node) * sizeof(ipset_node_t);
+    return ipset_node_reachable_count(cache, node) * sizeof(ipset_node_t);
 }
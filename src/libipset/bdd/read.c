@@ -326,11 +326,11 @@ load_v1(FILE *stream,
              * filled in for this node.
              */
 
-            low_id = g_hash_table_lookup
-                (cache_ids, GINT_TO_POINTER(low));
+            low_id = GPOINTER_TO_UINT(g_hash_table_lookup
+                (cache_ids, GINT_TO_POINTER(low)));
 
             g_d_debug("  Serialized ID %" G_GINT32_FORMAT
-                      " is internal ID %p", low, low_id);
+                      " is internal ID %u", low, low_id);
         }
 
         /*
@@ -350,11 +350,11 @@ load_v1(FILE *stream,
              * filled in for this node.
              */
 
-            high_id = g_hash_table_lookup
-                (cache_ids, GINT_TO_POINTER(high));
+            high_id = GPOINTER_TO_UINT(g_hash_table_lookup
+                (cache_ids, GINT_TO_POINTER(high)));
 
             g_d_debug("  Serialized ID %" G_GINT32_FORMAT
-                      " is internal ID %p", high, high_id);
+                      " is internal ID %u", high, high_id);
         }
 
         /*
@@ -364,7 +364,16 @@ load_v1(FILE *stream,
         result = ipset_node_cache_nonterminal
             (cache, variable, low_id, high_id);
 
-        g_d_debug("Internal node %p = nonterminal(%d,%p,%p)",
+        if (result == IPSET_NULL_NODE)
+        {
+            g_set_error(err,
+                        IPSET_ERROR,
+                        IPSET_ERROR_OUT_OF_MEMORY,
+                        "Not enough memory to load set.");
+            goto error;
+        }
+
+        g_d_debug("Internal node %u = nonterminal(%d,%u,%u)",
                   result, (int) variable, low_id, high_id);
 
         /*
@@ -374,7 +383,7 @@ load_v1(FILE *stream,
 
         g_hash_table_insert(cache_ids,
                             GINT_TO_POINTER(serialized_id),
-                            result);
+                            GUINT_TO_POINTER(result));
     }
 
     /*
@@ -0,0 +1,117 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/logging.h>
+
+
+void
+ipset_node_cache_get_stats(ipset_node_cache_t *cache,
+                           ipset_node_cache_stats_t *stats)
+{
+    guint32  index;
+    guint  i;
+
+    memset(stats, 0, sizeof(ipset_node_cache_stats_t));
+    ipset_node_cache_exclusive_begin(cache);
+
+#if defined(IPSET_CACHE_STATS)
+    stats->counters_enabled = TRUE;
+#else
+    stats->counters_enabled = FALSE;
+#endif
+
+    /*
+     * Count the live nonterminals at each level of the BDD.
+     */
+
+    for (index = 1; index < cache->next_index; index++)
+    {
+        ipset_node_t  *node = ipset_node_cache_get_nonterminal
+            (cache, ipset_index_to_node_id(index));
+
+        if (!node->released)
+            stats->level_counts[node->variable]++;
+    }
+
+    stats->node_count = ipset_node_cache_node_count(cache);
+
+    /*
+     * Unique table statistics.  While the table is being resized,
+     * both the old and new tables count towards its size.
+     */
+
+    stats->unique_capacity =
+        (gsize) cache->unique.capacity +
+        (gsize) cache->old_unique.capacity;
+
+    if (stats->unique_capacity > 0)
+    {
+        stats->unique_load_factor =
+            (double) stats->node_count /
+            (double) stats->unique_capacity;
+    }
+
+    stats->unique_hits = cache->counters.unique_hits;
+    stats->unique_misses = cache->counters.unique_misses;
+
+    guint64  lookups = stats->unique_hits + stats->unique_misses;
+    if (lookups > 0)
+    {
+        stats->unique_avg_probe_length =
+            (double) cache->counters.unique_probes / (double) lookups;
+    }
+
+    /*
+     * Computed table statistics.
+     */
+
+    stats->op_cache_size = cache->op_cache_size;
+
+    for (i = 0; i < IPSET_OP_COUNT; i++)
+    {
+        stats->op_hits[i] = cache->counters.op_hits[i];
+        stats->op_misses[i] = cache->counters.op_misses[i];
+    }
+
+    /*
+     * Memory usage.  Arena chunk k holds IPSET_NODE_CHUNK_BASE_SIZE ×
+     * 2^k nodes.
+     */
+
+    for (i = 0; i < IPSET_NODE_CHUNK_COUNT; i++)
+    {
+        if (cache->chunks[i] != NULL)
+        {
+            stats->arena_bytes +=
+                ((gsize) IPSET_NODE_CHUNK_BASE_SIZE << i) *
+                sizeof(ipset_node_t);
+        }
+    }
+
+    stats->unique_bytes =
+        stats->unique_capacity * sizeof(ipset_unique_slot_t);
+
+    stats->op_cache_bytes =
+        stats->op_cache_size * sizeof(ipset_op_entry_t);
+
+    ipset_node_cache_exclusive_end(cache);
+}
+
+
+void
+ipset_node_cache_reset_stats(ipset_node_cache_t *cache)
+{
+    memset(&cache->counters, 0, sizeof(cache->counters));
+}
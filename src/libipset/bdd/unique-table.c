@@ -0,0 +1,523 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/logging.h>
+
+
+guint64
+ipset_node_hash64(ipset_variable_t variable,
+                  ipset_node_id_t low,
+                  ipset_node_id_t high)
+{
+    /*
+     * Pack the two children into a single 64-bit word, fold in the
+     * variable, and then run the result through the SplitMix64
+     * finalizer, which spreads every input bit across the whole
+     * output.  Node IDs are small, sequential integers, so without
+     * the mixing step, nearby nodes would all land in nearby slots.
+     */
+
+    guint64  hash = (((guint64) low) << 32) | ((guint64) high);
+    hash ^= ((guint64) variable) * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+
+    hash ^= hash >> 30;
+    hash *= G_GUINT64_CONSTANT(0xbf58476d1ce4e5b9);
+    hash ^= hash >> 27;
+    hash *= G_GUINT64_CONSTANT(0x94d049bb133111eb);
+    hash ^= hash >> 31;
+
+    return hash;
+}
+
+
+void
+ipset_unique_table_init(ipset_unique_table_t *table,
+                        guint32 capacity)
+{
+    table->slots = (capacity == 0)? NULL:
+        g_new0(ipset_unique_slot_t, capacity);
+    table->capacity = capacity;
+    table->live_count = 0;
+    table->used_count = 0;
+}
+
+
+void
+ipset_unique_table_done(ipset_unique_table_t *table)
+{
+    g_free(table->slots);
+    ipset_unique_table_init(table, 0);
+}
+
+
+/**
+ * Find the slot that holds a node with the given contents, returning
+ * NULL if there isn't one.
+ */
+
+static ipset_unique_slot_t *
+table_find(ipset_node_cache_t *cache,
+           ipset_unique_table_t *table,
+           guint64 hash,
+           ipset_variable_t variable,
+           ipset_node_id_t low,
+           ipset_node_id_t high)
+{
+    if (table->capacity == 0)
+        return NULL;
+
+    guint32  mask = table->capacity - 1;
+    guint32  index = (guint32) hash & mask;
+
+    while (TRUE)
+    {
+        ipset_unique_slot_t  *slot = &table->slots[index];
+
+        IPSET_CACHE_STAT_INC(cache, unique_probes);
+
+        if (slot->id == IPSET_NULL_NODE)
+            return NULL;
+
+        if ((slot->id != IPSET_UNIQUE_TOMBSTONE) &&
+            (slot->variable == variable) &&
+            (slot->low == low) &&
+            (slot->high == high))
+        {
+            return slot;
+        }
+
+        index = (index + 1) & mask;
+    }
+}
+
+
+/**
+ * Put a node into the first free slot of its probe sequence.  The
+ * caller must ensure that the table has room.
+ */
+
+static void
+table_insert(ipset_unique_table_t *table,
+             guint64 hash,
+             ipset_node_id_t node_id,
+             ipset_variable_t variable,
+             ipset_node_id_t low,
+             ipset_node_id_t high)
+{
+    guint32  mask = table->capacity - 1;
+    guint32  index = (guint32) hash & mask;
+
+    while ((table->slots[index].id != IPSET_NULL_NODE) &&
+           (table->slots[index].id != IPSET_UNIQUE_TOMBSTONE))
+    {
+        index = (index + 1) & mask;
+    }
+
+    ipset_unique_slot_t  *slot = &table->slots[index];
+
+    if (slot->id == IPSET_NULL_NODE)
+        table->used_count++;
+
+    slot->id = node_id;
+    slot->variable = variable;
+    slot->low = low;
+    slot->high = high;
+    table->live_count++;
+}
+
+
+/**
+ * Move up to count slots from the old unique table into the current
+ * one.  Once every slot has been moved, the old table is freed.
+ */
+
+static void
+migrate_slots(ipset_node_cache_t *cache, guint32 count)
+{
+    ipset_unique_table_t  *old = &cache->old_unique;
+
+    if (old->capacity == 0)
+        return;
+
+    while ((count > 0) && (cache->migrate_index < old->capacity))
+    {
+        ipset_unique_slot_t  *slot = &old->slots[cache->migrate_index];
+
+        if ((slot->id != IPSET_NULL_NODE) &&
+            (slot->id != IPSET_UNIQUE_TOMBSTONE))
+        {
+            guint64  hash = ipset_node_hash64
+                (slot->variable, slot->low, slot->high);
+            table_insert(&cache->unique, hash, slot->id,
+                         slot->variable, slot->low, slot->high);
+
+            /*
+             * Leave a tombstone behind, so that lookups for nodes
+             * further along the same probe sequence still work.
+             */
+
+            slot->id = IPSET_UNIQUE_TOMBSTONE;
+            old->live_count--;
+        }
+
+        cache->migrate_index++;
+        count--;
+    }
+
+    if (cache->migrate_index == old->capacity)
+    {
+        g_d_debug("Finished migrating unique table (%u slots)",
+                  cache->unique.capacity);
+        ipset_unique_table_done(old);
+        cache->migrate_index = 0;
+    }
+}
+
+
+/**
+ * Start moving the unique table into a new table with the given
+ * number of slots.  If a previous migration is still in progress, we
+ * finish it first.  Returns FALSE, without starting the migration, if
+ * the new table would put the cache over its memory limit.
+ */
+
+static gboolean
+start_migration(ipset_node_cache_t *cache, guint32 capacity)
+{
+    migrate_slots(cache, G_MAXUINT32);
+
+    if (!ipset_node_cache_has_room
+        (cache, (gsize) capacity * sizeof(ipset_unique_slot_t)))
+    {
+        return FALSE;
+    }
+
+    g_d_debug("Resizing unique table from %u to %u slots",
+              cache->unique.capacity, capacity);
+
+    cache->old_unique = cache->unique;
+    cache->migrate_index = 0;
+    ipset_unique_table_init(&cache->unique, capacity);
+    return TRUE;
+}
+
+
+/**
+ * Return the smallest power-of-two capacity that can hold the given
+ * number of nodes while staying at most half full.
+ */
+
+static guint32
+capacity_for(gsize node_count)
+{
+    guint32  capacity = IPSET_UNIQUE_INITIAL_CAPACITY;
+
+    while (((gsize) capacity) < node_count * 2)
+    {
+        capacity <<= 1;
+    }
+
+    return capacity;
+}
+
+
+ipset_node_id_t
+ipset_node_cache_unique_lookup(ipset_node_cache_t *cache,
+                               ipset_variable_t variable,
+                               ipset_node_id_t low,
+                               ipset_node_id_t high)
+{
+    guint64  hash = ipset_node_hash64(variable, low, high);
+    ipset_unique_slot_t  *slot;
+
+    slot = table_find(cache, &cache->unique, hash, variable, low, high);
+    if (slot == NULL)
+    {
+        slot = table_find
+            (cache, &cache->old_unique, hash, variable, low, high);
+    }
+
+    if (slot != NULL)
+    {
+        IPSET_CACHE_STAT_INC(cache, unique_hits);
+        return slot->id;
+    }
+
+    IPSET_CACHE_STAT_INC(cache, unique_misses);
+    return IPSET_NULL_NODE;
+}
+
+
+gboolean
+ipset_node_cache_unique_insert(ipset_node_cache_t *cache,
+                               ipset_node_id_t node_id,
+                               ipset_node_t *node)
+{
+    /*
+     * If adding this node would make the table more than 3/4 full
+     * (counting tombstones), start moving into a new table.  If most
+     * of the used slots are tombstones, the new table can be the same
+     * size as the old one.
+     *
+     * If we're not allowed to allocate a new table, we can keep
+     * filling the current one, as long as there's always at least one
+     * empty slot to end each probe sequence.
+     */
+
+    ipset_unique_table_t  *table = &cache->unique;
+
+    if ((((guint64) table->used_count + 1) * 4) >
+        ((guint64) table->capacity * 3))
+    {
+        gsize  live_count = ipset_node_cache_node_count(cache) + 1;
+        guint32  capacity = capacity_for(live_count);
+        if (capacity < table->capacity)
+            capacity = table->capacity;
+
+        if (!start_migration(cache, capacity) &&
+            (table->used_count + 2 > table->capacity))
+        {
+            return FALSE;
+        }
+    }
+
+    guint64  hash = ipset_node_hash64
+        (node->variable, node->low, node->high);
+    table_insert(&cache->unique, hash, node_id,
+                 node->variable, node->low, node->high);
+
+    migrate_slots(cache, IPSET_UNIQUE_MIGRATE_STEP);
+    return TRUE;
+}
+
+
+void
+ipset_node_cache_unique_remove(ipset_node_cache_t *cache,
+                               ipset_node_t *node)
+{
+    guint64  hash = ipset_node_hash64
+        (node->variable, node->low, node->high);
+    ipset_unique_table_t  *table = &cache->unique;
+    ipset_unique_slot_t  *slot;
+
+    slot = table_find
+        (cache, table, hash, node->variable, node->low, node->high);
+    if (slot == NULL)
+    {
+        table = &cache->old_unique;
+        slot = table_find
+            (cache, table, hash, node->variable, node->low, node->high);
+    }
+
+    g_assert(slot != NULL);
+    slot->id = IPSET_UNIQUE_TOMBSTONE;
+    table->live_count--;
+}
+
+
+ipset_node_id_t
+ipset_node_cache_unique_claim(ipset_node_cache_t *cache,
+                              ipset_variable_t variable,
+                              ipset_node_id_t low,
+                              ipset_node_id_t high,
+                              ipset_unique_slot_t **slot)
+{
+    /*
+     * A concurrent cache only resizes its unique table while no
+     * operations are running, and always finishes the migration right
+     * away, so we only have to look in the current table.
+     */
+
+    ipset_unique_table_t  *table = &cache->unique;
+    guint64  hash = ipset_node_hash64(variable, low, high);
+    guint32  mask = table->capacity - 1;
+    guint32  index = (guint32) hash & mask;
+
+    *slot = NULL;
+
+    while (TRUE)
+    {
+        ipset_unique_slot_t  *current = &table->slots[index];
+        ipset_node_id_t  id = (ipset_node_id_t)
+            g_atomic_int_get((gint *) &current->id);
+
+        if (id == IPSET_NULL_NODE)
+        {
+            /*
+             * The node isn't in the table.  Try to claim this slot
+             * for it.  If some other thread beat us to it, we look at
+             * the same slot again, since the other thread might be
+             * adding the same node.
+             */
+
+            guint32  used_count = (guint32)
+                g_atomic_int_get((gint *) &table->used_count);
+
+            if ((((guint64) used_count + 1) * 4) >
+                ((guint64) table->capacity * 3))
+            {
+                return IPSET_NULL_NODE;
+            }
+
+            if (g_atomic_int_compare_and_exchange
+                ((gint *) &current->id,
+                 IPSET_NULL_NODE, IPSET_UNIQUE_BUSY))
+            {
+                g_atomic_int_inc((gint *) &table->used_count);
+                *slot = current;
+                return IPSET_NULL_NODE;
+            }
+
+            continue;
+        }
+
+        if (id == IPSET_UNIQUE_BUSY)
+        {
+            /*
+             * Another thread is filling in this slot, and we can't
+             * tell yet whether it's the node we're looking for.
+             */
+
+            g_thread_yield();
+            continue;
+        }
+
+        if ((id != IPSET_UNIQUE_TOMBSTONE) &&
+            (current->variable == variable) &&
+            (current->low == low) &&
+            (current->high == high))
+        {
+            return id;
+        }
+
+        index = (index + 1) & mask;
+    }
+}
+
+
+void
+ipset_node_cache_unique_publish(ipset_node_cache_t *cache,
+                                ipset_unique_slot_t *slot,
+                                ipset_node_id_t node_id,
+                                ipset_node_t *node)
+{
+    slot->variable = node->variable;
+    slot->low = node->low;
+    slot->high = node->high;
+    g_atomic_int_inc((gint *) &cache->unique.live_count);
+
+    /*
+     * Setting the ID last makes sure that any thread that sees it
+     * also sees the rest of the slot, and the node itself.
+     */
+
+    g_atomic_int_set((gint *) &slot->id, node_id);
+}
+
+
+void
+ipset_node_cache_unique_abandon(ipset_node_cache_t *cache,
+                                ipset_unique_slot_t *slot)
+{
+    g_atomic_int_set((gint *) &slot->id, IPSET_UNIQUE_TOMBSTONE);
+}
+
+
+void
+ipset_node_cache_unique_make_room(ipset_node_cache_t *cache)
+{
+    gsize  live_count = ipset_node_cache_node_count(cache);
+
+    migrate_slots(cache, G_MAXUINT32);
+
+    /*
+     * If the table doesn't have room for the nodes that it holds
+     * already, plus as many again, it needs to grow.  If it has room
+     * for them, but it's more than half full of tombstones, we clear
+     * them out.
+     */
+
+    if (capacity_for(live_count * 2) > cache->unique.capacity)
+        ipset_node_cache_unique_reserve(cache, live_count * 2);
+    else if (cache->unique.used_count > cache->unique.capacity / 2)
+        ipset_node_cache_unique_rebuild(cache);
+}
+
+
+gsize
+ipset_node_cache_node_count(ipset_node_cache_t *cache)
+{
+    /*
+     * Other threads might be adding nodes to a concurrent cache, so
+     * we read the counts atomically.
+     */
+
+    return
+        (guint32) g_atomic_int_get((gint *) &cache->unique.live_count) +
+        (guint32) g_atomic_int_get((gint *) &cache->old_unique.live_count);
+}
+
+
+void
+ipset_node_cache_unique_reserve(ipset_node_cache_t *cache,
+                                gsize node_count)
+{
+    guint32  capacity = capacity_for(node_count);
+
+    if (capacity <= cache->unique.capacity)
+        return;
+
+    /*
+     * Start a migration into a table of the right size, and then
+     * finish it right away.
+     */
+
+    if (start_migration(cache, capacity))
+        migrate_slots(cache, G_MAXUINT32);
+}
+
+
+void
+ipset_node_cache_unique_rebuild(ipset_node_cache_t *cache)
+{
+    guint32  index;
+
+    /*
+     * Finish any migration that's in progress, and then empty out the
+     * table in place, so that we don't need any extra memory.
+     */
+
+    migrate_slots(cache, G_MAXUINT32);
+
+    ipset_unique_table_t  *table = &cache->unique;
+    memset(table->slots, 0, table->capacity * sizeof(ipset_unique_slot_t));
+    table->live_count = 0;
+    table->used_count = 0;
+
+    for (index = 1; index < cache->next_index; index++)
+    {
+        ipset_node_id_t  node_id = ipset_index_to_node_id(index);
+        ipset_node_t  *node =
+            ipset_node_cache_get_nonterminal(cache, node_id);
+
+        if (node->released)
+            continue;
+
+        guint64  hash = ipset_node_hash64
+            (node->variable, node->low, node->high);
+        table_insert(table, hash, node_id,
+                     node->variable, node->low, node->high);
+    }
+}
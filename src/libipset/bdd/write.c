@@ -168,6 +168,12 @@ struct save_data
      */
 
     gpointer  user_data;
+
+    /**
+     * The node cache that the BDD's nodes live in.
+     */
+
+    ipset_node_cache_t  *cache;
 };
 
 
@@ -193,7 +199,7 @@ save_visit_node(save_data_t *save_data,
     gboolean  node_exists =
         g_hash_table_lookup_extended
         (save_data->serialized_ids,
-         node_id,
+         GUINT_TO_POINTER(node_id),
          NULL,
          &serialized_ptr);
 
@@ -225,9 +231,10 @@ save_visit_node(save_data_t *save_data,
              * children first, then output the nonterminal node.
              */
 
-            ipset_node_t  *node = ipset_nonterminal_node(node_id);
+            ipset_node_t  *node = ipset_node_cache_get_nonterminal
+                (save_data->cache, node_id);
 
-            g_d_debug("Visiting node %p nonterminal(%u,%p,%p)",
+            g_d_debug("Visiting node %u nonterminal(%u,%u,%u)",
                       node_id, node->variable, node->low, node->high);
 
             /*
@@ -241,19 +248,19 @@ save_visit_node(save_data_t *save_data,
             TRY_OR_RETURN(0,
                           serialized_low = save_visit_node,
                           save_data,
-                          node->low);
+                          ipset_node_low(node, node_id));
 
             TRY_OR_RETURN(0,
                           serialized_high = save_visit_node,
                           save_data,
-                          node->high);
+                          ipset_node_high(node, node_id));
 
             /*
              * Output the nonterminal
              */
 
             result = save_data->next_serialized_id--;
-            g_d_debug("Writing node %p as serialized node %d"
+            g_d_debug("Writing node %u as serialized node %d"
                       " = (%u,%d,%d)",
                       node_id, result,
                       node->variable, serialized_low, serialized_high);
@@ -271,7 +278,8 @@ save_visit_node(save_data_t *save_data,
          * output this node again.
          */
 
-        g_hash_table_insert(save_data->serialized_ids, node_id,
+        g_hash_table_insert(save_data->serialized_ids,
+                            GUINT_TO_POINTER(node_id),
                             GINT_TO_POINTER(result));
     }
 
@@ -294,6 +302,8 @@ save_bdd(save_data_t *save_data,
 {
     gboolean  result = FALSE;
 
+    save_data->cache = cache;
+
     /*
      * First, output the file header.
      */
@@ -485,6 +495,53 @@ static const char  MAGIC_NUMBER[] = "IP set";
 static const gsize  MAGIC_NUMBER_LENGTH = 6;
 
 
+/**
+ * Count the nonterminals that we'll write out for a BDD.  The file
+ * format doesn't have complemented edges, so a node that's reachable
+ * both with and without its complement bit is written twice.
+ */
+
+static gsize
+count_serialized_nodes(ipset_node_cache_t *cache,
+                       ipset_node_id_t root)
+{
+    GHashTable  *visited = g_hash_table_new(NULL, NULL);
+    GArray  *stack = g_array_new(FALSE, FALSE, sizeof(ipset_node_id_t));
+    gsize  node_count = 0;
+
+    g_array_append_val(stack, root);
+
+    while (stack->len > 0)
+    {
+        ipset_node_id_t  node_id =
+            g_array_index(stack, ipset_node_id_t, stack->len - 1);
+        g_array_set_size(stack, stack->len - 1);
+
+        if ((ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE) ||
+            g_hash_table_lookup_extended(visited,
+                                         GUINT_TO_POINTER(node_id),
+                                         NULL, NULL))
+        {
+            continue;
+        }
+
+        g_hash_table_insert(visited, GUINT_TO_POINTER(node_id), NULL);
+        node_count++;
+
+        ipset_node_t  *node =
+            ipset_node_cache_get_nonterminal(cache, node_id);
+        ipset_node_id_t  low = ipset_node_low(node, node_id);
+        ipset_node_id_t  high = ipset_node_high(node, node_id);
+        g_array_append_val(stack, low);
+        g_array_append_val(stack, high);
+    }
+
+    g_array_free(stack, TRUE);
+    g_hash_table_destroy(visited);
+    return node_count;
+}
+
+
 static gboolean
 write_header_v1(save_data_t *save_data,
                 ipset_node_cache_t *cache,
@@ -506,7 +563,7 @@ write_header_v1(save_data_t *save_data,
      * size of the set.
      */
 
-    gsize  nonterminal_count = ipset_node_reachable_count(root);
+    gsize  nonterminal_count = count_serialized_nodes(cache, root);
 
     gsize  set_size =
         MAGIC_NUMBER_LENGTH +    /* magic number */
@@ -21,10 +21,17 @@ ipset_cache = NULL;
 
 int
 ipset_init_library()
+{
+    return ipset_init_library_sized(IPSET_DEFAULT_OP_CACHE_SIZE);
+}
+
+
+int
+ipset_init_library_sized(gsize op_cache_size)
 {
     if (G_UNLIKELY(ipset_cache == NULL))
     {
-        ipset_cache = ipset_node_cache_new();
+        ipset_cache = ipset_node_cache_new_sized(op_cache_size);
 
         if (ipset_cache == NULL)
             return 1;
@@ -34,3 +41,154 @@ ipset_init_library()
         return 0;
     }
 }
+
+
+int
+ipset_init_library_concurrent()
+{
+    if (G_UNLIKELY(ipset_cache == NULL))
+    {
+        ipset_cache = ipset_node_cache_new_concurrent();
+
+        if (ipset_cache == NULL)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+gsize
+ipset_cache_collect()
+{
+    return ipset_node_cache_collect(ipset_cache);
+}
+
+
+void
+ipset_cache_set_gc_threshold(gsize threshold)
+{
+    ipset_cache->gc_threshold = threshold;
+}
+
+
+void
+ipset_cache_reserve(gsize node_count)
+{
+    ipset_node_cache_reserve(ipset_cache, node_count);
+}
+
+
+
+void
+ipset_cache_stats(ipset_cache_stats_t *stats)
+{
+    ipset_node_cache_get_stats(ipset_cache, stats);
+}
+
+
+void
+ipset_cache_reset_stats()
+{
+    ipset_node_cache_reset_stats(ipset_cache);
+}
+
+
+
+void
+ipset_cache_set_memory_limit(gsize bytes)
+{
+    ipset_cache->memory_limit = bytes;
+}
+
+
+gboolean
+ipset_cache_out_of_memory()
+{
+    return ipset_cache->out_of_memory;
+}
+
+
+void
+ipset_cache_set_threads(guint thread_count)
+{
+    ipset_node_cache_set_threads(ipset_cache, thread_count);
+}
+
+
+void
+ipset_cache_set_parallel_depth(guint depth)
+{
+    ipset_cache->parallel_depth = depth;
+}
+
+
+void
+ipset_cache_set_parallel_min_nodes(guint min_nodes)
+{
+    ipset_cache->parallel_min_nodes = min_nodes;
+}
+
+
+ipset_context_t *
+ipset_context_new()
+{
+    return ipset_node_cache_new();
+}
+
+
+ipset_context_t *
+ipset_context_new_concurrent()
+{
+    return ipset_node_cache_new_concurrent();
+}
+
+
+void
+ipset_context_free(ipset_context_t *ctx)
+{
+    ipset_node_cache_free(ctx);
+}
+
+
+void
+ipset_context_stats(ipset_context_t *ctx, ipset_cache_stats_t *stats)
+{
+    ipset_node_cache_get_stats(ctx, stats);
+}
+
+
+void
+ipset_context_set_memory_limit(ipset_context_t *ctx, gsize bytes)
+{
+    ctx->memory_limit = bytes;
+}
+
+
+gboolean
+ipset_context_out_of_memory(ipset_context_t *ctx)
+{
+    return ctx->out_of_memory;
+}
+
+
+void
+ipset_context_set_threads(ipset_context_t *ctx, guint thread_count)
+{
+    ipset_node_cache_set_threads(ctx, thread_count);
+}
+
+
+void
+ipset_context_set_parallel_depth(ipset_context_t *ctx, guint depth)
+{
+    ctx->parallel_depth = depth;
+}
+
+
+void
+ipset_context_set_parallel_min_nodes(ipset_context_t *ctx,
+                                     guint min_nodes)
+{
+    ctx->parallel_min_nodes = min_nodes;
+}
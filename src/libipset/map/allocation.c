@@ -17,21 +17,116 @@
 
 void
 ipmap_init(ip_map_t *map, gint default_value)
+{
+    ipmap_init_in(ipset_cache, map, default_value);
+}
+
+
+void
+ipmap_init_in(ipset_context_t *ctx, ip_map_t *map, gint default_value)
 {
     /*
      * The map starts empty, so every value assignment should yield
      * the default.
      */
 
+    map->cache = ctx;
     map->default_bdd =
-        ipset_node_cache_terminal(ipset_cache, default_value);
+        ipset_node_cache_terminal(ctx, default_value);
 
     map->map_bdd = map->default_bdd;
+    map->payloads = FALSE;
+
+    /*
+     * Let the garbage collector know about the map's BDD.
+     */
+
+    ipset_node_cache_add_root(ctx, &map->map_bdd);
+}
+
+
+/**
+ * The source and destination of a payload map that we're importing.
+ */
+
+typedef struct payload_import
+{
+    ipset_node_cache_t  *src;
+    ipset_node_cache_t  *dst;
+} payload_import_t;
+
+
+/**
+ * Find the destination context's value for the payload that a
+ * terminal value stands for in the source context.
+ */
+
+static ipset_range_t
+import_payload(ipset_range_t value, gpointer user_data)
+{
+    payload_import_t  *import = (payload_import_t *) user_data;
+    return ipset_node_cache_payload_value
+        (import->dst, ipset_node_cache_payload(import->src, value));
+}
+
+
+void
+ipmap_init_import(ipset_context_t *ctx, ip_map_t *map, ip_map_t *src)
+{
+    ipset_node_id_t  imported;
+    gint  default_value = ipset_terminal_value(src->default_bdd);
+    payload_import_t  import;
+
+    /*
+     * Terminal node IDs don't depend on the context, so for a map of
+     * gints, we can use the source map's values directly.  For a map
+     * of payloads, each value is an index into the source context's
+     * dictionary, so we have to look up the same payloads in the
+     * destination's.
+     */
+
+    import.src = src->cache;
+    import.dst = ctx;
+
+    if (src->payloads)
+        default_value = import_payload(default_value, &import);
+
+    ipmap_init_in(ctx, map, default_value);
+    map->payloads = src->payloads;
+
+    /*
+     * If there isn't enough memory to copy the source map, the new
+     * map is left with only its default value.
+     */
+
+    ipset_node_cache_begin(ctx);
+    g_atomic_int_set(&ctx->out_of_memory, FALSE);
+    imported = ipset_node_cache_import(ctx, src->cache, src->map_bdd);
+
+    if ((imported != IPSET_NULL_NODE) && src->payloads)
+    {
+        imported = ipset_node_cache_map_terminals
+            (ctx, imported, import_payload, &import);
+    }
+
+    if (imported == IPSET_NULL_NODE)
+        g_atomic_int_set(&ctx->out_of_memory, TRUE);
+    else
+        map->map_bdd = ipset_node_incref(ctx, imported);
+
+    ipset_node_cache_end(ctx);
 }
 
 
 ip_map_t *
 ipmap_new(gint default_value)
+{
+    return ipmap_new_in(ipset_cache, default_value);
+}
+
+
+ip_map_t *
+ipmap_new_in(ipset_context_t *ctx, gint default_value)
 {
     ip_map_t  *result = NULL;
 
@@ -47,15 +142,92 @@ ipmap_new(gint default_value)
      * If that worked, initialize and return the map.
      */
 
-    ipmap_init(result, default_value);
+    ipmap_init_in(ctx, result, default_value);
+    return result;
+}
+
+
+void
+ipmap_init_uint64(ip_map_t *map, guint64 default_value)
+{
+    ipmap_init_uint64_in(ipset_cache, map, default_value);
+}
+
+
+void
+ipmap_init_uint64_in(ipset_context_t *ctx, ip_map_t *map,
+                     guint64 default_value)
+{
+    /*
+     * Payloads are specific to a context, so the default has to go
+     * into the dictionary of the context that the map lives in.
+     */
+
+    ipmap_init_in(ctx, map, ipset_node_cache_payload_value
+                  (ctx, default_value));
+    map->payloads = TRUE;
+}
+
+
+ip_map_t *
+ipmap_new_uint64(guint64 default_value)
+{
+    return ipmap_new_uint64_in(ipset_cache, default_value);
+}
+
+
+ip_map_t *
+ipmap_new_uint64_in(ipset_context_t *ctx, guint64 default_value)
+{
+    ip_map_t  *result = ipmap_new_in
+        (ctx, ipset_node_cache_payload_value(ctx, default_value));
+
+    if (result != NULL)
+        result->payloads = TRUE;
+
     return result;
 }
 
 
+void
+ipmap_init_ptr(ip_map_t *map, gpointer default_value)
+{
+    ipmap_init_ptr_in(ipset_cache, map, default_value);
+}
+
+
+void
+ipmap_init_ptr_in(ipset_context_t *ctx, ip_map_t *map,
+                  gpointer default_value)
+{
+    ipmap_init_uint64_in(ctx, map, GPOINTER_TO_SIZE(default_value));
+}
+
+
+ip_map_t *
+ipmap_new_ptr(gpointer default_value)
+{
+    return ipmap_new_ptr_in(ipset_cache, default_value);
+}
+
+
+ip_map_t *
+ipmap_new_ptr_in(ipset_context_t *ctx, gpointer default_value)
+{
+    return ipmap_new_uint64_in(ctx, GPOINTER_TO_SIZE(default_value));
+}
+
+
 void
 ipmap_done(ip_map_t *map)
 {
-    /* nothing to do */
+    /*
+     * Give up our reference to the BDD, which releases any nodes
+     * that aren't shared with some other map.
+     */
+
+    ipset_node_cache_remove_root(map->cache, &map->map_bdd);
+    ipset_node_decref(map->cache, map->map_bdd);
 }
 
 
@@ -65,3 +237,15 @@ ipmap_free(ip_map_t *map)
     ipmap_done(map);
     g_slice_free(ip_map_t, map);
 }
+
+
+void
+ipmap_compact(ip_map_t *map)
+{
+    /*
+     * The map's BDD field is a registered root, so it's updated to
+     * point at the moved root node automatically.
+     */
+
+    ipset_node_cache_compact(map->cache, map->map_bdd);
+}
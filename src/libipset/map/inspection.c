@@ -50,7 +50,7 @@ ipmap_is_not_equal(ip_map_t *map1, ip_map_t *map2)
 gsize
 ipmap_memory_size(ip_map_t *map)
 {
-    return ipset_node_memory_size(map->map_bdd);
+    return ipset_node_memory_size(map->cache, map->map_bdd);
 }
 
 
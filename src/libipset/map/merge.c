@@ -0,0 +1,200 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/ipset.h>
+#include <ipset/internal.h>
+
+
+/**
+ * The default values that the built-in combiners need to know about.
+ */
+
+typedef struct merge_defaults
+{
+    ipset_range_t  dst;
+    ipset_range_t  map1;
+    ipset_range_t  map2;
+} merge_defaults_t;
+
+
+static ipset_range_t
+merge_max(ipset_range_t value1, ipset_range_t value2, gpointer user_data)
+{
+    return MAX(value1, value2);
+}
+
+
+static ipset_range_t
+merge_min(ipset_range_t value1, ipset_range_t value2, gpointer user_data)
+{
+    return MIN(value1, value2);
+}
+
+
+static ipset_range_t
+merge_sum(ipset_range_t value1, ipset_range_t value2, gpointer user_data)
+{
+    return value1 + value2;
+}
+
+
+static ipset_range_t
+merge_prefer_left(ipset_range_t value1,
+                  ipset_range_t value2,
+                  gpointer user_data)
+{
+    merge_defaults_t  *defaults = (merge_defaults_t *) user_data;
+    return (value1 != defaults->map1)? value1: value2;
+}
+
+
+static ipset_range_t
+merge_prefer_non_default(ipset_range_t value1,
+                         ipset_range_t value2,
+                         gpointer user_data)
+{
+    merge_defaults_t  *defaults = (merge_defaults_t *) user_data;
+
+    if (value1 != defaults->map1)
+        return value1;
+
+    if (value2 != defaults->map2)
+        return value2;
+
+    return defaults->dst;
+}
+
+
+/**
+ * A user-supplied combiner, and its user data.
+ */
+
+typedef struct merge_callback
+{
+    ipmap_merge_func_t  func;
+    gpointer  user_data;
+} merge_callback_t;
+
+
+static ipset_range_t
+merge_with_callback(ipset_range_t value1,
+                    ipset_range_t value2,
+                    gpointer user_data)
+{
+    merge_callback_t  *callback = (merge_callback_t *) user_data;
+    return callback->func(value1, value2, callback->user_data);
+}
+
+
+/**
+ * Replace dst's BDD with the combination of two other maps' BDDs.  If
+ * we run out of memory, we free up what we can and try again.  If
+ * that still doesn't work, dst is left as it was.
+ */
+
+static void
+merge_maps(ip_map_t *dst,
+           ip_map_t *map1,
+           ip_map_t *map2,
+           ipset_terminal_combiner_t combiner,
+           gpointer user_data)
+{
+    ipset_node_cache_t  *cache = dst->cache;
+    ipset_node_id_t  new_map_bdd;
+
+    ipset_node_cache_begin(cache);
+    g_atomic_int_set(&cache->out_of_memory, FALSE);
+    new_map_bdd = ipset_node_cache_combine
+        (cache, map1->map_bdd, map2->map_bdd, combiner, user_data);
+
+    if (new_map_bdd == IPSET_NULL_NODE)
+    {
+        ipset_node_cache_make_room(cache);
+        new_map_bdd = ipset_node_cache_combine
+            (cache, map1->map_bdd, map2->map_bdd, combiner, user_data);
+
+        if (new_map_bdd == IPSET_NULL_NODE)
+        {
+            g_atomic_int_set(&cache->out_of_memory, TRUE);
+            ipset_node_cache_end(cache);
+            return;
+        }
+    }
+
+    /*
+     * Take the new reference before giving up the old one, in case
+     * they refer to the same node.
+     */
+
+    ipset_node_incref(cache, new_map_bdd);
+    ipset_node_decref(cache, dst->map_bdd);
+    dst->map_bdd = new_map_bdd;
+
+    ipset_node_cache_collect_if_needed(cache);
+    ipset_node_cache_end(cache);
+}
+
+
+void
+ipmap_merge(ip_map_t *dst,
+            ip_map_t *map1,
+            ip_map_t *map2,
+            ipmap_merge_op_t op)
+{
+    merge_defaults_t  defaults;
+    ipset_terminal_combiner_t  combiner;
+
+    defaults.dst = ipset_terminal_value(dst->default_bdd);
+    defaults.map1 = ipset_terminal_value(map1->default_bdd);
+    defaults.map2 = ipset_terminal_value(map2->default_bdd);
+
+    switch (op)
+    {
+        case IPMAP_MERGE_MAX:
+            combiner = merge_max;
+            break;
+
+        case IPMAP_MERGE_MIN:
+            combiner = merge_min;
+            break;
+
+        case IPMAP_MERGE_SUM:
+            combiner = merge_sum;
+            break;
+
+        case IPMAP_MERGE_PREFER_LEFT:
+            combiner = merge_prefer_left;
+            break;
+
+        default:
+            combiner = merge_prefer_non_default;
+            break;
+    }
+
+    merge_maps(dst, map1, map2, combiner, &defaults);
+}
+
+
+void
+ipmap_merge_func(ip_map_t *dst,
+                 ip_map_t *map1,
+                 ip_map_t *map2,
+                 ipmap_merge_func_t func,
+                 gpointer user_data)
+{
+    merge_callback_t  callback;
+
+    callback.func = func;
+    callback.user_data = user_data;
+    merge_maps(dst, map1, map2, merge_with_callback, &callback);
+}
@@ -29,13 +29,22 @@ ipmap_save(FILE *stream,
            GError **err)
 {
     return ipset_node_cache_save
-        (stream, ipset_cache, map->map_bdd, err);
+        (stream, map->cache, map->map_bdd, err);
 }
 
 
 ip_map_t *
 ipmap_load(FILE *stream,
            GError **err)
+{
+    return ipmap_load_in(ipset_cache, stream, err);
+}
+
+
+ip_map_t *
+ipmap_load_in(ipset_context_t *ctx,
+              FILE *stream,
+              GError **err)
 {
     ip_map_t  *map;
     ipset_node_id_t  node;
@@ -46,20 +55,23 @@ ipmap_load(FILE *stream,
      * file.
      */
 
-    map = ipmap_new(0);
+    map = ipmap_new_in(ctx, 0);
     if (map == NULL) return NULL;
 
     GError  *suberror = NULL;
 
+    ipset_node_cache_begin(ctx);
     node = ipset_node_cache_load
-        (stream, ipset_cache, &suberror);
+        (stream, ctx, &suberror);
     if (suberror != NULL)
     {
+        ipset_node_cache_end(ctx);
         g_propagate_error(err, suberror);
         ipmap_free(map);
         return NULL;
     }
 
-    map->map_bdd = node;
+    map->map_bdd = ipset_node_incref(ctx, node);
+    ipset_node_cache_end(ctx);
     return map;
 }
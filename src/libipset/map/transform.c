@@ -0,0 +1,176 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/ipset.h>
+#include <ipset/internal.h>
+
+
+/**
+ * Map the terminals of a map's BDD, freeing up what we can and trying
+ * again if we run out of memory.  Returns IPSET_NULL_NODE, and sets
+ * the context's out-of-memory flag, if that still doesn't work.  Must
+ * be called between ipset_node_cache_begin() and _end().
+ */
+
+static ipset_node_id_t
+map_terminals(ip_map_t *map,
+              ipset_terminal_mapper_t mapper,
+              gpointer user_data)
+{
+    ipset_node_cache_t  *cache = map->cache;
+    ipset_node_id_t  result;
+
+    g_atomic_int_set(&cache->out_of_memory, FALSE);
+    result = ipset_node_cache_map_terminals
+        (cache, map->map_bdd, mapper, user_data);
+
+    if (result == IPSET_NULL_NODE)
+    {
+        /*
+         * Making room can move the map's BDD, so we have to look it up
+         * again afterwards.
+         */
+
+        ipset_node_cache_make_room(cache);
+        result = ipset_node_cache_map_terminals
+            (cache, map->map_bdd, mapper, user_data);
+
+        if (result == IPSET_NULL_NODE)
+            g_atomic_int_set(&cache->out_of_memory, TRUE);
+    }
+
+    return result;
+}
+
+
+/**
+ * A user-supplied predicate, and its user data.
+ */
+
+typedef struct select_callback
+{
+    ipmap_predicate_t  predicate;
+    gpointer  user_data;
+} select_callback_t;
+
+
+static ipset_range_t
+select_with_callback(ipset_range_t value, gpointer user_data)
+{
+    select_callback_t  *callback = (select_callback_t *) user_data;
+    return callback->predicate(value, callback->user_data)? TRUE: FALSE;
+}
+
+
+ip_set_t *
+ipmap_select(ip_map_t *map, ipmap_predicate_t predicate, gpointer user_data)
+{
+    ipset_node_cache_t  *cache = map->cache;
+    ip_set_t  *set = NULL;
+    select_callback_t  callback;
+
+    callback.predicate = predicate;
+    callback.user_data = user_data;
+
+    /*
+     * Sending each terminal to TRUE or FALSE turns the map's BDD into
+     * the BDD of the set that we want.
+     */
+
+    ipset_node_cache_begin(cache);
+
+    ipset_node_id_t  result =
+        map_terminals(map, select_with_callback, &callback);
+
+    if (result != IPSET_NULL_NODE)
+    {
+        set = ipset_new_in(cache);
+        if (set != NULL)
+            set->set_bdd = ipset_node_incref(cache, result);
+    }
+
+    ipset_node_cache_end(cache);
+    return set;
+}
+
+
+static gboolean
+value_equals(gint value, gpointer user_data)
+{
+    return (value == GPOINTER_TO_INT(user_data));
+}
+
+
+ip_set_t *
+ipmap_select_value(ip_map_t *map, gint value)
+{
+    return ipmap_select(map, value_equals, GINT_TO_POINTER(value));
+}
+
+
+/**
+ * A user-supplied transformation, and its user data.
+ */
+
+typedef struct transform_callback
+{
+    ipmap_transform_func_t  func;
+    gpointer  user_data;
+} transform_callback_t;
+
+
+static ipset_range_t
+transform_with_callback(ipset_range_t value, gpointer user_data)
+{
+    transform_callback_t  *callback = (transform_callback_t *) user_data;
+    return callback->func(value, callback->user_data);
+}
+
+
+void
+ipmap_transform(ip_map_t *map,
+                ipmap_transform_func_t func,
+                gpointer user_data)
+{
+    ipset_node_cache_t  *cache = map->cache;
+    transform_callback_t  callback;
+
+    callback.func = func;
+    callback.user_data = user_data;
+
+    ipset_node_cache_begin(cache);
+
+    ipset_node_id_t  result =
+        map_terminals(map, transform_with_callback, &callback);
+
+    if (result != IPSET_NULL_NODE)
+    {
+        /*
+         * The default value is transformed along with everything
+         * else.  Take the new reference before giving up the old
+         * one, in case they refer to the same node.
+         */
+
+        map->default_bdd = ipset_node_cache_terminal
+            (cache, func(ipset_terminal_value(map->default_bdd),
+                         user_data));
+
+        ipset_node_incref(cache, result);
+        ipset_node_decref(cache, map->map_bdd);
+        map->map_bdd = result;
+
+        ipset_node_cache_collect_if_needed(cache);
+    }
+
+    ipset_node_cache_end(cache);
+}
@@ -0,0 +1,326 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/ipset.h>
+#include <ipset/internal.h>
+
+
+/**
+ * A BDD operator that combines two sets.
+ */
+
+typedef ipset_node_id_t
+(*set_operator_t)(ipset_node_cache_t *cache,
+                  ipset_node_id_t lhs,
+                  ipset_node_id_t rhs);
+
+
+/**
+ * Apply a BDD operator to the BDDs of two sets.  If we run out of
+ * memory, we free up what we can and try again.  Returns
+ * IPSET_NULL_NODE, and sets the context's out-of-memory flag, if
+ * that still doesn't work.  The result isn't referenced by anything
+ * yet.
+ */
+
+static ipset_node_id_t
+apply_operator(set_operator_t op, ip_set_t *set1, ip_set_t *set2)
+{
+    ipset_node_cache_t  *cache = set1->cache;
+    ipset_node_id_t  result;
+
+    g_atomic_int_set(&cache->out_of_memory, FALSE);
+    result = op(cache, set1->set_bdd, set2->set_bdd);
+
+    if (result == IPSET_NULL_NODE)
+    {
+        ipset_node_cache_make_room(cache);
+        result = op(cache, set1->set_bdd, set2->set_bdd);
+
+        if (result == IPSET_NULL_NODE)
+            g_atomic_int_set(&cache->out_of_memory, TRUE);
+    }
+
+    return result;
+}
+
+
+/**
+ * Replace a set's BDD with a new one.  This must be called between
+ * ipset_node_cache_begin() and ipset_node_cache_end().
+ */
+
+static void
+replace_bdd(ip_set_t *set, ipset_node_id_t new_bdd)
+{
+    /*
+     * Take the new reference before giving up the old one, in case
+     * they refer to the same node.
+     */
+
+    ipset_node_incref(set->cache, new_bdd);
+    ipset_node_decref(set->cache, set->set_bdd);
+    set->set_bdd = new_bdd;
+
+    ipset_node_cache_collect_if_needed(set->cache);
+}
+
+
+/**
+ * Replace a set with the result of applying a BDD operator to it and
+ * another set.
+ */
+
+static void
+update_set(set_operator_t op, ip_set_t *set, ip_set_t *other)
+{
+    ipset_node_cache_begin(set->cache);
+
+    ipset_node_id_t  result = apply_operator(op, set, other);
+
+    if (result != IPSET_NULL_NODE)
+        replace_bdd(set, result);
+
+    ipset_node_cache_end(set->cache);
+}
+
+
+/**
+ * Create a new set that holds the result of applying a BDD operator
+ * to two other sets.
+ */
+
+static ip_set_t *
+new_set(set_operator_t op, ip_set_t *set1, ip_set_t *set2)
+{
+    ip_set_t  *set = NULL;
+
+    ipset_node_cache_begin(set1->cache);
+
+    ipset_node_id_t  result = apply_operator(op, set1, set2);
+
+    if (result != IPSET_NULL_NODE)
+    {
+        set = ipset_new_in(set1->cache);
+        if (set != NULL)
+            replace_bdd(set, result);
+    }
+
+    ipset_node_cache_end(set1->cache);
+    return set;
+}
+
+
+void
+ipset_union(ip_set_t *set, ip_set_t *other)
+{
+    update_set(ipset_node_cache_or, set, other);
+}
+
+
+void
+ipset_intersect(ip_set_t *set, ip_set_t *other)
+{
+    update_set(ipset_node_cache_and, set, other);
+}
+
+
+void
+ipset_difference(ip_set_t *set, ip_set_t *other)
+{
+    update_set(ipset_node_cache_and_not, set, other);
+}
+
+
+void
+ipset_xor(ip_set_t *set, ip_set_t *other)
+{
+    update_set(ipset_node_cache_xor, set, other);
+}
+
+
+void
+ipset_complement(ip_set_t *set)
+{
+    ipset_node_cache_begin(set->cache);
+    g_atomic_int_set(&set->cache->out_of_memory, FALSE);
+    replace_bdd(set, ipset_node_not(set->set_bdd));
+    ipset_node_cache_end(set->cache);
+}
+
+
+void
+ipset_minimize(ip_set_t *set, ip_set_t *care_set)
+{
+    update_set(ipset_node_cache_restrict, set, care_set);
+}
+
+
+ip_set_t *
+ipset_union_new(ip_set_t *set1, ip_set_t *set2)
+{
+    return new_set(ipset_node_cache_or, set1, set2);
+}
+
+
+ip_set_t *
+ipset_intersect_new(ip_set_t *set1, ip_set_t *set2)
+{
+    return new_set(ipset_node_cache_and, set1, set2);
+}
+
+
+ip_set_t *
+ipset_difference_new(ip_set_t *set1, ip_set_t *set2)
+{
+    return new_set(ipset_node_cache_and_not, set1, set2);
+}
+
+
+ip_set_t *
+ipset_xor_new(ip_set_t *set1, ip_set_t *set2)
+{
+    return new_set(ipset_node_cache_xor, set1, set2);
+}
+
+
+ip_set_t *
+ipset_complement_new(ip_set_t *set)
+{
+    ip_set_t  *result = ipset_new_in(set->cache);
+    if (result == NULL)
+        return NULL;
+
+    ipset_node_cache_begin(set->cache);
+    replace_bdd(result, ipset_node_not(set->set_bdd));
+    ipset_node_cache_end(set->cache);
+
+    return result;
+}
+
+
+/**
+ * Copy the BDDs of a list of sets into an array.  The sets' BDDs can
+ * move whenever the node cache makes room, so we have to do this
+ * again after each ipset_node_cache_make_room().
+ */
+
+static void
+get_set_bdds(ipset_node_id_t *bdds, ip_set_t **sets, gsize count)
+{
+    gsize  i;
+
+    for (i = 0; i < count; i++)
+    {
+        bdds[i] = sets[i]->set_bdd;
+    }
+}
+
+
+ip_set_t *
+ipset_union_many(ip_set_t **sets, gsize count)
+{
+    g_return_val_if_fail(count > 0, NULL);
+
+    ipset_node_cache_t  *cache = sets[0]->cache;
+    ipset_node_id_t  *operands = g_new(ipset_node_id_t, count);
+    ipset_node_id_t  result;
+
+    ipset_node_cache_begin(cache);
+    g_atomic_int_set(&cache->out_of_memory, FALSE);
+    get_set_bdds(operands, sets, count);
+    result = ipset_node_cache_or_many(cache, operands, count);
+
+    if (result == IPSET_NULL_NODE)
+    {
+        ipset_node_cache_make_room(cache);
+        get_set_bdds(operands, sets, count);
+        result = ipset_node_cache_or_many(cache, operands, count);
+    }
+
+    g_free(operands);
+
+    ip_set_t  *set = NULL;
+
+    if (result == IPSET_NULL_NODE)
+    {
+        g_atomic_int_set(&cache->out_of_memory, TRUE);
+    } else {
+        set = ipset_new_in(cache);
+        if (set != NULL)
+            replace_bdd(set, result);
+    }
+
+    ipset_node_cache_end(cache);
+    return set;
+}
+
+
+/**
+ * Coarsen each kind of address in a set's BDD by quantifying away
+ * the variables for the bits after its prefix.  Bit i of an address
+ * is variable i+1, so a /N prefix keeps variables 1 through N.
+ */
+
+static ipset_node_id_t
+coarsen_bdd(ipset_node_cache_t *cache,
+            ipset_node_id_t node_id,
+            guint v4_prefixlen,
+            guint v6_prefixlen)
+{
+    ipset_node_id_t  ipv4 = ipset_node_cache_exists_from
+        (cache, ipset_address_kind_bdd(cache, node_id, TRUE),
+         MIN(v4_prefixlen, IPV4_BIT_SIZE) + 1);
+    if (ipv4 == IPSET_NULL_NODE)
+        return IPSET_NULL_NODE;
+
+    ipset_node_id_t  ipv6 = ipset_node_cache_exists_from
+        (cache, ipset_address_kind_bdd(cache, node_id, FALSE),
+         MIN(v6_prefixlen, IPV6_BIT_SIZE) + 1);
+    if (ipv6 == IPSET_NULL_NODE)
+        return IPSET_NULL_NODE;
+
+    return ipset_node_cache_nonterminal(cache, 0, ipv6, ipv4);
+}
+
+
+ip_set_t *
+ipset_coarsen(ip_set_t *set, guint v4_prefixlen, guint v6_prefixlen)
+{
+    ipset_node_cache_t  *cache = set->cache;
+    ipset_node_id_t  result;
+    ip_set_t  *coarsened = NULL;
+
+    ipset_node_cache_begin(cache);
+    g_atomic_int_set(&cache->out_of_memory, FALSE);
+    result = coarsen_bdd(cache, set->set_bdd, v4_prefixlen, v6_prefixlen);
+
+    if (result == IPSET_NULL_NODE)
+    {
+        ipset_node_cache_make_room(cache);
+        result = coarsen_bdd
+            (cache, set->set_bdd, v4_prefixlen, v6_prefixlen);
+    }
+
+    if (result == IPSET_NULL_NODE)
+    {
+        g_atomic_int_set(&cache->out_of_memory, TRUE);
+    } else {
+        coarsened = ipset_new_in(cache);
+        if (coarsened != NULL)
+            replace_bdd(coarsened, result);
+    }
+
+    ipset_node_cache_end(cache);
+    return coarsened;
+}
@@ -17,18 +17,63 @@
 
 void
 ipset_init(ip_set_t *set)
+{
+    ipset_init_in(ipset_cache, set);
+}
+
+
+void
+ipset_init_in(ipset_context_t *ctx, ip_set_t *set)
 {
     /*
      * The set starts empty, so every value assignment should yield
      * false.
      */
 
-    set->set_bdd = ipset_node_cache_terminal(ipset_cache, FALSE);
+    set->cache = ctx;
+    set->set_bdd = ipset_node_cache_terminal(ctx, FALSE);
+
+    /*
+     * Let the garbage collector know about the set's BDD.
+     */
+
+    ipset_node_cache_add_root(ctx, &set->set_bdd);
+}
+
+
+void
+ipset_init_import(ipset_context_t *ctx, ip_set_t *set, ip_set_t *src)
+{
+    ipset_node_id_t  imported;
+
+    ipset_init_in(ctx, set);
+
+    /*
+     * If there isn't enough memory to copy the source set, the new
+     * set is left empty.
+     */
+
+    ipset_node_cache_begin(ctx);
+    g_atomic_int_set(&ctx->out_of_memory, FALSE);
+    imported = ipset_node_cache_import(ctx, src->cache, src->set_bdd);
+    if (imported == IPSET_NULL_NODE)
+        g_atomic_int_set(&ctx->out_of_memory, TRUE);
+    else
+        set->set_bdd = ipset_node_incref(ctx, imported);
+
+    ipset_node_cache_end(ctx);
 }
 
 
 ip_set_t *
 ipset_new()
+{
+    return ipset_new_in(ipset_cache);
+}
+
+
+ip_set_t *
+ipset_new_in(ipset_context_t *ctx)
 {
     ip_set_t  *result = NULL;
 
@@ -44,7 +89,7 @@ ipset_new()
      * If that worked, initialize and return the set.
      */
 
-    ipset_init(result);
+    ipset_init_in(ctx, result);
     return result;
 }
 
@@ -52,7 +97,13 @@ ipset_new()
 void
 ipset_done(ip_set_t *set)
 {
-    /* nothing to do */
+    /*
+     * Give up our reference to the BDD, which releases any nodes
+     * that aren't shared with some other set.
+     */
+
+    ipset_node_cache_remove_root(set->cache, &set->set_bdd);
+    ipset_node_decref(set->cache, set->set_bdd);
 }
 
 
@@ -62,3 +113,15 @@ ipset_free(ip_set_t *set)
     ipset_done(set);
     g_slice_free(ip_set_t, set);
 }
+
+
+void
+ipset_compact(ip_set_t *set)
+{
+    /*
+     * The set's BDD field is a registered root, so it's updated to
+     * point at the moved root node automatically.
+     */
+
+    ipset_node_cache_compact(set->cache, set->set_bdd);
+}
@@ -22,7 +22,7 @@ ipset_is_empty(ip_set_t *set)
      */
 
     return (set->set_bdd ==
-            ipset_node_cache_terminal(ipset_cache, FALSE));
+            ipset_node_cache_terminal(set->cache, FALSE));
 }
 
 gboolean
@@ -50,7 +50,33 @@ ipset_is_not_equal(ip_set_t *set1, ip_set_t *set2)
 gsize
 ipset_memory_size(ip_set_t *set)
 {
-    return ipset_node_memory_size(set->set_bdd);
+    return ipset_node_memory_size(set->cache, set->set_bdd);
+}
+
+gboolean
+ipset_is_subset(ip_set_t *set1, ip_set_t *set2)
+{
+    /*
+     * set1 ⊆ set2 exactly when set1 has nothing in common with the
+     * complement of set2.
+     */
+
+    return ipset_node_is_disjoint
+        (set1->cache, set1->set_bdd, ipset_node_not(set2->set_bdd));
+}
+
+gboolean
+ipset_is_disjoint(ip_set_t *set1, ip_set_t *set2)
+{
+    return ipset_node_is_disjoint
+        (set1->cache, set1->set_bdd, set2->set_bdd);
+}
+
+gboolean
+ipset_intersects(ip_set_t *set1, ip_set_t *set2)
+{
+    return !ipset_node_is_disjoint
+        (set1->cache, set1->set_bdd, set2->set_bdd);
 }
 
 
@@ -77,3 +103,95 @@ ipset_ip_add_network(ip_set_t *set, ipset_ip_t *addr, guint netmask)
     }
 }
 
+
+ipset_node_id_t
+ipset_address_kind_bdd(ipset_node_cache_t *cache,
+                       ipset_node_id_t node_id,
+                       gboolean ipv4)
+{
+    if (ipset_node_get_type(node_id) == IPSET_NONTERMINAL_NODE)
+    {
+        ipset_node_t  *node =
+            ipset_node_cache_get_nonterminal(cache, node_id);
+
+        if (node->variable == 0)
+        {
+            return ipv4?
+                ipset_node_high(node, node_id):
+                ipset_node_low(node, node_id);
+        }
+    }
+
+    return node_id;
+}
+
+
+/**
+ * Count the addresses of one kind that start with the first netmask
+ * bits of addr.  We follow the prefix's bits down through the BDD,
+ * and then count the paths below wherever we end up.  Bit i of an
+ * address is variable i+1; variable 0 tells us the kind of address.
+ */
+
+static ipset_count_t
+count_network(ip_set_t *set, gboolean is_ipv4, gpointer addr,
+              guint bit_size, guint netmask)
+{
+    ipset_node_cache_t  *cache = set->cache;
+    ipset_node_id_t  node_id = set->set_bdd;
+    ipset_variable_t  variable;
+    ipset_count_t  count = { 0, 0 };
+
+    if (netmask > bit_size)
+        return count;
+
+    ipset_node_cache_begin(cache);
+
+    for (variable = 0; variable <= netmask; variable++)
+    {
+        if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE)
+            break;
+
+        ipset_node_t  *node =
+            ipset_node_cache_get_nonterminal(cache, node_id);
+
+        /*
+         * If the BDD skips this variable, both of its values lead to
+         * the same place.
+         */
+
+        if (node->variable != variable)
+            continue;
+
+        gboolean  bit = (variable == 0)?
+            is_ipv4: IPSET_BIT_GET(addr, variable - 1);
+
+        node_id = bit?
+            ipset_node_high(node, node_id):
+            ipset_node_low(node, node_id);
+    }
+
+    count = ipset_node_path_count(cache, node_id, netmask + 1, bit_size);
+    ipset_node_cache_end(cache);
+    return count;
+}
+
+guint64
+ipset_ipv4_count(ip_set_t *set)
+{
+    return count_network(set, TRUE, NULL, IPV4_BIT_SIZE, 0).low;
+}
+
+ipset_count_t
+ipset_ipv6_count(ip_set_t *set)
+{
+    return count_network(set, FALSE, NULL, IPV6_BIT_SIZE, 0);
+}
+
+ipset_count_t
+ipset_count_within(ip_set_t *set, ipset_ip_t *addr, guint netmask)
+{
+    return count_network
+        (set, addr->is_ipv4, addr->addr,
+         addr->is_ipv4? IPV4_BIT_SIZE: IPV6_BIT_SIZE, netmask);
+}
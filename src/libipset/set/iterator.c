@@ -369,7 +369,8 @@ create_iterator(ip_set_t *set, gboolean desired_value,
      */
 
     g_d_debug("Iterating set");
-    iterator->bdd_iterator = ipset_node_iterate(set->set_bdd);
+    iterator->bdd_iterator =
+        ipset_node_iterate(set->cache, set->set_bdd);
 
     /*
      * Then drill down from the current BDD assignment, creating an
@@ -0,0 +1,350 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2010, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the LICENSE.txt file in this distribution for license
+ * details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <ipset/bdd/nodes.h>
+#include <ipset/ipset.h>
+#include <ipset/internal.h>
+#include <ipset/logging.h>
+
+
+/*
+ * The addresses in a set are ordered with all of the IPv4 addresses
+ * first, and then all of the IPv6 addresses, each in numeric order.
+ * Bit i of an address is variable i+1; variable 0 tells us the kind
+ * of address, so each kind's addresses are the paths through one of
+ * variable 0's subtrees, starting at variable 1.
+ */
+
+typedef struct address_counter
+{
+    ipset_node_counter_t  ipv4;
+    ipset_node_counter_t  ipv6;
+    ipset_node_id_t  ipv4_bdd;
+    ipset_node_id_t  ipv6_bdd;
+    ipset_count_t  ipv4_count;
+    ipset_count_t  ipv6_count;
+} address_counter_t;
+
+
+static void
+address_counter_init(address_counter_t *counter,
+                     ipset_node_cache_t *cache,
+                     ipset_node_id_t set_bdd)
+{
+    ipset_node_counter_init(&counter->ipv4, cache, IPV4_BIT_SIZE);
+    ipset_node_counter_init(&counter->ipv6, cache, IPV6_BIT_SIZE);
+
+    counter->ipv4_bdd = ipset_address_kind_bdd(cache, set_bdd, TRUE);
+    counter->ipv6_bdd = ipset_address_kind_bdd(cache, set_bdd, FALSE);
+
+    counter->ipv4_count = ipset_node_counter_count
+        (&counter->ipv4, counter->ipv4_bdd, 1);
+    counter->ipv6_count = ipset_node_counter_count
+        (&counter->ipv6, counter->ipv6_bdd, 1);
+}
+
+
+static void
+address_counter_done(address_counter_t *counter)
+{
+    ipset_node_counter_done(&counter->ipv4);
+    ipset_node_counter_done(&counter->ipv6);
+}
+
+
+/**
+ * Find the index'th address in a set.
+ */
+
+static gboolean
+select_address(address_counter_t *counter,
+               ipset_count_t index,
+               ipset_ip_t *addr)
+{
+    memset(addr, 0, sizeof(ipset_ip_t));
+
+    if (ipset_node_count_less(index, counter->ipv4_count))
+    {
+        addr->is_ipv4 = TRUE;
+        return ipset_node_counter_select
+            (&counter->ipv4, counter->ipv4_bdd, 1, index, addr->addr);
+    }
+
+    addr->is_ipv4 = FALSE;
+    return ipset_node_counter_select
+        (&counter->ipv6, counter->ipv6_bdd, 1,
+         ipset_node_count_sub(index, counter->ipv4_count), addr->addr);
+}
+
+
+/**
+ * Count the addresses in a set that come before addr.
+ */
+
+static ipset_count_t
+rank_address(address_counter_t *counter, ipset_ip_t *addr)
+{
+    ipset_count_t  rank;
+
+    if (addr->is_ipv4)
+    {
+        return ipset_node_counter_rank
+            (&counter->ipv4, counter->ipv4_bdd, 1, addr->addr);
+    }
+
+    rank = ipset_node_count_add
+        (counter->ipv4_count,
+         ipset_node_counter_rank
+         (&counter->ipv6, counter->ipv6_bdd, 1, addr->addr));
+
+    /*
+     * The rank can only wrap around if the set contains nearly every
+     * IPv6 address; saturate like the counts do.
+     */
+
+    if (ipset_node_count_less(rank, counter->ipv4_count))
+        rank.high = rank.low = G_MAXUINT64;
+
+    return rank;
+}
+
+
+gboolean
+ipset_nth(ip_set_t *set, ipset_count_t index, ipset_ip_t *addr)
+{
+    address_counter_t  counter;
+    gboolean  result;
+
+    ipset_node_cache_begin(set->cache);
+    address_counter_init(&counter, set->cache, set->set_bdd);
+    result = select_address(&counter, index, addr);
+    address_counter_done(&counter);
+    ipset_node_cache_end(set->cache);
+
+    return result;
+}
+
+
+ipset_count_t
+ipset_rank(ip_set_t *set, ipset_ip_t *addr)
+{
+    address_counter_t  counter;
+    ipset_count_t  rank;
+
+    ipset_node_cache_begin(set->cache);
+    address_counter_init(&counter, set->cache, set->set_bdd);
+    rank = rank_address(&counter, addr);
+    address_counter_done(&counter);
+    ipset_node_cache_end(set->cache);
+
+    return rank;
+}
+
+
+/**
+ * A set's path counts, kept around between calls.
+ */
+
+struct ipset_counter
+{
+    ip_set_t  *set;
+
+    /**
+     * The BDD that the counts are for.  This is a registered root,
+     * and we hold a reference to it, so its nodes can't be reclaimed
+     * (and their IDs reused) while we remember their counts.
+     */
+
+    ipset_node_id_t  set_bdd;
+
+    /**
+     * The cache's compaction count when we counted, since compacting
+     * can move the nodes that we have counts for.
+     */
+
+    guint  compactions;
+
+    address_counter_t  counts;
+};
+
+
+ipset_counter_t *
+ipset_counter_new(ip_set_t *set)
+{
+    ipset_counter_t  *counter = g_slice_new(ipset_counter_t);
+    ipset_node_cache_t  *cache = set->cache;
+
+    ipset_node_cache_begin(cache);
+
+    counter->set = set;
+    counter->set_bdd = ipset_node_incref(cache, set->set_bdd);
+    counter->compactions = cache->compactions;
+    ipset_node_cache_add_root(cache, &counter->set_bdd);
+    address_counter_init(&counter->counts, cache, counter->set_bdd);
+
+    ipset_node_cache_end(cache);
+    return counter;
+}
+
+
+void
+ipset_counter_free(ipset_counter_t *counter)
+{
+    ipset_node_cache_t  *cache = counter->set->cache;
+
+    address_counter_done(&counter->counts);
+    ipset_node_cache_remove_root(cache, &counter->set_bdd);
+    ipset_node_decref(cache, counter->set_bdd);
+    g_slice_free(ipset_counter_t, counter);
+}
+
+
+/**
+ * Make sure that a counter's counts are for the current contents of
+ * its set, starting over if the set has changed, or if its nodes
+ * might have moved.  Must be called between ipset_node_cache_begin()
+ * and _end().
+ */
+
+static void
+counter_refresh(ipset_counter_t *counter)
+{
+    ip_set_t  *set = counter->set;
+    ipset_node_cache_t  *cache = set->cache;
+
+    if ((counter->set_bdd == set->set_bdd) &&
+        (counter->compactions == cache->compactions))
+    {
+        return;
+    }
+
+    g_d_debug("Recounting set %p", set);
+
+    /*
+     * Take the new reference before giving up the old one, in case
+     * they refer to the same node.
+     */
+
+    address_counter_done(&counter->counts);
+    ipset_node_incref(cache, set->set_bdd);
+    ipset_node_decref(cache, counter->set_bdd);
+    counter->set_bdd = set->set_bdd;
+    counter->compactions = cache->compactions;
+    address_counter_init(&counter->counts, cache, counter->set_bdd);
+}
+
+
+gboolean
+ipset_counter_nth(ipset_counter_t *counter,
+                  ipset_count_t index,
+                  ipset_ip_t *addr)
+{
+    ipset_node_cache_t  *cache = counter->set->cache;
+    gboolean  result;
+
+    ipset_node_cache_begin(cache);
+    counter_refresh(counter);
+    result = select_address(&counter->counts, index, addr);
+    ipset_node_cache_end(cache);
+
+    return result;
+}
+
+
+ipset_count_t
+ipset_counter_rank(ipset_counter_t *counter, ipset_ip_t *addr)
+{
+    ipset_node_cache_t  *cache = counter->set->cache;
+    ipset_count_t  rank;
+
+    ipset_node_cache_begin(cache);
+    counter_refresh(counter);
+    rank = rank_address(&counter->counts, addr);
+    ipset_node_cache_end(cache);
+
+    return rank;
+}
+
+
+/**
+ * Choose a random index that's less than limit, which must be
+ * nonzero.  We draw just enough random bits to cover the limit, and
+ * try again if we overshoot, which happens less than half the time.
+ */
+
+static ipset_count_t
+random_index(GRand *rng, ipset_count_t limit)
+{
+    ipset_count_t  mask;
+    ipset_count_t  index;
+
+    if (limit.high != 0)
+    {
+        guint  bits = g_bit_storage(limit.high);
+        mask.high = (bits >= 64)? G_MAXUINT64:
+            ((G_GUINT64_CONSTANT(1) << bits) - 1);
+        mask.low = G_MAXUINT64;
+    } else {
+        guint  bits = g_bit_storage(limit.low);
+        mask.high = 0;
+        mask.low = (bits >= 64)? G_MAXUINT64:
+            ((G_GUINT64_CONSTANT(1) << bits) - 1);
+    }
+
+    do
+    {
+        index.high = ((((guint64) g_rand_int(rng)) << 32) |
+                      g_rand_int(rng)) & mask.high;
+        index.low = ((((guint64) g_rand_int(rng)) << 32) |
+                     g_rand_int(rng)) & mask.low;
+    } while (!ipset_node_count_less(index, limit));
+
+    return index;
+}
+
+
+gsize
+ipset_sample(ip_set_t *set, GRand *rng, gsize n, ipset_ip_t *out)
+{
+    address_counter_t  counter;
+    ipset_count_t  total;
+    gsize  i;
+
+    ipset_node_cache_begin(set->cache);
+    address_counter_init(&counter, set->cache, set->set_bdd);
+
+    total = ipset_node_count_add(counter.ipv4_count, counter.ipv6_count);
+    if (ipset_node_count_less(total, counter.ipv4_count))
+        total.high = total.low = G_MAXUINT64;
+
+    if ((total.high == 0) && (total.low == 0))
+        n = 0;
+
+    g_d_debug("Sampling %" G_GSIZE_FORMAT " addresses", n);
+
+    /*
+     * Every sample shares the same counter, so each node's path count
+     * is only computed once, no matter how many samples we take.
+     */
+
+    for (i = 0; i < n; i++)
+    {
+        select_address(&counter, random_index(rng, total), &out[i]);
+    }
+
+    address_counter_done(&counter);
+    ipset_node_cache_end(set->cache);
+
+    return n;
+}
@@ -24,7 +24,7 @@ ipset_save(FILE *stream,
            GError **err)
 {
     return ipset_node_cache_save
-        (stream, ipset_cache, set->set_bdd, err);
+        (stream, set->cache, set->set_bdd, err);
 }
 
 
@@ -34,31 +34,43 @@ ipset_save_dot(FILE *stream,
                GError **err)
 {
     return ipset_node_cache_save_dot
-        (stream, ipset_cache, set->set_bdd, err);
+        (stream, set->cache, set->set_bdd, err);
 }
 
 
 ip_set_t *
 ipset_load(FILE *stream,
            GError **err)
+{
+    return ipset_load_in(ipset_cache, stream, err);
+}
+
+
+ip_set_t *
+ipset_load_in(ipset_context_t *ctx,
+              FILE *stream,
+              GError **err)
 {
     ip_set_t  *set;
     ipset_node_id_t  node;
 
-    set = ipset_new();
+    set = ipset_new_in(ctx);
     if (set == NULL) return NULL;
 
     GError  *suberror = NULL;
 
+    ipset_node_cache_begin(ctx);
     node = ipset_node_cache_load
-        (stream, ipset_cache, &suberror);
+        (stream, ctx, &suberror);
     if (suberror != NULL)
     {
+        ipset_node_cache_end(ctx);
         g_propagate_error(err, suberror);
         ipset_free(set);
         return NULL;
     }
 
-    set->set_bdd = node;
+    set->set_bdd = ipset_node_incref(ctx, node);
+    ipset_node_cache_end(ctx);
     return set;
 }
@@ -15,6 +15,7 @@
 #include <glib/gstdio.h>
 
 #include <ipset/bdd/nodes.h>
+#include <ipset/ipset.h>
 
 
 /*-----------------------------------------------------------------------
@@ -236,7 +237,7 @@ START_TEST(test_bdd_nonterminal_1)
                 "Nonterminal has wrong type");
 
     ipset_node_t  *n =
-        ipset_nonterminal_node(node);
+        ipset_node_cache_get_nonterminal(cache, node);
 
     fail_unless(n->variable == 0,
                 "Nonterminal has wrong variable");
@@ -300,6 +301,215 @@ START_TEST(test_bdd_nonterminal_reduced_2)
 }
 END_TEST
 
+START_TEST(test_bdd_nonterminal_reduced_3)
+{
+    ipset_node_cache_t  *cache = ipset_node_cache_new();
+
+    /*
+     * Nonterminals should stay reduced even after the unique table
+     * has grown several times.
+     */
+
+    ipset_node_id_t  n_false =
+        ipset_node_cache_terminal(cache, FALSE);
+    ipset_node_id_t  n_true =
+        ipset_node_cache_terminal(cache, TRUE);
+
+    const guint  NODE_COUNT = 10000;
+    ipset_node_id_t  *nodes = g_new(ipset_node_id_t, NODE_COUNT);
+    ipset_node_id_t  prev = n_true;
+    guint  i;
+
+    for (i = 0; i < NODE_COUNT; i++)
+    {
+        nodes[i] = ipset_node_cache_nonterminal
+            (cache, i % 128, (i % 2 == 0)? n_false: n_true, prev);
+        prev = nodes[i];
+    }
+
+    fail_unless(ipset_node_cache_node_count(cache) == NODE_COUNT,
+                "Unique table has the wrong number of nodes");
+
+    prev = n_true;
+    for (i = 0; i < NODE_COUNT; i++)
+    {
+        ipset_node_id_t  node = ipset_node_cache_nonterminal
+            (cache, i % 128, (i % 2 == 0)? n_false: n_true, prev);
+        fail_unless(node == nodes[i],
+                    "Nonterminal node isn't reduced");
+        prev = node;
+    }
+
+    g_free(nodes);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_bdd_reserve_1)
+{
+    ipset_node_cache_t  *cache = ipset_node_cache_new();
+
+    /*
+     * After reserving space, creating that many nodes shouldn't grow
+     * the unique table.
+     */
+
+    ipset_node_id_t  n_false =
+        ipset_node_cache_terminal(cache, FALSE);
+
+    const guint  NODE_COUNT = 10000;
+    ipset_node_cache_reserve(cache, NODE_COUNT);
+
+    guint32  capacity = cache->unique.capacity;
+    ipset_node_id_t  prev = ipset_node_cache_terminal(cache, TRUE);
+    guint  i;
+
+    for (i = 0; i < NODE_COUNT; i++)
+    {
+        prev = ipset_node_cache_nonterminal
+            (cache, i % 128, n_false, prev);
+    }
+
+    fail_unless(cache->unique.capacity == capacity,
+                "Unique table shouldn't grow after reserving space");
+    fail_unless(ipset_node_cache_node_count(cache) == NODE_COUNT,
+                "Unique table has the wrong number of nodes");
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+START_TEST(test_bdd_stats_1)
+{
+    ipset_node_cache_t  *cache = ipset_node_cache_new();
+    ipset_node_cache_stats_t  stats;
+
+    ipset_node_id_t  n_false =
+        ipset_node_cache_terminal(cache, FALSE);
+    ipset_node_id_t  n_true =
+        ipset_node_cache_terminal(cache, TRUE);
+    ipset_node_id_t  n_two =
+        ipset_node_cache_terminal(cache, 2);
+
+    /*
+     * (We use a non-Boolean terminal for the second node, since
+     * otherwise it would be the complement of the first.)
+     */
+
+    ipset_node_id_t  node1 =
+        ipset_node_cache_nonterminal(cache, 1, n_false, n_true);
+    ipset_node_id_t  node2 =
+        ipset_node_cache_nonterminal(cache, 1, n_true, n_two);
+    ipset_node_cache_nonterminal(cache, 0, node1, node2);
+
+    /*
+     * Ask for one of the nodes again, which should be a unique table
+     * hit.
+     */
+
+    ipset_node_cache_nonterminal(cache, 1, n_false, n_true);
+
+    ipset_node_cache_get_stats(cache, &stats);
+
+    fail_unless(stats.node_count == 3,
+                "Stats have the wrong number of nodes");
+    fail_unless(stats.level_counts[0] == 1,
+                "Stats have the wrong number of nodes at level 0");
+    fail_unless(stats.level_counts[1] == 2,
+                "Stats have the wrong number of nodes at level 1");
+    fail_unless(stats.unique_capacity == IPSET_UNIQUE_INITIAL_CAPACITY,
+                "Stats have the wrong unique table size");
+    fail_unless(stats.arena_bytes > 0,
+                "Stats should count the arena's memory");
+
+    if (stats.counters_enabled)
+    {
+        fail_unless(stats.unique_hits == 1,
+                    "Stats have the wrong number of unique hits");
+        fail_unless(stats.unique_misses == 3,
+                    "Stats have the wrong number of unique misses");
+        fail_unless(stats.unique_avg_probe_length >= 1.0,
+                    "Every lookup should probe at least one slot");
+    } else {
+        fail_unless(stats.unique_hits == 0,
+                    "Counters should be 0 when they're disabled");
+    }
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_bdd_complement_1)
+{
+    ipset_node_cache_t  *cache = ipset_node_cache_new();
+
+    /*
+     * Create BDDs representing
+     *   f(x) = x[0] ∧ ¬x[1]
+     *   g(x) = ¬x[0] ∨ x[1]
+     * which are complements of each other.
+     */
+
+    ipset_node_id_t  n_false =
+        ipset_node_cache_terminal(cache, FALSE);
+    ipset_node_id_t  n_true =
+        ipset_node_cache_terminal(cache, TRUE);
+
+    ipset_node_id_t  f1 =
+        ipset_node_cache_nonterminal(cache, 1, n_true, n_false);
+    ipset_node_id_t  f =
+        ipset_node_cache_nonterminal(cache, 0, n_false, f1);
+
+    ipset_node_id_t  g1 =
+        ipset_node_cache_nonterminal(cache, 1, n_false, n_true);
+    ipset_node_id_t  g =
+        ipset_node_cache_nonterminal(cache, 0, n_true, g1);
+
+    fail_unless(ipset_node_not(n_false) == n_true,
+                "Complement of FALSE should be TRUE");
+    fail_unless(g == ipset_node_not(f),
+                "Complemented BDD isn't reduced");
+    fail_unless(ipset_node_regular(g) == ipset_node_regular(f),
+                "Complemented BDDs should share a node");
+    fail_unless(ipset_node_cache_node_count(cache) == 2,
+                "Complemented BDDs should share all of their nodes");
+    fail_unless(ipset_node_not(ipset_node_not(f)) == f,
+                "Double complement should give back the original");
+
+    fail_unless(ipset_node_cache_ite(cache, f, n_false, n_true) == g,
+                "ITE(f, 0, 1) should be the complement of f");
+    fail_unless(ipset_node_cache_and(cache, f, g) == n_false,
+                "f ∧ ¬f should be FALSE");
+    fail_unless(ipset_node_cache_or(cache, f, g) == n_true,
+                "f ∨ ¬f should be TRUE");
+
+    guint8  input;
+
+    for (input = 0; input < 4; input++)
+    {
+        guint8  bits[] = { input << 6 };
+        gboolean  expected = (input == 2); /* { TRUE, FALSE } */
+
+        fail_unless(ipset_node_evaluate(cache, f,
+                                        ipset_bit_array_assignment,
+                                        bits)
+                    == expected,
+                    "BDD evaluates to wrong value");
+
+        fail_unless(ipset_node_evaluate(cache, g,
+                                        ipset_bit_array_assignment,
+                                        bits)
+                    == !expected,
+                    "Complemented BDD evaluates to wrong value");
+    }
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
 
 /*-----------------------------------------------------------------------
  * Evaluation
@@ -329,7 +539,7 @@ START_TEST(test_bdd_evaluate_1)
     guint8  input1[] = { 0x80 }; /* { TRUE } */
     gboolean  expected1 = FALSE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bit_array_assignment,
                                     input1)
                 == expected1,
@@ -338,7 +548,7 @@ START_TEST(test_bdd_evaluate_1)
     guint8  input2[] = { 0x00 }; /* { FALSE } */
     gboolean  expected2 = TRUE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bit_array_assignment,
                                     input2)
                 == expected2,
@@ -375,7 +585,7 @@ START_TEST(test_bdd_evaluate_2)
     gboolean  input1[] = { TRUE, TRUE };
     gboolean  expected1 = FALSE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input1)
                 == expected1,
@@ -384,7 +594,7 @@ START_TEST(test_bdd_evaluate_2)
     gboolean  input2[] = { TRUE, FALSE };
     gboolean  expected2 = FALSE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input2)
                 == expected2,
@@ -393,7 +603,7 @@ START_TEST(test_bdd_evaluate_2)
     gboolean  input3[] = { FALSE, TRUE };
     gboolean  expected3 = TRUE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input3)
                 == expected3,
@@ -402,7 +612,7 @@ START_TEST(test_bdd_evaluate_2)
     gboolean  input4[] = { FALSE, FALSE };
     gboolean  expected4 = FALSE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input4)
                 == expected4,
@@ -494,7 +704,7 @@ START_TEST(test_bdd_and_evaluate_1)
     gboolean  input1[] = { TRUE, TRUE };
     gboolean  expected1 = TRUE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input1)
                 == expected1,
@@ -503,7 +713,7 @@ START_TEST(test_bdd_and_evaluate_1)
     gboolean  input2[] = { TRUE, FALSE };
     gboolean  expected2 = FALSE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input2)
                 == expected2,
@@ -512,7 +722,7 @@ START_TEST(test_bdd_and_evaluate_1)
     gboolean  input3[] = { FALSE, TRUE };
     gboolean  expected3 = FALSE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input3)
                 == expected3,
@@ -521,7 +731,7 @@ START_TEST(test_bdd_and_evaluate_1)
     gboolean  input4[] = { FALSE, FALSE };
     gboolean  expected4 = FALSE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input4)
                 == expected4,
@@ -609,7 +819,7 @@ START_TEST(test_bdd_or_evaluate_1)
     gboolean  input1[] = { TRUE, TRUE };
     gboolean  expected1 = TRUE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input1)
                 == expected1,
@@ -618,7 +828,7 @@ START_TEST(test_bdd_or_evaluate_1)
     gboolean  input2[] = { TRUE, FALSE };
     gboolean  expected2 = TRUE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input2)
                 == expected2,
@@ -627,7 +837,7 @@ START_TEST(test_bdd_or_evaluate_1)
     gboolean  input3[] = { FALSE, TRUE };
     gboolean  expected3 = TRUE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input3)
                 == expected3,
@@ -636,7 +846,7 @@ START_TEST(test_bdd_or_evaluate_1)
     gboolean  input4[] = { FALSE, FALSE };
     gboolean  expected4 = FALSE;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input4)
                 == expected4,
@@ -647,6 +857,262 @@ START_TEST(test_bdd_or_evaluate_1)
 END_TEST
 
 
+START_TEST(test_bdd_or_lossy_1)
+{
+    /*
+     * With a computed table that only has a single entry, nearly
+     * every lookup collides, but the results should still be correct
+     * and reduced.
+     */
+
+    ipset_node_cache_t  *cache = ipset_node_cache_new_sized(1);
+
+    ipset_node_id_t  n_false =
+        ipset_node_cache_terminal(cache, FALSE);
+    ipset_node_id_t  n_true =
+        ipset_node_cache_terminal(cache, TRUE);
+
+    ipset_node_id_t  node1 = n_false;
+    ipset_node_id_t  node2 = n_false;
+    guint  i;
+
+    for (i = 0; i < 8; i++)
+    {
+        ipset_node_id_t  var =
+            ipset_node_cache_nonterminal(cache, i, n_false, n_true);
+        node1 = ipset_node_cache_or(cache, node1, var);
+    }
+
+    for (i = 8; i > 0; i--)
+    {
+        ipset_node_id_t  var =
+            ipset_node_cache_nonterminal(cache, i-1, n_false, n_true);
+        node2 = ipset_node_cache_or(cache, var, node2);
+    }
+
+    fail_unless(node1 == node2,
+                "OR result isn't reduced");
+
+    gboolean  input1[] =
+        { FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE };
+
+    fail_unless(ipset_node_evaluate(cache, node1,
+                                    ipset_bool_array_assignment,
+                                    input1)
+                == FALSE,
+                "BDD evaluates to wrong value");
+
+    gboolean  input2[] =
+        { FALSE, FALSE, FALSE, FALSE, FALSE, TRUE, FALSE, FALSE };
+
+    fail_unless(ipset_node_evaluate(cache, node1,
+                                    ipset_bool_array_assignment,
+                                    input2)
+                == TRUE,
+                "BDD evaluates to wrong value");
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_bdd_shared_table_1)
+{
+    /*
+     * Every operation shares the computed table, so make sure that
+     * operations on the same operands don't get each other's results.
+     */
+
+    ipset_node_cache_t  *cache = ipset_node_cache_new_sized(1);
+
+    ipset_node_id_t  n_false =
+        ipset_node_cache_terminal(cache, FALSE);
+    ipset_node_id_t  n_true =
+        ipset_node_cache_terminal(cache, TRUE);
+
+    ipset_node_id_t  x0 =
+        ipset_node_cache_nonterminal(cache, 0, n_false, n_true);
+    ipset_node_id_t  x1 =
+        ipset_node_cache_nonterminal(cache, 1, n_false, n_true);
+
+    ipset_node_id_t  and1 = ipset_node_cache_and(cache, x0, x1);
+    ipset_node_id_t  or1 = ipset_node_cache_or(cache, x0, x1);
+    ipset_node_id_t  xor1 = ipset_node_cache_xor(cache, x0, x1);
+
+    fail_unless(ipset_node_cache_and(cache, x1, x0) == and1,
+                "AND result changed");
+    fail_unless(ipset_node_cache_or(cache, x1, x0) == or1,
+                "OR result changed");
+    fail_unless(ipset_node_cache_xor(cache, x1, x0) == xor1,
+                "XOR result changed");
+
+    fail_unless(and1 != or1, "AND and OR results should differ");
+    fail_unless(or1 != xor1, "OR and XOR results should differ");
+
+    /*
+     * x0 ⊕ x1 = (x0 ∨ x1) ∧ ¬(x0 ∧ x1)
+     */
+
+    fail_unless(ipset_node_cache_and_not(cache, or1, and1) == xor1,
+                "XOR result is wrong");
+
+    /*
+     * x0 ∧ 1 only reduces to x0 for Boolean BDDs.
+     */
+
+    ipset_node_id_t  n_two =
+        ipset_node_cache_terminal(cache, 2);
+    ipset_node_id_t  map =
+        ipset_node_cache_nonterminal(cache, 0, n_two, n_true);
+
+    fail_unless(ipset_node_cache_and(cache, x0, n_true) == x0,
+                "x ∧ 1 should be x");
+    fail_unless(ipset_node_cache_and(cache, map, n_true) == x0,
+                "Terminal values should be ANDed bitwise");
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_bdd_deep_apply_1)
+{
+    /*
+     * Create BDDs representing
+     *   f(x) = x[0] ∧ x[1] ∧ … ∧ x[255]
+     *   g(x) = ¬x[0] ∧ x[1] ∧ … ∧ x[255]
+     * which test every variable, so that the operators have to go as
+     * deep as they ever can.
+     */
+
+    ipset_node_cache_t  *cache = ipset_node_cache_new();
+
+    ipset_node_id_t  n_false =
+        ipset_node_cache_terminal(cache, FALSE);
+    ipset_node_id_t  n_true =
+        ipset_node_cache_terminal(cache, TRUE);
+
+    ipset_node_id_t  tail = n_true;
+    guint  i;
+
+    for (i = IPSET_VARIABLE_COUNT - 1; i > 0; i--)
+    {
+        tail = ipset_node_cache_nonterminal(cache, i, n_false, tail);
+    }
+
+    ipset_node_id_t  f =
+        ipset_node_cache_nonterminal(cache, 0, n_false, tail);
+    ipset_node_id_t  g =
+        ipset_node_cache_nonterminal(cache, 0, tail, n_false);
+
+    /*
+     * f ∨ g is just the tail, and f ⊕ g is the same thing.
+     */
+
+    fail_unless(ipset_node_cache_or(cache, f, g) == tail,
+                "OR result is wrong");
+    fail_unless(ipset_node_cache_xor(cache, f, g) == tail,
+                "XOR result is wrong");
+    fail_unless(ipset_node_cache_and(cache, f, g) == n_false,
+                "AND result is wrong");
+    fail_unless(ipset_node_cache_ite(cache, f, n_true, g) == tail,
+                "ITE result is wrong");
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+/**
+ * Build a Boolean BDD that's the union of a bunch of pseudo-random
+ * cubes over the first 24 variables.
+ */
+
+static ipset_node_id_t
+random_bdd(ipset_node_cache_t *cache, guint32 seed, guint cube_count)
+{
+    ipset_node_id_t  n_false = ipset_node_cache_terminal(cache, FALSE);
+    ipset_node_id_t  n_true = ipset_node_cache_terminal(cache, TRUE);
+    ipset_node_id_t  result = n_false;
+    guint  i;
+
+    for (i = 0; i < cube_count; i++)
+    {
+        ipset_node_id_t  cube = n_true;
+        gint  variable;
+
+        for (variable = 23; variable >= 0; variable--)
+        {
+            seed = seed * 1103515245 + 12345;
+
+            switch ((seed >> 16) % 3)
+            {
+                case 0:
+                    cube = ipset_node_cache_nonterminal
+                        (cache, variable, cube, n_false);
+                    break;
+
+                case 1:
+                    cube = ipset_node_cache_nonterminal
+                        (cache, variable, n_false, cube);
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        result = ipset_node_cache_or(cache, result, cube);
+    }
+
+    return result;
+}
+
+
+START_TEST(test_bdd_parallel_apply_1)
+{
+    ipset_node_cache_t  *cache = ipset_node_cache_new();
+    ipset_node_id_t  serial[4];
+    ipset_node_id_t  parallel[4];
+    guint  pass;
+
+    ipset_node_id_t  f = random_bdd(cache, 1, 200);
+    ipset_node_id_t  g = random_bdd(cache, 2, 200);
+    ipset_node_id_t  h = random_bdd(cache, 3, 200);
+
+    /*
+     * Compute each operation once on a single thread, and once on
+     * several.  Since the results live in the same cache, they have
+     * to be the same nodes.  We flush the computed table before each
+     * pass, so that the second pass can't just look up the results of
+     * the first.
+     */
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        ipset_node_id_t  *results = (pass == 0)? serial: parallel;
+
+        ipset_context_set_threads(cache, (pass == 0)? 1: 4);
+        ipset_context_set_parallel_depth(cache, 4);
+        ipset_context_set_parallel_min_nodes(cache, 0);
+        ipset_node_cache_flush_operations(cache);
+
+        results[0] = ipset_node_cache_and(cache, f, g);
+        results[1] = ipset_node_cache_or(cache, f, g);
+        results[2] = ipset_node_cache_xor(cache, f, g);
+        results[3] = ipset_node_cache_ite(cache, f, g, h);
+    }
+
+    fail_unless(parallel[0] == serial[0], "Parallel AND is wrong");
+    fail_unless(parallel[1] == serial[1], "Parallel OR is wrong");
+    fail_unless(parallel[2] == serial[2], "Parallel XOR is wrong");
+    fail_unless(parallel[3] == serial[3], "Parallel ITE is wrong");
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
 START_TEST(test_bdd_ite_reduced_1)
 {
     ipset_node_cache_t  *cache = ipset_node_cache_new();
@@ -752,7 +1218,7 @@ START_TEST(test_bdd_ite_evaluate_1)
     gboolean  input1[] = { TRUE, TRUE };
     gint  expected1 = 2;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input1)
                 == expected1,
@@ -761,7 +1227,7 @@ START_TEST(test_bdd_ite_evaluate_1)
     gboolean  input2[] = { TRUE, FALSE };
     gint  expected2 = 0;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input2)
                 == expected2,
@@ -770,7 +1236,7 @@ START_TEST(test_bdd_ite_evaluate_1)
     gboolean  input3[] = { FALSE, TRUE };
     gint  expected3 = 0;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input3)
                 == expected3,
@@ -779,7 +1245,7 @@ START_TEST(test_bdd_ite_evaluate_1)
     gboolean  input4[] = { FALSE, FALSE };
     gint  expected4 = 0;
 
-    fail_unless(ipset_node_evaluate(node,
+    fail_unless(ipset_node_evaluate(cache, node,
                                     ipset_bool_array_assignment,
                                     input4)
                 == expected4,
@@ -790,6 +1256,333 @@ START_TEST(test_bdd_ite_evaluate_1)
 END_TEST
 
 
+START_TEST(test_bdd_ite_normalize_1)
+{
+    ipset_node_cache_t  *cache = ipset_node_cache_new();
+    ipset_node_cache_stats_t  before, after;
+
+    /*
+     * Create BDDs representing
+     *   f(x) = x[0] ∧ x[1]
+     *   g(x) = x[1] ∨ x[2]
+     */
+
+    ipset_node_id_t  n_false =
+        ipset_node_cache_terminal(cache, FALSE);
+    ipset_node_id_t  n_true =
+        ipset_node_cache_terminal(cache, TRUE);
+    ipset_node_id_t  n_two =
+        ipset_node_cache_terminal(cache, 2);
+    ipset_node_id_t  n_three =
+        ipset_node_cache_terminal(cache, 3);
+
+    ipset_node_id_t  x0 =
+        ipset_node_cache_nonterminal(cache, 0, n_false, n_true);
+    ipset_node_id_t  x1 =
+        ipset_node_cache_nonterminal(cache, 1, n_false, n_true);
+    ipset_node_id_t  x2 =
+        ipset_node_cache_nonterminal(cache, 2, n_false, n_true);
+
+    ipset_node_id_t  f = ipset_node_cache_and(cache, x0, x1);
+    ipset_node_id_t  g = ipset_node_cache_or(cache, x1, x2);
+    ipset_node_id_t  f_or_g = ipset_node_cache_or(cache, f, g);
+
+    /*
+     * ITEs that are really binary operations should be answered from
+     * the binary operations' computed table entries.
+     */
+
+    ipset_node_cache_get_stats(cache, &before);
+
+    fail_unless(ipset_node_cache_ite(cache, f, n_true, g) == f_or_g,
+                "ITE(f, 1, g) should be f ∨ g");
+    fail_unless(ipset_node_cache_ite(cache, f, f, g) == f_or_g,
+                "ITE(f, f, g) should be f ∨ g");
+    fail_unless(ipset_node_cache_ite(cache, ipset_node_not(f),
+                                     g, n_true) == f_or_g,
+                "ITE(¬f, g, 1) should be f ∨ g");
+
+    ipset_node_cache_get_stats(cache, &after);
+
+    if (after.counters_enabled)
+    {
+        fail_unless(after.op_hits[IPSET_OP_OR] ==
+                    before.op_hits[IPSET_OP_OR] + 3,
+                    "Each ITE should hit the OR entry");
+        fail_unless(after.op_misses[IPSET_OP_ITE] ==
+                    before.op_misses[IPSET_OP_ITE],
+                    "None of the ITEs should miss");
+    }
+
+    fail_unless(ipset_node_cache_ite(cache, f, g, n_false) ==
+                ipset_node_cache_and(cache, f, g),
+                "ITE(f, g, 0) should be f ∧ g");
+    fail_unless(ipset_node_cache_ite(cache, f, g, f) ==
+                ipset_node_cache_and(cache, f, g),
+                "ITE(f, g, f) should be f ∧ g");
+    fail_unless(ipset_node_cache_ite(cache, f, ipset_node_not(g), g) ==
+                ipset_node_cache_xor(cache, f, g),
+                "ITE(f, ¬g, g) should be f ⊕ g");
+
+    /*
+     * Swapping the branches of a complemented condition works for
+     * non-Boolean branches, too.
+     */
+
+    ipset_node_id_t  node =
+        ipset_node_cache_ite(cache, f, n_three, n_two);
+
+    ipset_node_cache_get_stats(cache, &before);
+
+    fail_unless(ipset_node_cache_ite(cache, ipset_node_not(f),
+                                     n_two, n_three) == node,
+                "ITE(¬f, 2, 3) should be ITE(f, 3, 2)");
+
+    ipset_node_cache_get_stats(cache, &after);
+
+    if (after.counters_enabled)
+    {
+        fail_unless(after.op_hits[IPSET_OP_ITE] ==
+                    before.op_hits[IPSET_OP_ITE] + 1,
+                    "ITE(¬f, 2, 3) should hit the ITE(f, 3, 2) entry");
+    }
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_bdd_exists_1)
+{
+    ipset_node_cache_t  *cache = ipset_node_cache_new();
+    ipset_node_cache_stats_t  before, after;
+
+    ipset_node_id_t  n_false =
+        ipset_node_cache_terminal(cache, FALSE);
+    ipset_node_id_t  n_true =
+        ipset_node_cache_terminal(cache, TRUE);
+
+    ipset_node_id_t  x0 =
+        ipset_node_cache_nonterminal(cache, 0, n_false, n_true);
+    ipset_node_id_t  x1 =
+        ipset_node_cache_nonterminal(cache, 1, n_false, n_true);
+    ipset_node_id_t  x2 =
+        ipset_node_cache_nonterminal(cache, 2, n_false, n_true);
+
+    /*
+     * ∃x2. x0 ∧ x1 ∧ x2 = x0 ∧ x1
+     */
+
+    ipset_node_id_t  f = ipset_node_cache_and
+        (cache, x0, ipset_node_cache_and(cache, x1, x2));
+    ipset_node_id_t  expected = ipset_node_cache_and(cache, x0, x1);
+
+    fail_unless(ipset_node_cache_exists_from(cache, f, 2) == expected,
+                "∃x2. x0 ∧ x1 ∧ x2 should be x0 ∧ x1");
+    fail_unless(ipset_node_cache_exists_from(cache, f, 0) == n_true,
+                "Quantifying every variable should give TRUE");
+
+    /*
+     * The result should be in the computed table now.
+     */
+
+    ipset_node_cache_get_stats(cache, &before);
+
+    fail_unless(ipset_node_cache_exists_from(cache, f, 2) == expected,
+                "∃x2. x0 ∧ x1 ∧ x2 should still be x0 ∧ x1");
+
+    ipset_node_cache_get_stats(cache, &after);
+
+    if (after.counters_enabled)
+    {
+        fail_unless(after.op_hits[IPSET_OP_EXISTS] ==
+                    before.op_hits[IPSET_OP_EXISTS] + 1,
+                    "Repeated EXISTS should hit the computed table");
+    }
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_bdd_restrict_1)
+{
+    ipset_node_cache_t  *cache = ipset_node_cache_new();
+    ipset_node_cache_stats_t  before, after;
+
+    ipset_node_id_t  n_false =
+        ipset_node_cache_terminal(cache, FALSE);
+    ipset_node_id_t  n_true =
+        ipset_node_cache_terminal(cache, TRUE);
+
+    ipset_node_id_t  x0 =
+        ipset_node_cache_nonterminal(cache, 0, n_false, n_true);
+    ipset_node_id_t  x1 =
+        ipset_node_cache_nonterminal(cache, 1, n_false, n_true);
+    ipset_node_id_t  x2 =
+        ipset_node_cache_nonterminal(cache, 2, n_false, n_true);
+
+    /*
+     * Restricting x0 ∧ x1 to x0 only leaves x1.
+     */
+
+    ipset_node_id_t  f = ipset_node_cache_and(cache, x0, x1);
+
+    fail_unless(ipset_node_cache_restrict(cache, f, x0) == x1,
+                "x0 ∧ x1 restricted to x0 should be x1");
+    fail_unless(ipset_node_cache_restrict(cache, f, f) == n_true,
+                "f restricted to itself should be TRUE");
+    fail_unless(ipset_node_cache_restrict(cache, f, n_false) == n_false,
+                "f restricted to FALSE should be FALSE");
+
+    /*
+     * x1 ∧ x2 doesn't test x0, so the care set's x0 test gets
+     * quantified away, leaving x1 as the care set, and x2 as the
+     * result.
+     */
+
+    ipset_node_id_t  g = ipset_node_cache_and(cache, x1, x2);
+
+    fail_unless(ipset_node_cache_restrict(cache, g, f) == x2,
+                "x1 ∧ x2 restricted to x0 ∧ x1 should be x2");
+
+    /*
+     * The result should be in the computed table now.
+     */
+
+    ipset_node_cache_get_stats(cache, &before);
+
+    fail_unless(ipset_node_cache_restrict(cache, g, f) == x2,
+                "x1 ∧ x2 restricted to x0 ∧ x1 should still be x2");
+
+    ipset_node_cache_get_stats(cache, &after);
+
+    if (after.counters_enabled)
+    {
+        fail_unless(after.op_hits[IPSET_OP_RESTRICT] ==
+                    before.op_hits[IPSET_OP_RESTRICT] + 1,
+                    "Repeated RESTRICT should hit the computed table");
+    }
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+static ipset_range_t
+combine_max(ipset_range_t lhs_value, ipset_range_t rhs_value,
+            gpointer user_data)
+{
+    return MAX(lhs_value, rhs_value);
+}
+
+
+static ipset_range_t
+combine_sum(ipset_range_t lhs_value, ipset_range_t rhs_value,
+            gpointer user_data)
+{
+    return lhs_value + rhs_value;
+}
+
+
+START_TEST(test_bdd_combine_1)
+{
+    ipset_node_cache_t  *cache = ipset_node_cache_new();
+
+    ipset_node_id_t  n0 = ipset_node_cache_terminal(cache, 0);
+    ipset_node_id_t  n1 = ipset_node_cache_terminal(cache, 1);
+    ipset_node_id_t  n2 = ipset_node_cache_terminal(cache, 2);
+    ipset_node_id_t  n3 = ipset_node_cache_terminal(cache, 3);
+
+    /*
+     * lhs = x0? 1: 0
+     * rhs = x0? 2: 1
+     */
+
+    ipset_node_id_t  lhs =
+        ipset_node_cache_nonterminal(cache, 0, n0, n1);
+    ipset_node_id_t  rhs =
+        ipset_node_cache_nonterminal(cache, 0, n1, n2);
+
+    ipset_node_id_t  expected_max = rhs;
+    ipset_node_id_t  expected_sum =
+        ipset_node_cache_nonterminal(cache, 0, n1, n3);
+
+    fail_unless(ipset_node_cache_combine
+                (cache, lhs, rhs, combine_max, NULL) == expected_max,
+                "Combining with max gives the wrong result");
+
+    /*
+     * A different combiner on the same operands must not reuse the
+     * first call's results.
+     */
+
+    fail_unless(ipset_node_cache_combine
+                (cache, lhs, rhs, combine_sum, NULL) == expected_sum,
+                "Combining with sum gives the wrong result");
+
+    fail_unless(ipset_node_cache_combine
+                (cache, lhs, rhs, combine_max, NULL) == expected_max,
+                "Combining with max again gives the wrong result");
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+static ipset_range_t
+map_double(ipset_range_t value, gpointer user_data)
+{
+    return value * 2;
+}
+
+
+static ipset_range_t
+map_increment(ipset_range_t value, gpointer user_data)
+{
+    return value + 1;
+}
+
+
+START_TEST(test_bdd_map_terminals_1)
+{
+    ipset_node_cache_t  *cache = ipset_node_cache_new();
+
+    ipset_node_id_t  n1 = ipset_node_cache_terminal(cache, 1);
+    ipset_node_id_t  n2 = ipset_node_cache_terminal(cache, 2);
+    ipset_node_id_t  n3 = ipset_node_cache_terminal(cache, 3);
+    ipset_node_id_t  n4 = ipset_node_cache_terminal(cache, 4);
+
+    /*
+     * f = x0? 2: 1
+     */
+
+    ipset_node_id_t  f =
+        ipset_node_cache_nonterminal(cache, 0, n1, n2);
+
+    ipset_node_id_t  expected_double =
+        ipset_node_cache_nonterminal(cache, 0, n2, n4);
+    ipset_node_id_t  expected_increment =
+        ipset_node_cache_nonterminal(cache, 0, n2, n3);
+
+    fail_unless(ipset_node_cache_map_terminals
+                (cache, f, map_double, NULL) == expected_double,
+                "Doubling terminals gives the wrong result");
+
+    /*
+     * A different mapper on the same BDD must not reuse the first
+     * call's results.
+     */
+
+    fail_unless(ipset_node_cache_map_terminals
+                (cache, f, map_increment, NULL) == expected_increment,
+                "Incrementing terminals gives the wrong result");
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
 /*-----------------------------------------------------------------------
  * Memory size
  */
@@ -828,10 +1621,10 @@ START_TEST(test_bdd_size_1)
      * And verify how big it is.
      */
 
-    fail_unless(ipset_node_reachable_count(node) == 3u,
+    fail_unless(ipset_node_reachable_count(cache, node) == 3u,
                 "BDD has wrong number of nodes");
 
-    fail_unless(ipset_node_memory_size(node) ==
+    fail_unless(ipset_node_memory_size(cache, node) ==
                 3u * sizeof(ipset_node_t),
                 "BDD takes up wrong amount of space");
 
@@ -1122,7 +1915,7 @@ START_TEST(test_bdd_iterate_1)
     ipset_assignment_t  *expected;
     expected = ipset_assignment_new();
 
-    ipset_bdd_iterator_t  *it = ipset_node_iterate(node);
+    ipset_bdd_iterator_t  *it = ipset_node_iterate(cache, node);
 
     fail_if(it->finished,
             "Iterator should not be empty");
@@ -1180,7 +1973,7 @@ START_TEST(test_bdd_iterate_2)
     ipset_assignment_t  *expected;
     expected = ipset_assignment_new();
 
-    ipset_bdd_iterator_t  *it = ipset_node_iterate(node);
+    ipset_bdd_iterator_t  *it = ipset_node_iterate(cache, node);
 
     fail_if(it->finished,
             "Iterator should not be empty");
@@ -1248,6 +2041,10 @@ test_suite()
     tcase_add_test(tc_nonterminals, test_bdd_nonterminal_1);
     tcase_add_test(tc_nonterminals, test_bdd_nonterminal_reduced_1);
     tcase_add_test(tc_nonterminals, test_bdd_nonterminal_reduced_2);
+    tcase_add_test(tc_nonterminals, test_bdd_nonterminal_reduced_3);
+    tcase_add_test(tc_nonterminals, test_bdd_reserve_1);
+    tcase_add_test(tc_nonterminals, test_bdd_stats_1);
+    tcase_add_test(tc_nonterminals, test_bdd_complement_1);
     suite_add_tcase(s, tc_nonterminals);
 
     TCase  *tc_evaluation = tcase_create("evaluation");
@@ -1260,8 +2057,17 @@ test_suite()
     tcase_add_test(tc_operators, test_bdd_and_evaluate_1);
     tcase_add_test(tc_operators, test_bdd_or_reduced_1);
     tcase_add_test(tc_operators, test_bdd_or_evaluate_1);
+    tcase_add_test(tc_operators, test_bdd_or_lossy_1);
+    tcase_add_test(tc_operators, test_bdd_shared_table_1);
+    tcase_add_test(tc_operators, test_bdd_deep_apply_1);
+    tcase_add_test(tc_operators, test_bdd_parallel_apply_1);
     tcase_add_test(tc_operators, test_bdd_ite_reduced_1);
     tcase_add_test(tc_operators, test_bdd_ite_evaluate_1);
+    tcase_add_test(tc_operators, test_bdd_ite_normalize_1);
+    tcase_add_test(tc_operators, test_bdd_exists_1);
+    tcase_add_test(tc_operators, test_bdd_restrict_1);
+    tcase_add_test(tc_operators, test_bdd_combine_1);
+    tcase_add_test(tc_operators, test_bdd_map_terminals_1);
     suite_add_tcase(s, tc_operators);
 
     TCase  *tc_size = tcase_create("size");
@@ -1280,13 +2086,7 @@ test_suite()
     tcase_add_test(tc_iteration, test_bdd_iterate_2);
     suite_add_tcase(s, tc_iteration);
 
-    Suite  *s1 = suite_create("bdd");
-    TCase  *tc1 = tcase_create("bits");
-    tcase_add_test(tc1, test_bdd_save_1);
-    suite_add_tcase(s1, tc1);
-    (void) s;
-
-    return s1;
+    return s;
 }
 
 
@@ -14,7 +14,9 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 
+#include <ipset/bdd/nodes.h>
 #include <ipset/ipset.h>
+#include <ipset/internal.h>
 
 
 /*-----------------------------------------------------------------------
@@ -402,13 +404,7 @@ START_TEST(test_ipv4_memory_size_1)
     ipmap_init(&map, 0);
     ipmap_ipv4_set(&map, &IPV4_ADDR_1, 1);
 
-#if GLIB_SIZEOF_VOID_P == 4
     expected = 396;
-#elif GLIB_SIZEOF_VOID_P == 8
-    expected = 792;
-#else
-#   error "Unknown architecture: not 32-bit or 64-bit"
-#endif
     actual = ipmap_memory_size(&map);
 
     fail_unless(expected == actual,
@@ -427,13 +423,7 @@ START_TEST(test_ipv4_memory_size_2)
     ipmap_init(&map, 0);
     ipmap_ipv4_set_network(&map, &IPV4_ADDR_1, 24, 1);
 
-#if GLIB_SIZEOF_VOID_P == 4
     expected = 300;
-#elif GLIB_SIZEOF_VOID_P == 8
-    expected = 600;
-#else
-#   error "Unknown architecture: not 32-bit or 64-bit"
-#endif
     actual = ipmap_memory_size(&map);
 
     fail_unless(expected == actual,
@@ -444,6 +434,366 @@ START_TEST(test_ipv4_memory_size_2)
 }
 END_TEST
 
+START_TEST(test_ipv4_done_releases_nodes)
+{
+    ip_map_t  map;
+    ipv4_addr_t  addr1 = "\x0a\x00\x00\x01"; /* 10.0.0.1 */
+    ipv4_addr_t  addr2 = "\x0a\x00\x00\x02"; /* 10.0.0.2 */
+    ipv4_addr_t  addr3 = "\x0a\x01\x00\x00"; /* 10.1.0.0 */
+    gsize  node_count;
+
+    /*
+     * Once we throw the map away, any nodes that it created should
+     * be released.  We use addresses that no other test uses, so
+     * that none of the nodes already exist.
+     */
+
+    node_count = ipset_node_cache_node_count(ipset_cache);
+
+    ipmap_init(&map, 0);
+    ipmap_ipv4_set(&map, &addr1, 1);
+    ipmap_ipv4_set(&map, &addr2, 2);
+    ipmap_ipv4_set_network(&map, &addr3, 24, 2);
+    ipmap_done(&map);
+
+    fail_unless(ipset_node_cache_node_count(ipset_cache) <= node_count,
+                "Nodes should be released when the map is freed");
+}
+END_TEST
+
+START_TEST(test_ipv4_collect_garbage)
+{
+    ip_map_t  map;
+    ipv4_addr_t  addr = "\x0a\x02\x00\x01"; /* 10.2.0.1 */
+
+    ipmap_init(&map, 0);
+    ipmap_ipv4_set(&map, &IPV4_ADDR_1, 1);
+    ipmap_ipv4_set_network(&map, &IPV4_ADDR_3, 24, 2);
+
+    /*
+     * Create a BDD that isn't part of any map, and make sure that the
+     * collector reclaims it without touching the map's nodes.
+     */
+
+    ipset_ipv4_make_ip_bdd(ipset_cache, &addr, 32);
+
+    fail_unless(ipset_cache_collect() > 0,
+                "Unreachable nodes should be reclaimed");
+
+    fail_unless(ipmap_ipv4_get(&map, &IPV4_ADDR_1) == 1,
+                "Map should survive garbage collection");
+    fail_unless(ipmap_ipv4_get(&map, &IPV4_ADDR_3) == 2,
+                "Map should survive garbage collection");
+    fail_unless(ipmap_ipv4_get(&map, &IPV4_ADDR_2) == 0,
+                "Map should survive garbage collection");
+
+    ipmap_done(&map);
+}
+END_TEST
+
+START_TEST(test_ipv4_context_import)
+{
+    ipset_context_t  *ctx;
+    ip_map_t  map1, map2;
+
+    ctx = ipset_context_new();
+    fail_if(ctx == NULL, "Cannot create context");
+
+    ipmap_init_in(ctx, &map1, 5);
+    ipmap_ipv4_set(&map1, &IPV4_ADDR_1, 1);
+    ipmap_ipv4_set_network(&map1, &IPV4_ADDR_3, 24, 2);
+
+    ipmap_init_import(ipset_cache, &map2, &map1);
+
+    ipmap_done(&map1);
+    ipset_context_free(ctx);
+
+    fail_unless(ipmap_ipv4_get(&map2, &IPV4_ADDR_1) == 1,
+                "Imported map should keep its values");
+    fail_unless(ipmap_ipv4_get(&map2, &IPV4_ADDR_3) == 2,
+                "Imported map should keep its values");
+    fail_unless(ipmap_ipv4_get(&map2, &IPV4_ADDR_2) == 5,
+                "Imported map should keep its default");
+
+    ipmap_done(&map2);
+}
+END_TEST
+
+START_TEST(test_ipv4_payloads_01)
+{
+    ip_map_t  map;
+
+    /*
+     * Payloads don't have to fit into a gint.
+     */
+
+    const guint64  BIG = G_GUINT64_CONSTANT(0xfedcba9876543210);
+
+    ipmap_init_uint64(&map, 7);
+
+    ipmap_ipv4_set_uint64(&map, &IPV4_ADDR_1, BIG);
+    ipmap_ipv4_set_network_uint64(&map, &IPV4_ADDR_3, 24, BIG);
+
+    fail_unless(ipmap_ipv4_get_uint64(&map, &IPV4_ADDR_1) == BIG,
+                "Element should have a payload");
+    fail_unless(ipmap_ipv4_get_uint64(&map, &IPV4_ADDR_3) == BIG,
+                "Network should have a payload");
+    fail_unless(ipmap_ipv4_get_uint64(&map, &IPV4_ADDR_2) == 7,
+                "Element should have the default payload");
+
+    ipmap_done(&map);
+}
+END_TEST
+
+
+START_TEST(test_ipv4_payloads_import)
+{
+    ipset_context_t  *ctx1, *ctx2;
+    ip_map_t  map1, map2;
+
+    const guint64  PAYLOAD_1 = G_GUINT64_CONSTANT(0x100000001);
+    const guint64  PAYLOAD_2 = G_GUINT64_CONSTANT(0x100000002);
+
+    ctx1 = ipset_context_new();
+    ctx2 = ipset_context_new();
+
+    /*
+     * Give the destination's dictionary a different set of payloads,
+     * so that the two contexts use different values for them.
+     */
+
+    ipmap_init_uint64_in(ctx2, &map2, PAYLOAD_2);
+    ipmap_done(&map2);
+
+    ipmap_init_uint64_in(ctx1, &map1, 9);
+    ipmap_ipv4_set_uint64(&map1, &IPV4_ADDR_1, PAYLOAD_1);
+    ipmap_ipv4_set_network_uint64(&map1, &IPV4_ADDR_3, 24, PAYLOAD_2);
+
+    ipmap_init_import(ctx2, &map2, &map1);
+
+    ipmap_done(&map1);
+    ipset_context_free(ctx1);
+
+    fail_unless(ipmap_ipv4_get_uint64(&map2, &IPV4_ADDR_1) == PAYLOAD_1,
+                "Imported map should keep its payloads");
+    fail_unless(ipmap_ipv4_get_uint64(&map2, &IPV4_ADDR_3) == PAYLOAD_2,
+                "Imported map should keep its payloads");
+    fail_unless(ipmap_ipv4_get_uint64(&map2, &IPV4_ADDR_2) == 9,
+                "Imported map should keep its default payload");
+
+    ipmap_done(&map2);
+    ipset_context_free(ctx2);
+}
+END_TEST
+
+
+START_TEST(test_ipv4_payloads_02)
+{
+    ip_map_t  map;
+    gint  route1, route2;
+
+    ipmap_init_ptr(&map, NULL);
+
+    ipmap_ipv4_set_ptr(&map, &IPV4_ADDR_1, &route1);
+    ipmap_ipv4_set_network_ptr(&map, &IPV4_ADDR_3, 24, &route2);
+
+    fail_unless(ipmap_ipv4_get_ptr(&map, &IPV4_ADDR_1) == &route1,
+                "Element should have a pointer");
+    fail_unless(ipmap_ipv4_get_ptr(&map, &IPV4_ADDR_3) == &route2,
+                "Network should have a pointer");
+    fail_unless(ipmap_ipv4_get_ptr(&map, &IPV4_ADDR_2) == NULL,
+                "Element should have the default pointer");
+    fail_if(ipmap_is_empty(&map),
+            "Map with pointers shouldn't be empty");
+
+    ipmap_done(&map);
+}
+END_TEST
+
+
+START_TEST(test_ipv4_payloads_03)
+{
+    ipset_context_t  *ctx;
+    ip_map_t  map;
+    guint32  i;
+
+    ctx = ipset_context_new();
+    fail_if(ctx == NULL, "Cannot create context");
+
+    /*
+     * Add enough distinct payloads to fill several of the
+     * dictionary's chunks.
+     */
+
+    const guint64  BASE = G_GUINT64_CONSTANT(0x100000000);
+
+    ipmap_init_uint64_in(ctx, &map, BASE);
+
+    for (i = 1; i < 500; i++)
+    {
+        guint32  addr = GUINT32_TO_BE(0x0a000000 + i);
+        ipmap_ipv4_set_uint64(&map, &addr, BASE + i);
+    }
+
+    for (i = 0; i < 500; i++)
+    {
+        guint32  addr = GUINT32_TO_BE(0x0a000000 + i);
+        fail_unless(ipmap_ipv4_get_uint64(&map, &addr) == BASE + i,
+                    "Element %u should have its payload", i);
+    }
+
+    ipmap_done(&map);
+    ipset_context_free(ctx);
+}
+END_TEST
+
+
+/**
+ * A merge callback that keeps the first value, scaled by ten, and
+ * adds the second.
+ */
+
+static gint
+merge_digits(gint value1, gint value2, gpointer user_data)
+{
+    return value1 * 10 + value2;
+}
+
+START_TEST(test_ipv4_merge_01)
+{
+    ip_map_t  base, tenant, merged;
+
+    /*
+     * base: 192.168.1.0/24 → 1, 192.168.2.100 → 3, default 0
+     * tenant: 192.168.1.101 → 2, default 0
+     */
+
+    ipmap_init(&base, 0);
+    ipmap_ipv4_set_network(&base, &IPV4_ADDR_1, 24, 1);
+    ipmap_ipv4_set(&base, &IPV4_ADDR_3, 3);
+
+    ipmap_init(&tenant, 0);
+    ipmap_ipv4_set(&tenant, &IPV4_ADDR_2, 2);
+
+    ipmap_init(&merged, 0);
+
+    ipmap_merge(&merged, &tenant, &base, IPMAP_MERGE_PREFER_LEFT);
+    fail_unless(ipmap_ipv4_get(&merged, &IPV4_ADDR_1) == 1,
+                "Base value should show through");
+    fail_unless(ipmap_ipv4_get(&merged, &IPV4_ADDR_2) == 2,
+                "Tenant value should override the base");
+    fail_unless(ipmap_ipv4_get(&merged, &IPV4_ADDR_3) == 3,
+                "Base value should show through");
+
+    ipmap_merge(&merged, &tenant, &base, IPMAP_MERGE_MAX);
+    fail_unless(ipmap_ipv4_get(&merged, &IPV4_ADDR_2) == 2,
+                "Expected the larger value");
+
+    ipmap_merge(&merged, &tenant, &base, IPMAP_MERGE_MIN);
+    fail_unless(ipmap_ipv4_get(&merged, &IPV4_ADDR_2) == 1,
+                "Expected the smaller value");
+    fail_unless(ipmap_ipv4_get(&merged, &IPV4_ADDR_3) == 0,
+                "Expected the smaller value");
+
+    ipmap_merge(&merged, &tenant, &base, IPMAP_MERGE_SUM);
+    fail_unless(ipmap_ipv4_get(&merged, &IPV4_ADDR_2) == 3,
+                "Expected the sum");
+
+    ipmap_merge_func(&merged, &tenant, &base, merge_digits, NULL);
+    fail_unless(ipmap_ipv4_get(&merged, &IPV4_ADDR_1) == 1,
+                "Expected callback result");
+    fail_unless(ipmap_ipv4_get(&merged, &IPV4_ADDR_2) == 21,
+                "Expected callback result");
+
+    /*
+     * Merging into one of the operands should work, too.
+     */
+
+    ipmap_merge(&base, &tenant, &base, IPMAP_MERGE_PREFER_NON_DEFAULT);
+    ipmap_merge(&merged, &merged, &base, IPMAP_MERGE_MAX);
+    fail_unless(ipmap_ipv4_get(&base, &IPV4_ADDR_2) == 2,
+                "Tenant value should override the base");
+    fail_unless(ipmap_ipv4_get(&merged, &IPV4_ADDR_2) == 21,
+                "Expected callback result to survive");
+
+    ipmap_done(&base);
+    ipmap_done(&tenant);
+    ipmap_done(&merged);
+}
+END_TEST
+
+
+static gboolean
+value_above_one(gint value, gpointer user_data)
+{
+    return (value > 1);
+}
+
+static gint
+renumber(gint value, gpointer user_data)
+{
+    return (value == 2)? 7: value;
+}
+
+START_TEST(test_ipv4_select_01)
+{
+    ip_map_t  map;
+    ip_set_t  expected;
+    ip_set_t  *selected;
+
+    ipmap_init(&map, 0);
+    ipmap_ipv4_set(&map, &IPV4_ADDR_1, 1);
+    ipmap_ipv4_set(&map, &IPV4_ADDR_2, 2);
+    ipmap_ipv4_set_network(&map, &IPV4_ADDR_3, 24, 3);
+
+    ipset_init(&expected);
+    ipset_ipv4_add(&expected, &IPV4_ADDR_2);
+
+    selected = ipmap_select_value(&map, 2);
+    fail_unless(ipset_is_equal(selected, &expected),
+                "Expected the addresses with value 2");
+    ipset_free(selected);
+
+    ipset_ipv4_add_network(&expected, &IPV4_ADDR_3, 24);
+
+    selected = ipmap_select(&map, value_above_one, NULL);
+    fail_unless(ipset_is_equal(selected, &expected),
+                "Expected the addresses with values above 1");
+    ipset_free(selected);
+
+    ipset_done(&expected);
+    ipmap_done(&map);
+}
+END_TEST
+
+START_TEST(test_ipv4_transform_01)
+{
+    ip_map_t  map, expected;
+    ipv4_addr_t  unset = "\x0a\x00\x00\x01"; /* 10.0.0.1 */
+
+    ipmap_init(&map, 2);
+    ipmap_ipv4_set(&map, &IPV4_ADDR_1, 1);
+    ipmap_ipv4_set(&map, &IPV4_ADDR_2, 2);
+    ipmap_ipv4_set_network(&map, &IPV4_ADDR_3, 24, 3);
+
+    ipmap_init(&expected, 7);
+    ipmap_ipv4_set(&expected, &IPV4_ADDR_1, 1);
+    ipmap_ipv4_set_network(&expected, &IPV4_ADDR_3, 24, 3);
+
+    ipmap_transform(&map, renumber, NULL);
+    fail_unless(ipmap_is_equal(&map, &expected),
+                "Expected value 2 to be renumbered");
+    fail_unless(ipmap_ipv4_get(&map, &IPV4_ADDR_2) == 7,
+                "Expected value 2 to be renumbered");
+    fail_unless(ipmap_ipv4_get(&map, &unset) == 7,
+                "Expected default value to be renumbered");
+
+    ipmap_done(&map);
+    ipmap_done(&expected);
+}
+END_TEST
+
+
 START_TEST(test_ipv4_store_01)
 {
     ip_map_t  map;
@@ -674,13 +1024,7 @@ START_TEST(test_ipv6_memory_size_1)
     ipmap_init(&map, 0);
     ipmap_ipv6_set(&map, &IPV6_ADDR_1, 1);
 
-#if GLIB_SIZEOF_VOID_P == 4
     expected = 1548;
-#elif GLIB_SIZEOF_VOID_P == 8
-    expected = 3096;
-#else
-#   error "Unknown architecture: not 32-bit or 64-bit"
-#endif
     actual = ipmap_memory_size(&map);
 
     fail_unless(expected == actual,
@@ -699,13 +1043,7 @@ START_TEST(test_ipv6_memory_size_2)
     ipmap_init(&map, 0);
     ipmap_ipv6_set_network(&map, &IPV6_ADDR_1, 32, 1);
 
-#if GLIB_SIZEOF_VOID_P == 4
     expected = 396;
-#elif GLIB_SIZEOF_VOID_P == 8
-    expected = 792;
-#else
-#   error "Unknown architecture: not 32-bit or 64-bit"
-#endif
     actual = ipmap_memory_size(&map);
 
     fail_unless(expected == actual,
@@ -765,6 +1103,16 @@ ipmap_suite()
     tcase_add_test(tc_ipv4, test_ipv4_memory_size_1);
     tcase_add_test(tc_ipv4, test_ipv4_memory_size_2);
     tcase_add_test(tc_ipv4, test_ipv4_store_01);
+    tcase_add_test(tc_ipv4, test_ipv4_done_releases_nodes);
+    tcase_add_test(tc_ipv4, test_ipv4_collect_garbage);
+    tcase_add_test(tc_ipv4, test_ipv4_context_import);
+    tcase_add_test(tc_ipv4, test_ipv4_payloads_01);
+    tcase_add_test(tc_ipv4, test_ipv4_payloads_02);
+    tcase_add_test(tc_ipv4, test_ipv4_payloads_import);
+    tcase_add_test(tc_ipv4, test_ipv4_payloads_03);
+    tcase_add_test(tc_ipv4, test_ipv4_merge_01);
+    tcase_add_test(tc_ipv4, test_ipv4_select_01);
+    tcase_add_test(tc_ipv4, test_ipv4_transform_01);
     suite_add_tcase(s, tc_ipv4);
 
     TCase  *tc_ipv6 = tcase_create("ipv6");
@@ -14,7 +14,9 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 
+#include <ipset/bdd/nodes.h>
 #include <ipset/ipset.h>
+#include <ipset/internal.h>
 
 
 /*-----------------------------------------------------------------------
@@ -304,13 +306,7 @@ START_TEST(test_ipv4_memory_size_1)
     ipset_init(&set);
     ipset_ipv4_add(&set, &IPV4_ADDR_1);
 
-#if GLIB_SIZEOF_VOID_P == 4
     expected = 396;
-#elif GLIB_SIZEOF_VOID_P == 8
-    expected = 792;
-#else
-#   error "Unknown architecture: not 32-bit or 64-bit"
-#endif
     actual = ipset_memory_size(&set);
 
     fail_unless(expected == actual,
@@ -329,13 +325,7 @@ START_TEST(test_ipv4_memory_size_2)
     ipset_init(&set);
     ipset_ipv4_add_network(&set, &IPV4_ADDR_1, 24);
 
-#if GLIB_SIZEOF_VOID_P == 4
     expected = 300;
-#elif GLIB_SIZEOF_VOID_P == 8
-    expected = 600;
-#else
-#   error "Unknown architecture: not 32-bit or 64-bit"
-#endif
     actual = ipset_memory_size(&set);
 
     fail_unless(expected == actual,
@@ -346,6 +336,895 @@ START_TEST(test_ipv4_memory_size_2)
 }
 END_TEST
 
+START_TEST(test_ipv4_done_releases_nodes)
+{
+    ip_set_t  set;
+    ipv4_addr_t  addr1 = "\x0a\x00\x00\x01"; /* 10.0.0.1 */
+    ipv4_addr_t  addr2 = "\x0a\x00\x00\x02"; /* 10.0.0.2 */
+    ipv4_addr_t  addr3 = "\x0a\x01\x00\x00"; /* 10.1.0.0 */
+    gsize  node_count;
+
+    /*
+     * Once we throw the set away, any nodes that it created should
+     * be released.  We use addresses that no other test uses, so
+     * that none of the nodes already exist.
+     */
+
+    node_count = ipset_node_cache_node_count(ipset_cache);
+
+    ipset_init(&set);
+    ipset_ipv4_add(&set, &addr1);
+    ipset_ipv4_add(&set, &addr2);
+    ipset_ipv4_add_network(&set, &addr3, 24);
+    ipset_done(&set);
+
+    fail_unless(ipset_node_cache_node_count(ipset_cache) <= node_count,
+                "Nodes should be released when the set is freed");
+}
+END_TEST
+
+START_TEST(test_ipv4_collect_garbage)
+{
+    ip_set_t  set1, set2;
+    ipv4_addr_t  addr = "\x0a\x02\x00\x01"; /* 10.2.0.1 */
+
+    ipset_init(&set1);
+    ipset_ipv4_add(&set1, &IPV4_ADDR_1);
+    ipset_ipv4_add_network(&set1, &IPV4_ADDR_3, 24);
+
+    /*
+     * Create a BDD that isn't part of any set, and make sure that the
+     * collector reclaims it without touching the set's nodes.
+     */
+
+    ipset_ipv4_make_ip_bdd(ipset_cache, &addr, 32);
+
+    fail_unless(ipset_cache_collect() > 0,
+                "Unreachable nodes should be reclaimed");
+
+    ipset_init(&set2);
+    ipset_ipv4_add(&set2, &IPV4_ADDR_1);
+    ipset_ipv4_add_network(&set2, &IPV4_ADDR_3, 24);
+
+    fail_unless(ipset_is_equal(&set1, &set2),
+                "Set should survive garbage collection");
+
+    ipset_done(&set1);
+    ipset_done(&set2);
+}
+END_TEST
+
+START_TEST(test_ipv4_context_import)
+{
+    ipset_context_t  *ctx;
+    ip_set_t  set1, set2, set3;
+
+    ctx = ipset_context_new();
+    fail_if(ctx == NULL, "Cannot create context");
+
+    ipset_init_in(ctx, &set1);
+    ipset_ipv4_add(&set1, &IPV4_ADDR_1);
+    ipset_ipv4_add_network(&set1, &IPV4_ADDR_3, 24);
+
+    /*
+     * Copy the set into the default context, and make sure it's equal
+     * to the same set built there directly.
+     */
+
+    ipset_init_import(ipset_cache, &set2, &set1);
+
+    ipset_init(&set3);
+    ipset_ipv4_add(&set3, &IPV4_ADDR_1);
+    ipset_ipv4_add_network(&set3, &IPV4_ADDR_3, 24);
+
+    fail_unless(ipset_is_equal(&set2, &set3),
+                "Imported set should equal the original");
+
+    ipset_done(&set1);
+    ipset_context_free(ctx);
+
+    fail_unless(ipset_ipv4_add(&set2, &IPV4_ADDR_1),
+                "Imported set should outlive its source context");
+
+    ipset_done(&set2);
+    ipset_done(&set3);
+}
+END_TEST
+
+START_TEST(test_ipv4_memory_limit)
+{
+    ipset_context_t  *ctx;
+    ip_set_t  set1, set2, set3;
+    ipv4_addr_t  addr = "\x0a\x00\x00\x00"; /* 10.0.0.0 */
+    guint  i, added;
+
+    /*
+     * Only leave enough room in the context for the first chunk of
+     * nodes, and then add scattered addresses until we run out.
+     */
+
+    ctx = ipset_node_cache_new_sized(1);
+    ipset_context_set_memory_limit
+        (ctx, ipset_node_cache_memory_usage(ctx) +
+         IPSET_NODE_CHUNK_BASE_SIZE * sizeof(ipset_node_t));
+
+    ipset_init_in(ctx, &set1);
+    added = 0;
+
+    for (i = 0; i < 1000; i++)
+    {
+        guint32  bits = i * 2654435761u;
+        addr[1] = (guint8) (bits >> 24);
+        addr[2] = (guint8) (bits >> 16);
+        addr[3] = (guint8) (bits >> 8);
+        ipset_ipv4_add(&set1, &addr);
+
+        if (ipset_context_out_of_memory(ctx))
+            break;
+
+        added++;
+    }
+
+    fail_unless(added > 0,
+                "Should have been able to add some addresses");
+    fail_unless(added < 1000,
+                "Should have run out of memory");
+    fail_unless(ipset_node_cache_memory_usage(ctx) <= ctx->memory_limit,
+                "Context should stay within its memory limit");
+
+    /*
+     * The failed addition should have left the set unchanged.
+     */
+
+    ipset_init_import(ipset_cache, &set2, &set1);
+    ipset_init(&set3);
+
+    for (i = 0; i < added; i++)
+    {
+        guint32  bits = i * 2654435761u;
+        addr[1] = (guint8) (bits >> 24);
+        addr[2] = (guint8) (bits >> 16);
+        addr[3] = (guint8) (bits >> 8);
+        ipset_ipv4_add(&set3, &addr);
+    }
+
+    fail_unless(ipset_is_equal(&set2, &set3),
+                "Set should be unchanged after running out of memory");
+
+    ipset_done(&set1);
+    ipset_done(&set2);
+    ipset_done(&set3);
+    ipset_context_free(ctx);
+}
+END_TEST
+
+static void
+node_index_range(ipset_node_cache_t *cache, ipset_node_id_t node_id,
+                 guint32 *min_index, guint32 *max_index)
+{
+    if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE)
+        return;
+
+    guint32  index = ipset_node_id_to_index(node_id);
+    if (index < *min_index) *min_index = index;
+    if (index > *max_index) *max_index = index;
+
+    ipset_node_t  *node = ipset_node_cache_get_nonterminal(cache, node_id);
+    node_index_range(cache, node->low, min_index, max_index);
+    node_index_range(cache, node->high, min_index, max_index);
+}
+
+START_TEST(test_ipv4_compact)
+{
+    ipset_context_t  *ctx;
+    ip_set_t  set1, set2, set3, set4;
+    ipv4_addr_t  addr = "\x0a\x00\x00\x00"; /* 10.0.0.0 */
+    guint  i;
+
+    ctx = ipset_context_new();
+    ipset_init_in(ctx, &set1);
+    ipset_init_in(ctx, &set2);
+
+    /*
+     * Add addresses to two sets in turn, so that their nodes are
+     * interleaved in memory.
+     */
+
+    for (i = 0; i < 64; i++)
+    {
+        guint32  bits = i * 2654435761u;
+        addr[1] = (guint8) (bits >> 24);
+        addr[2] = (guint8) (bits >> 16);
+        addr[3] = (guint8) (bits >> 8);
+        ipset_ipv4_add((i % 2 == 0)? &set1: &set2, &addr);
+    }
+
+    ipset_compact(&set1);
+
+    guint32  min_index = G_MAXUINT32;
+    guint32  max_index = 0;
+    node_index_range(ctx, set1.set_bdd, &min_index, &max_index);
+
+    fail_unless(max_index - min_index + 1 ==
+                ipset_node_reachable_count(ctx, set1.set_bdd),
+                "Compacted set should be contiguous");
+
+    /*
+     * The set already fits in the slots that it's using, so
+     * compacting it again shouldn't need any new ones.
+     */
+
+    guint32  arena_size = ctx->next_index;
+    ipset_compact(&set1);
+
+    fail_unless(ctx->next_index <= arena_size,
+                "Compaction shouldn't grow the arena");
+
+    /*
+     * Both sets should still have the same contents.
+     */
+
+    ipset_init_in(ctx, &set3);
+    ipset_init_in(ctx, &set4);
+
+    for (i = 0; i < 64; i++)
+    {
+        guint32  bits = i * 2654435761u;
+        addr[1] = (guint8) (bits >> 24);
+        addr[2] = (guint8) (bits >> 16);
+        addr[3] = (guint8) (bits >> 8);
+        ipset_ipv4_add((i % 2 == 0)? &set3: &set4, &addr);
+    }
+
+    fail_unless(ipset_is_equal(&set1, &set3),
+                "Compacted set should be unchanged");
+    fail_unless(ipset_is_equal(&set2, &set4),
+                "Other sets should be unchanged by compaction");
+
+    ipset_done(&set1);
+    ipset_done(&set2);
+    ipset_done(&set3);
+    ipset_done(&set4);
+    ipset_context_free(ctx);
+}
+END_TEST
+
+START_TEST(test_ipv4_algebra_1)
+{
+    ip_set_t  set1, set2, expected;
+    ip_set_t  *result;
+
+    /*
+     * set1 = {x, y}, set2 = {y, z}
+     */
+
+    ipset_init(&set1);
+    ipset_ipv4_add(&set1, &IPV4_ADDR_1);
+    ipset_ipv4_add(&set1, &IPV4_ADDR_2);
+
+    ipset_init(&set2);
+    ipset_ipv4_add(&set2, &IPV4_ADDR_2);
+    ipset_ipv4_add(&set2, &IPV4_ADDR_3);
+
+    ipset_init(&expected);
+    ipset_ipv4_add(&expected, &IPV4_ADDR_1);
+    ipset_ipv4_add(&expected, &IPV4_ADDR_2);
+    ipset_ipv4_add(&expected, &IPV4_ADDR_3);
+
+    result = ipset_union_new(&set1, &set2);
+    fail_unless(ipset_is_equal(result, &expected),
+                "Expected {x,y} ∪ {y,z} == {x,y,z}");
+    ipset_free(result);
+
+    ipset_done(&expected);
+    ipset_init(&expected);
+    ipset_ipv4_add(&expected, &IPV4_ADDR_2);
+
+    result = ipset_intersect_new(&set1, &set2);
+    fail_unless(ipset_is_equal(result, &expected),
+                "Expected {x,y} ∩ {y,z} == {y}");
+    ipset_free(result);
+
+    ipset_done(&expected);
+    ipset_init(&expected);
+    ipset_ipv4_add(&expected, &IPV4_ADDR_1);
+
+    result = ipset_difference_new(&set1, &set2);
+    fail_unless(ipset_is_equal(result, &expected),
+                "Expected {x,y} - {y,z} == {x}");
+    ipset_free(result);
+
+    ipset_ipv4_add(&expected, &IPV4_ADDR_3);
+
+    result = ipset_xor_new(&set1, &set2);
+    fail_unless(ipset_is_equal(result, &expected),
+                "Expected {x,y} ⊕ {y,z} == {x,z}");
+    ipset_free(result);
+
+    /*
+     * And again in place.
+     */
+
+    ipset_xor(&set1, &set2);
+    fail_unless(ipset_is_equal(&set1, &expected),
+                "Expected {x,y} ⊕ {y,z} == {x,z}");
+
+    ipset_difference(&set1, &expected);
+    fail_unless(ipset_is_empty(&set1),
+                "Expected {x,z} - {x,z} == ∅");
+
+    ipset_union(&set1, &set2);
+    fail_unless(ipset_is_equal(&set1, &set2),
+                "Expected ∅ ∪ {y,z} == {y,z}");
+
+    ipset_intersect(&set1, &expected);
+    ipset_done(&expected);
+    ipset_init(&expected);
+    ipset_ipv4_add(&expected, &IPV4_ADDR_3);
+    fail_unless(ipset_is_equal(&set1, &expected),
+                "Expected {y,z} ∩ {x,z} == {z}");
+
+    ipset_done(&set1);
+    ipset_done(&set2);
+    ipset_done(&expected);
+}
+END_TEST
+
+
+START_TEST(test_ipv4_union_many_1)
+{
+    ip_set_t  set1, set2, set3, set4, expected;
+    ip_set_t  *sets[4] = { &set1, &set2, &set3, &set4 };
+    ip_set_t  *result;
+
+    /*
+     * set1 = {x}, set2 = {x, y}, set3 = x/24, set4 = ¬{y}
+     */
+
+    ipset_init(&set1);
+    ipset_ipv4_add(&set1, &IPV4_ADDR_1);
+
+    ipset_init(&set2);
+    ipset_ipv4_add(&set2, &IPV4_ADDR_1);
+    ipset_ipv4_add(&set2, &IPV4_ADDR_2);
+
+    ipset_init(&set3);
+    ipset_ipv4_add_network(&set3, &IPV4_ADDR_3, 24);
+
+    ipset_init(&set4);
+    ipset_ipv4_add(&set4, &IPV4_ADDR_2);
+    ipset_complement(&set4);
+
+    /*
+     * The union of the first three sets should match a chain of
+     * binary unions.
+     */
+
+    ipset_init(&expected);
+    ipset_union(&expected, &set1);
+    ipset_union(&expected, &set2);
+    ipset_union(&expected, &set3);
+
+    result = ipset_union_many(sets, 3);
+    fail_unless(ipset_is_equal(result, &expected),
+                "Expected N-ary union to match binary unions");
+    ipset_free(result);
+
+    /*
+     * set2 and set4 together cover everything.
+     */
+
+    result = ipset_union_many(sets, 4);
+    ipset_done(&expected);
+    ipset_init(&expected);
+    ipset_complement(&expected);
+    fail_unless(ipset_is_equal(result, &expected),
+                "Expected {x,y} ∪ ¬{y} to be everything");
+    ipset_free(result);
+
+    /*
+     * A single set is copied.
+     */
+
+    result = ipset_union_many(sets + 2, 1);
+    fail_unless(ipset_is_equal(result, &set3),
+                "Expected union of one set to equal that set");
+    ipset_free(result);
+
+    ipset_done(&set1);
+    ipset_done(&set2);
+    ipset_done(&set3);
+    ipset_done(&set4);
+    ipset_done(&expected);
+}
+END_TEST
+
+START_TEST(test_ipv4_coarsen_1)
+{
+    ip_set_t  set, expected;
+    ip_set_t  *result;
+    ipv4_addr_t  low_half = "\x0a\x00\x00\x00"; /* 10.0.0.0 */
+
+    ipset_init(&set);
+    ipset_ipv4_add(&set, &IPV4_ADDR_1);
+    ipset_ipv4_add(&set, &IPV4_ADDR_2);
+    ipset_ipv4_add(&set, &IPV4_ADDR_3);
+    ipset_ipv6_add(&set, &IPV6_ADDR_1);
+    ipset_ipv6_add(&set, &IPV6_ADDR_3);
+
+    /*
+     * Each address should be replaced by its whole network.
+     */
+
+    ipset_init(&expected);
+    ipset_ipv4_add_network(&expected, &IPV4_ADDR_1, 24);
+    ipset_ipv4_add_network(&expected, &IPV4_ADDR_3, 24);
+    ipset_ipv6_add_network(&expected, &IPV6_ADDR_1, 48);
+    ipset_ipv6_add_network(&expected, &IPV6_ADDR_3, 48);
+
+    result = ipset_coarsen(&set, 24, 48);
+    fail_unless(ipset_is_equal(result, &expected),
+                "Expected coarsened set to hold /24s and /48s");
+    ipset_free(result);
+
+    /*
+     * Full-length prefixes don't change anything, and an empty
+     * prefix covers every address of a kind that appears, without
+     * adding the other kind.
+     */
+
+    result = ipset_coarsen(&set, 32, 128);
+    fail_unless(ipset_is_equal(result, &set),
+                "Expected full-length prefixes to keep the set");
+    ipset_free(result);
+
+    ipset_done(&set);
+    ipset_init(&set);
+    ipset_ipv4_add(&set, &IPV4_ADDR_1);
+
+    ipset_done(&expected);
+    ipset_init(&expected);
+    ipset_ipv4_add_network(&expected, &IPV4_ADDR_1, 1);
+    ipset_ipv4_add_network(&expected, &low_half, 1);
+
+    result = ipset_coarsen(&set, 0, 0);
+    fail_unless(ipset_is_equal(result, &expected),
+                "Expected /0 to cover every IPv4 address");
+    ipset_free(result);
+
+    ipset_done(&set);
+    ipset_done(&expected);
+}
+END_TEST
+
+START_TEST(test_ipv4_minimize_1)
+{
+    ip_set_t  set, care;
+    ip_set_t  *before, *after;
+    ipv4_addr_t  other = "\x0a\x01\x02\x03"; /* 10.1.2.3 */
+    gsize  original_size;
+
+    /*
+     * set = 192.168.1.0/24 ∪ {10.1.2.3, 192.168.2.100}
+     * care = 192.168.0.0/16
+     */
+
+    ipset_init(&set);
+    ipset_ipv4_add_network(&set, &IPV4_ADDR_1, 24);
+    ipset_ipv4_add(&set, &other);
+    ipset_ipv4_add(&set, &IPV4_ADDR_3);
+
+    ipset_init(&care);
+    ipset_ipv4_add_network(&care, &IPV4_ADDR_1, 16);
+
+    before = ipset_intersect_new(&set, &care);
+    original_size = ipset_memory_size(&set);
+
+    /*
+     * The minimized set has to agree with the original within the
+     * care set, and should be smaller, since it doesn't need to
+     * check the first 16 bits, or hold onto 10.1.2.3.
+     */
+
+    ipset_minimize(&set, &care);
+    after = ipset_intersect_new(&set, &care);
+
+    fail_unless(ipset_is_equal(before, after),
+                "Minimized set should agree within the care set");
+    fail_unless(ipset_memory_size(&set) < original_size,
+                "Minimized set should be smaller");
+
+    ipset_free(before);
+    ipset_free(after);
+    ipset_done(&set);
+    ipset_done(&care);
+}
+END_TEST
+
+START_TEST(test_ipv4_subset_1)
+{
+    ip_set_t  empty, host, network, other;
+    ipset_cache_stats_t  stats;
+    gsize  node_count;
+
+    ipset_init(&empty);
+
+    ipset_init(&host);
+    ipset_ipv4_add(&host, &IPV4_ADDR_1);
+
+    ipset_init(&network);
+    ipset_ipv4_add_network(&network, &IPV4_ADDR_1, 24);
+
+    ipset_init(&other);
+    ipset_ipv4_add(&other, &IPV4_ADDR_3);
+    ipset_ipv6_add(&other, &IPV6_ADDR_1);
+
+    ipset_cache_stats(&stats);
+    node_count = stats.node_count;
+
+    fail_unless(ipset_is_subset(&host, &network),
+                "Host should be inside its network");
+    fail_if(ipset_is_subset(&network, &host),
+            "Network shouldn't be inside one of its hosts");
+    fail_unless(ipset_is_subset(&empty, &host),
+                "Empty set should be inside everything");
+    fail_unless(ipset_is_subset(&network, &network),
+                "Set should be inside itself");
+
+    fail_unless(ipset_is_disjoint(&network, &other),
+                "Network shouldn't overlap other addresses");
+    fail_if(ipset_intersects(&network, &other),
+            "Network shouldn't overlap other addresses");
+    fail_unless(ipset_intersects(&host, &network),
+                "Host should overlap its network");
+    fail_if(ipset_is_disjoint(&host, &network),
+            "Host should overlap its network");
+    fail_unless(ipset_is_disjoint(&empty, &empty),
+                "Empty set shouldn't overlap anything");
+
+    ipset_complement(&other);
+    fail_unless(ipset_is_subset(&network, &other),
+                "Network should be inside the complement of a "
+                "disjoint set");
+    fail_if(ipset_is_disjoint(&network, &other),
+            "Network should overlap the complement of a disjoint set");
+
+    /*
+     * None of that should have created any nodes.
+     */
+
+    ipset_cache_stats(&stats);
+    fail_unless(stats.node_count == node_count,
+                "Relation tests shouldn't create nodes");
+
+    ipset_done(&empty);
+    ipset_done(&host);
+    ipset_done(&network);
+    ipset_done(&other);
+}
+END_TEST
+
+START_TEST(test_ipv4_count_1)
+{
+    ip_set_t  set;
+    ipset_ip_t  addr;
+    ipset_count_t  count;
+
+    ipset_init(&set);
+    ipset_ipv4_add_network(&set, &IPV4_ADDR_1, 24);
+    ipset_ipv4_add(&set, &IPV4_ADDR_3);
+
+    fail_unless(ipset_ipv4_count(&set) == 257,
+                "Set should contain 257 IPv4 addresses");
+    count = ipset_ipv6_count(&set);
+    fail_unless((count.high == 0) && (count.low == 0),
+                "Set shouldn't contain any IPv6 addresses");
+
+    ipset_ip_from_ipv4(&addr, &IPV4_ADDR_1);
+    count = ipset_count_within(&set, &addr, 16);
+    fail_unless((count.high == 0) && (count.low == 257),
+                "/16 network should contain 257 addresses");
+    count = ipset_count_within(&set, &addr, 24);
+    fail_unless((count.high == 0) && (count.low == 256),
+                "/24 network should contain 256 addresses");
+    count = ipset_count_within(&set, &addr, 32);
+    fail_unless((count.high == 0) && (count.low == 1),
+                "Host should contain 1 address");
+
+    ipset_ip_from_ipv4(&addr, &IPV4_ADDR_3);
+    count = ipset_count_within(&set, &addr, 24);
+    fail_unless((count.high == 0) && (count.low == 1),
+                "Other /24 network should contain 1 address");
+
+    /*
+     * The complement contains every IPv6 address, which is one more
+     * than the count can hold.
+     */
+
+    ipset_complement(&set);
+    fail_unless(ipset_ipv4_count(&set) == G_GUINT64_CONSTANT(4294967039),
+                "Complement should contain 2^32 - 257 IPv4 addresses");
+    count = ipset_ipv6_count(&set);
+    fail_unless((count.high == G_MAXUINT64) && (count.low == G_MAXUINT64),
+                "IPv6 count should saturate");
+
+    ipset_done(&set);
+}
+END_TEST
+
+START_TEST(test_ipv4_nth_1)
+{
+    ip_set_t  set;
+    ipset_ip_t  addr, expected, samples[50];
+    ipset_count_t  index = { 0, 0 };
+    ipset_count_t  rank;
+    GRand  *rng;
+    gsize  i;
+
+    ipset_init(&set);
+    ipset_ipv4_add_network(&set, &IPV4_ADDR_1, 24);
+    ipset_ipv4_add(&set, &IPV4_ADDR_3);
+    ipset_ipv6_add(&set, &IPV6_ADDR_1);
+
+    /*
+     * The /24 network comes first, then the other IPv4 address, and
+     * then the IPv6 address.
+     */
+
+    index.low = 100;
+    fail_unless(ipset_nth(&set, index, &addr),
+                "Should find address #100");
+    ipset_ip_from_ipv4(&expected, &IPV4_ADDR_1);
+    fail_unless(ipset_ip_equal(&addr, &expected),
+                "Address #100 should be 192.168.1.100");
+
+    rank = ipset_rank(&set, &expected);
+    fail_unless((rank.high == 0) && (rank.low == 100),
+                "192.168.1.100 should have rank 100");
+
+    index.low = 256;
+    fail_unless(ipset_nth(&set, index, &addr),
+                "Should find address #256");
+    ipset_ip_from_ipv4(&expected, &IPV4_ADDR_3);
+    fail_unless(ipset_ip_equal(&addr, &expected),
+                "Address #256 should be 192.168.2.100");
+
+    index.low = 257;
+    fail_unless(ipset_nth(&set, index, &addr),
+                "Should find address #257");
+    ipset_ip_from_ipv6(&expected, &IPV6_ADDR_1);
+    fail_unless(ipset_ip_equal(&addr, &expected),
+                "Address #257 should be the IPv6 address");
+
+    rank = ipset_rank(&set, &expected);
+    fail_unless((rank.high == 0) && (rank.low == 257),
+                "IPv6 address should have rank 257");
+
+    index.low = 258;
+    fail_if(ipset_nth(&set, index, &addr),
+            "Shouldn't find address #258");
+
+    /*
+     * Every sample should be an address in the set, which we can
+     * check by finding it again from its rank.
+     */
+
+    rng = g_rand_new_with_seed(1);
+    fail_unless(ipset_sample(&set, rng, 50, samples) == 50,
+                "Should choose 50 samples");
+
+    for (i = 0; i < 50; i++)
+    {
+        rank = ipset_rank(&set, &samples[i]);
+        fail_unless(ipset_nth(&set, rank, &addr) &&
+                    ipset_ip_equal(&addr, &samples[i]),
+                    "Sample %" G_GSIZE_FORMAT " should be in the set", i);
+    }
+
+    g_rand_free(rng);
+    ipset_done(&set);
+}
+END_TEST
+
+START_TEST(test_ipv4_counter_1)
+{
+    ip_set_t  set;
+    ipset_counter_t  *counter;
+    ipset_ip_t  addr, expected;
+    ipset_count_t  index = { 0, 0 };
+    ipset_count_t  rank;
+
+    ipset_init(&set);
+    ipset_ipv4_add_network(&set, &IPV4_ADDR_1, 24);
+    counter = ipset_counter_new(&set);
+
+    index.low = 100;
+    fail_unless(ipset_counter_nth(counter, index, &addr),
+                "Should find address #100");
+    ipset_ip_from_ipv4(&expected, &IPV4_ADDR_1);
+    fail_unless(ipset_ip_equal(&addr, &expected),
+                "Address #100 should be 192.168.1.100");
+
+    rank = ipset_counter_rank(counter, &expected);
+    fail_unless((rank.high == 0) && (rank.low == 100),
+                "192.168.1.100 should have rank 100");
+
+    index.low = 256;
+    fail_if(ipset_counter_nth(counter, index, &addr),
+            "Shouldn't find address #256");
+
+    /*
+     * The counter should notice when the set changes, and when its
+     * nodes move.
+     */
+
+    ipset_ipv4_add(&set, &IPV4_ADDR_3);
+    fail_unless(ipset_counter_nth(counter, index, &addr),
+                "Should find address #256 after adding it");
+    ipset_ip_from_ipv4(&expected, &IPV4_ADDR_3);
+    fail_unless(ipset_ip_equal(&addr, &expected),
+                "Address #256 should be 192.168.2.100");
+
+    ipset_compact(&set);
+    rank = ipset_counter_rank(counter, &expected);
+    fail_unless((rank.high == 0) && (rank.low == 256),
+                "192.168.2.100 should have rank 256 after compacting");
+
+    ipset_counter_free(counter);
+    ipset_done(&set);
+}
+END_TEST
+
+/**
+ * The addresses that one thread adds in test_ipv4_concurrent_add.
+ * The multiplier scatters them across the address space, so that
+ * they share as few nodes as possible.
+ */
+
+#define CONCURRENT_THREAD_COUNT  4
+#define CONCURRENT_ADD_COUNT  2000
+
+typedef struct concurrent_adder
+{
+    ip_set_t  *set;
+    guint32  seed;
+} concurrent_adder_t;
+
+static gpointer
+concurrent_add(gpointer user_data)
+{
+    concurrent_adder_t  *adder = (concurrent_adder_t *) user_data;
+    ipv4_addr_t  addr;
+    guint32  i;
+
+    for (i = 0; i < CONCURRENT_ADD_COUNT; i++)
+    {
+        guint32  value = (adder->seed + i) * 2654435761u;
+
+        addr[0] = value >> 24;
+        addr[1] = value >> 16;
+        addr[2] = value >> 8;
+        addr[3] = value;
+        ipset_ipv4_add(adder->set, &addr);
+    }
+
+    return NULL;
+}
+
+START_TEST(test_ipv4_concurrent_add)
+{
+    ipset_context_t  *ctx;
+    ip_set_t  sets[CONCURRENT_THREAD_COUNT];
+    concurrent_adder_t  adders[CONCURRENT_THREAD_COUNT];
+    GThread  *threads[CONCURRENT_THREAD_COUNT];
+    guint  i;
+
+    /*
+     * Fill up a set in each thread.  The low collection threshold
+     * makes the threads collect garbage out from under each other
+     * while they work.
+     */
+
+    ctx = ipset_context_new_concurrent();
+    fail_if(ctx == NULL, "Cannot create context");
+    ctx->gc_threshold = 1000;
+
+    for (i = 0; i < CONCURRENT_THREAD_COUNT; i++)
+    {
+        ipset_init_in(ctx, &sets[i]);
+        adders[i].set = &sets[i];
+        adders[i].seed = i * CONCURRENT_ADD_COUNT;
+    }
+
+    for (i = 0; i < CONCURRENT_THREAD_COUNT; i++)
+    {
+        threads[i] = g_thread_new
+            ("test-ipset", concurrent_add, &adders[i]);
+    }
+
+    for (i = 0; i < CONCURRENT_THREAD_COUNT; i++)
+    {
+        g_thread_join(threads[i]);
+    }
+
+    fail_if(ipset_context_out_of_memory(ctx),
+            "Concurrent context should never run out of memory");
+
+    /*
+     * Each set should match the same set built on a single thread.
+     */
+
+    for (i = 0; i < CONCURRENT_THREAD_COUNT; i++)
+    {
+        ip_set_t  copy, expected;
+        concurrent_adder_t  adder;
+
+        ipset_init_import(ipset_cache, &copy, &sets[i]);
+
+        ipset_init(&expected);
+        adder.set = &expected;
+        adder.seed = i * CONCURRENT_ADD_COUNT;
+        concurrent_add(&adder);
+
+        fail_unless(ipset_is_equal(&copy, &expected),
+                    "Set %u should match its single-threaded copy", i);
+
+        ipset_done(&copy);
+        ipset_done(&expected);
+    }
+
+    for (i = 0; i < CONCURRENT_THREAD_COUNT; i++)
+    {
+        ipset_done(&sets[i]);
+    }
+
+    ipset_context_free(ctx);
+}
+END_TEST
+
+
+START_TEST(test_ipv4_complement_1)
+{
+    ip_set_t  set1, set2;
+    ip_set_t  *result;
+
+    ipset_init(&set1);
+    ipset_ipv4_add(&set1, &IPV4_ADDR_1);
+    ipset_ipv4_add_network(&set1, &IPV4_ADDR_3, 24);
+
+    result = ipset_complement_new(&set1);
+    fail_unless(ipset_is_not_equal(result, &set1),
+                "Complement should be different");
+    fail_unless(ipset_memory_size(result) == ipset_memory_size(&set1),
+                "Complement should share all of its nodes");
+
+    ipset_init(&set2);
+    ipset_union(&set2, result);
+    ipset_intersect(&set2, &set1);
+    fail_unless(ipset_is_empty(&set2),
+                "Expected x ∩ ¬x == ∅");
+
+    ipset_complement(result);
+    fail_unless(ipset_is_equal(result, &set1),
+                "Expected ¬¬x == x");
+
+    /*
+     * The complement of the empty set isn't empty.
+     */
+
+    ipset_complement(&set2);
+    fail_if(ipset_is_empty(&set2),
+            "Expected ¬∅ != ∅");
+    fail_unless(ipset_ipv4_add(&set2, &IPV4_ADDR_2),
+                "Element should be in complement of ∅");
+
+    ipset_free(result);
+    ipset_done(&set1);
+    ipset_done(&set2);
+}
+END_TEST
+
+
 START_TEST(test_ipv4_store_01)
 {
     ip_set_t  set;
@@ -524,13 +1403,7 @@ START_TEST(test_ipv6_memory_size_1)
     ipset_init(&set);
     ipset_ipv6_add(&set, &IPV6_ADDR_1);
 
-#if GLIB_SIZEOF_VOID_P == 4
     expected = 1548;
-#elif GLIB_SIZEOF_VOID_P == 8
-    expected = 3096;
-#else
-#   error "Unknown architecture: not 32-bit or 64-bit"
-#endif
     actual = ipset_memory_size(&set);
 
     fail_unless(expected == actual,
@@ -549,13 +1422,7 @@ START_TEST(test_ipv6_memory_size_2)
     ipset_init(&set);
     ipset_ipv6_add_network(&set, &IPV6_ADDR_1, 24);
 
-#if GLIB_SIZEOF_VOID_P == 4
     expected = 300;
-#elif GLIB_SIZEOF_VOID_P == 8
-    expected = 600;
-#else
-#   error "Unknown architecture: not 32-bit or 64-bit"
-#endif
     actual = ipset_memory_size(&set);
 
     fail_unless(expected == actual,
@@ -601,6 +1468,43 @@ START_TEST(test_ipv6_store_03)
 }
 END_TEST
 
+START_TEST(test_ipv6_count_1)
+{
+    ip_set_t  set;
+    ipset_ip_t  addr;
+    ipset_count_t  count;
+
+    ipset_init(&set);
+    ipset_ipv6_add_network(&set, &IPV6_ADDR_1, 64);
+    ipset_ipv6_add(&set, &IPV6_ADDR_3);
+
+    fail_unless(ipset_ipv4_count(&set) == 0,
+                "Set shouldn't contain any IPv4 addresses");
+    count = ipset_ipv6_count(&set);
+    fail_unless((count.high == 1) && (count.low == 1),
+                "Set should contain 2^64 + 1 IPv6 addresses");
+
+    ipset_ip_from_ipv6(&addr, &IPV6_ADDR_1);
+    count = ipset_count_within(&set, &addr, 16);
+    fail_unless((count.high == 1) && (count.low == 1),
+                "/16 network should contain 2^64 + 1 addresses");
+    count = ipset_count_within(&set, &addr, 32);
+    fail_unless((count.high == 1) && (count.low == 0),
+                "/32 network should contain 2^64 addresses");
+    count = ipset_count_within(&set, &addr, 129);
+    fail_unless((count.high == 0) && (count.low == 0),
+                "Bad netmask should contain no addresses");
+
+    ipset_complement(&set);
+    count = ipset_ipv6_count(&set);
+    fail_unless((count.high == G_MAXUINT64 - 1) &&
+                (count.low == G_MAXUINT64),
+                "Complement should contain 2^128 - 2^64 - 1 addresses");
+
+    ipset_done(&set);
+}
+END_TEST
+
 
 /*-----------------------------------------------------------------------
  * Testing harness
@@ -632,6 +1536,21 @@ ipset_suite()
     tcase_add_test(tc_ipv4, test_ipv4_store_01);
     tcase_add_test(tc_ipv4, test_ipv4_store_02);
     tcase_add_test(tc_ipv4, test_ipv4_store_03);
+    tcase_add_test(tc_ipv4, test_ipv4_done_releases_nodes);
+    tcase_add_test(tc_ipv4, test_ipv4_collect_garbage);
+    tcase_add_test(tc_ipv4, test_ipv4_context_import);
+    tcase_add_test(tc_ipv4, test_ipv4_memory_limit);
+    tcase_add_test(tc_ipv4, test_ipv4_compact);
+    tcase_add_test(tc_ipv4, test_ipv4_algebra_1);
+    tcase_add_test(tc_ipv4, test_ipv4_union_many_1);
+    tcase_add_test(tc_ipv4, test_ipv4_concurrent_add);
+    tcase_add_test(tc_ipv4, test_ipv4_coarsen_1);
+    tcase_add_test(tc_ipv4, test_ipv4_minimize_1);
+    tcase_add_test(tc_ipv4, test_ipv4_subset_1);
+    tcase_add_test(tc_ipv4, test_ipv4_count_1);
+    tcase_add_test(tc_ipv4, test_ipv4_nth_1);
+    tcase_add_test(tc_ipv4, test_ipv4_counter_1);
+    tcase_add_test(tc_ipv4, test_ipv4_complement_1);
     suite_add_tcase(s, tc_ipv4);
 
     TCase  *tc_ipv6 = tcase_create("ipv6");
@@ -648,6 +1567,7 @@ ipset_suite()
     tcase_add_test(tc_ipv6, test_ipv6_store_01);
     tcase_add_test(tc_ipv6, test_ipv6_store_02);
     tcase_add_test(tc_ipv6, test_ipv6_store_03);
+    tcase_add_test(tc_ipv6, test_ipv6_count_1);
     suite_add_tcase(s, tc_ipv6);
 
     return s;